@@ -39,6 +39,9 @@ volatile flash_res_t g_blank_check_result;
  Private (static) variables
  *********************************************************************************************************************/
 static volatile CommonAPI_Status_t s_Flash_COM_Status = COMAPI_STATE_CLOSE;/* Variables that manage commonAPI status */
+static volatile TaskHandle_t s_flash_waiter = NULL;/* Task notified at the end of the running flash operation */
+
+static void flash_operation_done (BaseType_t * pxHigherPriorityTaskWoken);
 
 /* Function Name: Flash_COM_init */
 /**********************************************************************************************************************
@@ -307,6 +310,45 @@ e_commonapi_err_t R_Demo_Common_API_Flash_Close(void)
  End of function R_Demo_Common_API_Flash_Close
  *********************************************************************************************************************/
 
+/* Function Name: R_Demo_Common_API_Flash_SetWaiter */
+/**********************************************************************************************************************
+ * @brief Registers the task to be notified when the flash operation about to be started completes.
+ *        The caller must hold xSemaphoreFlashAccess, which then stays taken until the caller gives it back.
+ *        While no task is registered, the completion gives xSemaphoreFlashAccess instead.
+ * @param[in] xTask  Task to notify on COMMONAPI_FLASH_NOTIFY_IDX, or NULL to unregister.
+ * @return void
+ *********************************************************************************************************************/
+void R_Demo_Common_API_Flash_SetWaiter(TaskHandle_t xTask)
+{
+    s_flash_waiter = xTask;
+}
+/**********************************************************************************************************************
+ End of function R_Demo_Common_API_Flash_SetWaiter
+ *********************************************************************************************************************/
+
+/* Function Name: flash_operation_done */
+/**********************************************************************************************************************
+ * @brief Reports the end of a flash operation to the registered task, or releases xSemaphoreFlashAccess.
+ * @param[out] pxHigherPriorityTaskWoken
+ * @return void
+ *********************************************************************************************************************/
+static void flash_operation_done(BaseType_t * pxHigherPriorityTaskWoken)
+{
+    TaskHandle_t xWaiter = s_flash_waiter;
+
+    if (NULL != xWaiter)
+    {
+        vTaskNotifyGiveIndexedFromISR(xWaiter, COMMONAPI_FLASH_NOTIFY_IDX, pxHigherPriorityTaskWoken);
+    }
+    else
+    {
+        xSemaphoreGiveFromISR(xSemaphoreFlashAccess, pxHigherPriorityTaskWoken);
+    }
+}
+/**********************************************************************************************************************
+ End of function flash_operation_done
+ *********************************************************************************************************************/
+
 /* Function Name: flashing_callback */
 /**********************************************************************************************************************
  * @brief Callback function for Flash. This function is called from Renesas API's interrupt service routine.
@@ -318,7 +360,7 @@ void flashing_callback(void *event)
     uint32_t event_code;
     event_code = *((uint32_t*)event);
 
-    static portBASE_TYPE xHigherPriorityTaskWoken;
+    portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
 
     switch (event_code)
     {
@@ -326,39 +368,39 @@ void flashing_callback(void *event)
             if (DATA_FLASH_UPDATE_STATE_ERASE_WAIT_COMPLETE == update_data_flash_control_block.status)
             {
                 update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_FINALIZE;
-                xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+                flash_operation_done(&xHigherPriorityTaskWoken);
                 portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
             }
             else
             {
                 update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_ERROR;
-                xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+                flash_operation_done(&xHigherPriorityTaskWoken);
             }
             break;
         case FLASH_INT_EVENT_WRITE_COMPLETE:
             if (DATA_FLASH_UPDATE_STATE_WRITE_WAIT_COMPLETE == update_data_flash_control_block.status)
             {
                 update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_FINALIZE;
-                xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+                flash_operation_done(&xHigherPriorityTaskWoken);
                 portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
             }
             else
             {
                 update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_ERROR;
-                xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+                flash_operation_done(&xHigherPriorityTaskWoken);
             }
             break;
         case FLASH_INT_EVENT_BLANK:
             g_blank_check_result = FLASH_RES_BLANK;
-            xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+            flash_operation_done(&xHigherPriorityTaskWoken);
             break;
         case FLASH_INT_EVENT_NOT_BLANK:
             g_blank_check_result = FLASH_RES_NOT_BLANK;
-            xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+            flash_operation_done(&xHigherPriorityTaskWoken);
             break;
         default:
             update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_ERROR;
-            xSemaphoreGiveFromISR(xSemaphoreFlashAccess, &xHigherPriorityTaskWoken);
+            flash_operation_done(&xHigherPriorityTaskWoken);
             break;
     }
 }
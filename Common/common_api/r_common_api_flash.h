@@ -15,6 +15,7 @@
 #include "FreeRTOS.h"
 #include "queue.h"
 #include "semphr.h"
+#include "task.h"
 #include "r_common_api.h"
 #include "r_flash_rx_if.h"
 
@@ -31,6 +32,10 @@
 #define DATA_FLASH_UPDATE_STATE_ERROR               (103)
 #define DATA_FLASH_UPDATE_STATE_UNINITIALIZE        (0xFF)
 
+/* Index of the task notification used to report the end of a flash operation
+ * to the task registered with R_Demo_Common_API_Flash_SetWaiter. */
+#define COMMONAPI_FLASH_NOTIFY_IDX                  (1U)
+
 typedef struct _update_data_flash_control_block
 {
     uint32_t status;
@@ -59,6 +64,14 @@ e_commonapi_err_t R_Demo_Common_API_Flash_Open (void);
  *********************************************************************************************************************/
 e_commonapi_err_t R_Demo_Common_API_Flash_Close (void);
 
+/* Function Name: R_Demo_Common_API_Flash_SetWaiter */
+/**********************************************************************************************************************
+ * @brief Registers the task to be notified on COMMONAPI_FLASH_NOTIFY_IDX when the next flash operation completes.
+ * @param[in] TaskHandle_t xTask
+ * @return void
+ *********************************************************************************************************************/
+void R_Demo_Common_API_Flash_SetWaiter (TaskHandle_t xTask);
+
 /* Function Name: flashing_callback */
 /**********************************************************************************************************************
  * @brief Callback function which is called from Renesas API's interrupt service routine.
@@ -13,6 +13,8 @@
 /**********************************************************************************************************************
  Includes   <System Includes> , "Project Includes"
  *********************************************************************************************************************/
+#include "FreeRTOS.h"
+#include "semphr.h"
 #include "lfs_common_data.h"
 #include "rm_littlefs_flash_config.h"
 
@@ -54,10 +56,57 @@ const struct lfs_config g_rm_littlefs0_lfs_cfg =
 const rm_littlefs_cfg_t g_rm_littlefs0_cfg =
 { .p_lfs_cfg = &g_rm_littlefs0_lfs_cfg };
 
+/* File holding the flash wear record across reboots. Its size identifies the layout, so a record saved for a
+ * different LFS_FLASH_BLOCK_COUNT is ignored. */
+#define LFS_WEAR_FILE_NAME    "flash_wear"
+
 /* Instance structure to use this module. */
 const rm_littlefs_instance_t g_rm_littlefs0 =
 { .p_ctrl = &g_rm_littlefs0_ctrl, .p_cfg = &g_rm_littlefs0_cfg, .p_api = &g_rm_littlefs_on_flash, };
 
+/* Lock serializing all access to g_rm_littlefs0_lfs, see littlFs_lock(). */
+static StaticSemaphore_t s_lfs_mutex_buffer;
+static SemaphoreHandle_t s_lfs_mutex = NULL;
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_lock
+ * Description  : Takes the file system lock. LittleFS is built without LFS_THREADSAFE, so every task must hold this
+ *                lock around its lfs_*() calls on g_rm_littlefs0_lfs. The lock is recursive, so a function holding it
+ *                may call another function that takes it. It is created on first use because tasks may reach the
+ *                file system before littlFs_init() runs.
+ * Return Value : none
+ *********************************************************************************************************************/
+void littlFs_lock(void)
+{
+    if (NULL == s_lfs_mutex)
+    {
+        taskENTER_CRITICAL();
+        if (NULL == s_lfs_mutex)
+        {
+            s_lfs_mutex = xSemaphoreCreateRecursiveMutexStatic(&s_lfs_mutex_buffer);
+        }
+        taskEXIT_CRITICAL();
+    }
+
+    (void) xSemaphoreTakeRecursive(s_lfs_mutex, portMAX_DELAY);
+}
+/*****************************************************************************************
+End of function littlFs_lock
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_unlock
+ * Description  : Releases the file system lock taken by littlFs_lock().
+ * Return Value : none
+ *********************************************************************************************************************/
+void littlFs_unlock(void)
+{
+    (void) xSemaphoreGiveRecursive(s_lfs_mutex);
+}
+/*****************************************************************************************
+End of function littlFs_unlock
+****************************************************************************************/
+
 /**********************************************************************************************************************
  * Function Name: littlFs_init
  * Description  : .
@@ -66,6 +115,8 @@ const rm_littlefs_instance_t g_rm_littlefs0 =
 int32_t littlFs_init(void)
 {
     int32_t err;
+
+    littlFs_lock();
     RM_LITTLEFS_FLASH_Open(g_rm_littlefs0.p_ctrl, g_rm_littlefs0.p_cfg);
     err = lfs_mount(&g_rm_littlefs0_lfs, &g_rm_littlefs0_lfs_cfg);
 
@@ -77,6 +128,13 @@ int32_t littlFs_init(void)
             err = lfs_mount(&g_rm_littlefs0_lfs, &g_rm_littlefs0_lfs_cfg);
         }
     }
+
+    if (LFS_ERR_OK == err)
+    {
+        /* No record yet on a new or reformatted file system. */
+        (void) littlFs_wear_load();
+    }
+    littlFs_unlock();
     return err;
 
 }
@@ -92,14 +150,92 @@ End of function littlFs_init
 int32_t littlFs_format(void)
 {
     int32_t err;
+
+    littlFs_lock();
     RM_LITTLEFS_FLASH_Open(g_rm_littlefs0.p_ctrl, g_rm_littlefs0.p_cfg);
     err = lfs_format(&g_rm_littlefs0_lfs, &g_rm_littlefs0_lfs_cfg);
     if (LFS_ERR_OK == err)
     {
         err = lfs_mount(&g_rm_littlefs0_lfs, &g_rm_littlefs0_lfs_cfg);
     }
+    littlFs_unlock();
     return err;
 }
 /*****************************************************************************************
 End of function littlFs_format
 ****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_wear_load
+ * Description  : Adds the flash wear record saved by littlFs_wear_save() to the counters of the instance.
+ * Return Value : LFS_ERR_OK on success, LFS_ERR_CORRUPT if the record has an unexpected size, or a LittleFS error.
+ *********************************************************************************************************************/
+int32_t littlFs_wear_load(void)
+{
+    static rm_littlefs_flash_wear_t wear;
+    lfs_file_t file;
+    lfs_ssize_t lfs_ret;
+
+    littlFs_lock();
+    lfs_ret = lfs_file_open(&g_rm_littlefs0_lfs, &file, LFS_WEAR_FILE_NAME, LFS_O_RDONLY);
+    if (LFS_ERR_OK != lfs_ret)
+    {
+        littlFs_unlock();
+        return lfs_ret;
+    }
+
+    lfs_ret = lfs_file_read(&g_rm_littlefs0_lfs, &file, &wear, sizeof(wear));
+    (void) lfs_file_close(&g_rm_littlefs0_lfs, &file);
+    littlFs_unlock();
+
+    if ((lfs_ssize_t) sizeof(wear) != lfs_ret)
+    {
+        return (lfs_ret < 0) ? lfs_ret : LFS_ERR_CORRUPT;
+    }
+
+    RM_LITTLEFS_FLASH_WearSet(g_rm_littlefs0.p_ctrl, &wear);
+    return LFS_ERR_OK;
+}
+/*****************************************************************************************
+End of function littlFs_wear_load
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_wear_save
+ * Description  : Saves the flash wear record of the instance so that the counters survive a reboot.
+ *                Saving programs the flash itself, so call it after batches of writes rather than after each one.
+ * Return Value : LFS_ERR_OK on success or a LittleFS error.
+ *********************************************************************************************************************/
+int32_t littlFs_wear_save(void)
+{
+    static rm_littlefs_flash_wear_t wear;
+    lfs_file_t file;
+    lfs_ssize_t lfs_ret;
+
+    RM_LITTLEFS_FLASH_WearGet(g_rm_littlefs0.p_ctrl, &wear);
+
+    littlFs_lock();
+    lfs_ret = lfs_file_open(&g_rm_littlefs0_lfs, &file, LFS_WEAR_FILE_NAME, LFS_O_WRONLY | LFS_O_TRUNC | LFS_O_CREAT);
+    if (LFS_ERR_OK != lfs_ret)
+    {
+        littlFs_unlock();
+        return lfs_ret;
+    }
+
+    lfs_ret = lfs_file_write(&g_rm_littlefs0_lfs, &file, &wear, sizeof(wear));
+    if (lfs_ret >= 0)
+    {
+        /* The record is written on close. */
+        lfs_ret = lfs_file_close(&g_rm_littlefs0_lfs, &file);
+    }
+    else
+    {
+        (void) lfs_file_close(&g_rm_littlefs0_lfs, &file);
+    }
+    littlFs_unlock();
+
+    return lfs_ret;
+}
+/*****************************************************************************************
+End of function littlFs_wear_save
+****************************************************************************************/
@@ -52,6 +52,20 @@ extern struct lfs g_rm_littlefs0_lfs;
 extern const struct lfs_config g_rm_littlefs0_lfs_cfg;
 extern lfs_t g_lfs;
 
+/**********************************************************************************************************************
+ * Function Name: littlFs_lock
+ * Description  : Takes the file system lock. Hold it around every lfs_*() call on g_rm_littlefs0_lfs.
+ * Return Value : none
+ *********************************************************************************************************************/
+void littlFs_lock (void);
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_unlock
+ * Description  : Releases the file system lock taken by littlFs_lock().
+ * Return Value : none
+ *********************************************************************************************************************/
+void littlFs_unlock (void);
+
 /**********************************************************************************************************************
  * Function Name: littlFs_init
  * Description  : .
@@ -66,6 +80,20 @@ int32_t littlFs_init (void);
  *********************************************************************************************************************/
 int32_t littlFs_format (void);
 
+/**********************************************************************************************************************
+ * Function Name: littlFs_wear_load
+ * Description  : Adds the flash wear record saved by littlFs_wear_save() to the counters of the instance.
+ * Return Value : LFS_ERR_OK on success, LFS_ERR_CORRUPT if the record has an unexpected size, or a LittleFS error.
+ *********************************************************************************************************************/
+int32_t littlFs_wear_load (void);
+
+/**********************************************************************************************************************
+ * Function Name: littlFs_wear_save
+ * Description  : Saves the flash wear record of the instance so that the counters survive a reboot.
+ * Return Value : LFS_ERR_OK on success or a LittleFS error.
+ *********************************************************************************************************************/
+int32_t littlFs_wear_save (void);
+
 /**********************************************************************************************************************
  * Function Name: g_common_init
  * Description  : .
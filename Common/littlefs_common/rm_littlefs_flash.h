@@ -46,11 +46,29 @@ FSP_HEADER
 /***********************************************************************************************************************
  * Typedef definitions
  **********************************************************************************************************************/
+/** Flash usage counters of an instance, see RM_LITTLEFS_FLASH_StatsGet(). */
+typedef struct st_rm_littlefs_flash_stats
+{
+    uint32_t erase_requests;           ///< Number of erases requested by LittleFS
+    uint32_t erases_skipped;           ///< Requests served without erasing because the block was already erased
+} rm_littlefs_flash_stats_t;
+
+/** Lifetime wear record of an instance, see RM_LITTLEFS_FLASH_WearGet() and RM_LITTLEFS_FLASH_WearSet(). */
+typedef struct st_rm_littlefs_flash_wear
+{
+    uint32_t erase_count[LFS_FLASH_BLOCK_COUNT]; ///< Erases performed on each block
+    uint32_t bytes_programmed;                   ///< Bytes programmed to the flash by LittleFS
+    uint32_t file_bytes_written;                 ///< File data written through LittleFS, see RM_LITTLEFS_FLASH_FileBytesAdd()
+} rm_littlefs_flash_wear_t;
+
 /** Instance control block.  This is private to the FSP and should not be used or modified by the application. */
 typedef struct st_rm_littlefs_flash_instance_ctrl
 {
     uint32_t                  open;
     rm_littlefs_cfg_t const * p_cfg;
+    uint32_t                  erased_blocks[(LFS_FLASH_BLOCK_COUNT + 31) / 32]; ///< Blocks erased and not written since
+    rm_littlefs_flash_stats_t stats;
+    rm_littlefs_flash_wear_t  wear;    ///< Not cleared by open so that it survives a format
 #if LFS_THREAD_SAFE
     SemaphoreHandle_t         xSemaphore;
     StaticSemaphore_t         xMutexBuffer;
@@ -93,6 +111,42 @@ fsp_err_t RM_LITTLEFS_FLASH_Open (rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs
  *********************************************************************************************************************/
 fsp_err_t RM_LITTLEFS_FLASH_Close (rm_littlefs_ctrl_t * const p_ctrl);
 
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_StatsGet
+ * Description  : Returns the flash usage counters of the instance.
+ * Arguments    : p_ctrl
+ *              : p_stats
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_StatsGet (rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_stats_t * const p_stats);
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_WearGet
+ * Description  : Returns the lifetime wear record of the instance.
+ * Arguments    : p_ctrl
+ *              : p_wear
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_WearGet (rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_wear_t * const p_wear);
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_WearSet
+ * Description  : Restores a wear record saved by a previous boot. Wear counted since open is added to it.
+ * Arguments    : p_ctrl
+ *              : p_wear
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_WearSet (rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_wear_t const * const p_wear);
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_FileBytesAdd
+ * Description  : Counts file data written through LittleFS, the reference for write amplification.
+ * Arguments    : p_ctrl
+ *              : bytes
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_FileBytesAdd (rm_littlefs_ctrl_t * const p_ctrl, uint32_t bytes);
+
 /**********************************************************************************************************************
  * Function Name: rm_littlefs_flash_read
  * Description  : Read from the flash driver. Negative error codes are propogated to the user.
@@ -40,6 +40,17 @@
  **********************************************************************************************************************/
 #define ETHER_BUFSIZE_MIN    60
 
+/* Maximum number of received frames passed to the IP task in one event when
+ * ipconfigUSE_LINKED_RX_MESSAGES is enabled. A chain holds one network buffer
+ * per frame, so the default leaves one buffer of the pool to the IP task. */
+#ifndef ETHER_RX_BATCH_MAX
+    #if ( ipconfigNUM_NETWORK_BUFFER_DESCRIPTORS > 1 )
+        #define ETHER_RX_BATCH_MAX    ( ipconfigNUM_NETWORK_BUFFER_DESCRIPTORS - 1 )
+    #else
+        #define ETHER_RX_BATCH_MAX    ( 1 )
+    #endif
+#endif
+
 #if defined( BSP_MCU_RX65N ) || defined( BSP_MCU_RX64M ) || defined( BSP_MCU_RX71M ) || defined( BSP_MCU_RX72M ) || defined( BSP_MCU_RX72N )
     #if ETHER_CFG_MODE_SEL == 0
         #define R_ETHER_PinSet_CHANNEL_0()    R_ETHER_PinSet_ETHERC0_MII()
@@ -70,6 +81,23 @@ static BaseType_t xPHYLinkStatus;
 static BaseType_t xReportedStatus;
 static eMAC_INIT_STATUS_TYPE xMacInitStatus = eMACInit;
 
+/* Transmit counters, kept for inspection with a debugger. */
+static struct
+{
+    uint32_t ulFramesSent; /* Frames handed to the EDMAC. */
+    uint32_t ulBytesSent;  /* Bytes handed to the EDMAC, including padding. */
+    uint32_t ulRingFull;   /* Times no TX descriptor was free on entry. */
+    uint32_t ulErrors;     /* Frames that could not be queued. */
+} xTxStats;
+
+/* Receive counters, kept for inspection with a debugger. */
+static struct
+{
+    uint32_t ulFramesPassed;   /* Frames handed to the IP task. */
+    uint32_t ulFramesFiltered; /* Frames dropped before a network buffer was taken. */
+    uint32_t ulEventsPosted;   /* eNetworkRxEvent messages sent to the IP task. */
+} xRxStats;
+
 /* Pointer to the interface object of this NIC */
 static NetworkInterface_t * pxMyInterface = NULL;
 
@@ -77,6 +105,8 @@ static int16_t SendData( uint8_t * pucBuffer,
                          size_t length );
 static int InitializeNetwork( void );
 static void prvEMACDeferredInterruptHandlerTask( void * pvParameters );
+static void prvPassToIPTask( NetworkBufferDescriptor_t * pxDescriptor,
+                             UBaseType_t uxCount );
 static void clear_all_ether_rx_discriptors( uint32_t event );
 
 int32_t callback_ether_regist( void );
@@ -239,15 +269,19 @@ BaseType_t xRX_NetworkInterfaceOutput( NetworkInterface_t * pxInterface,
 static void prvEMACDeferredInterruptHandlerTask( void * pvParameters )
 {
     NetworkBufferDescriptor_t * pxBufferDescriptor;
+    NetworkEndPoint_t * pxEndPoint;
     int32_t xBytesReceived = 0;
 
+    #if ( ipconfigUSE_LINKED_RX_MESSAGES != 0 )
+        /* Frames read from the ring but not yet passed to the IP task. */
+        NetworkBufferDescriptor_t * pxFirstDescriptor = NULL;
+        NetworkBufferDescriptor_t * pxLastDescriptor = NULL;
+        UBaseType_t uxBatchCount = 0;
+    #endif
+
     /* Avoid compiler warning about unreferenced parameter. */
     ( void ) pvParameters;
 
-    /* Used to indicate that xSendEventStructToIPTask() is being called because
-     * of an Ethernet receive event. */
-    IPStackEvent_t xRxEvent;
-
     uint8_t * buffer_pointer;
 
     /* Some variables related to monitoring the PHY. */
@@ -273,10 +307,11 @@ static void prvEMACDeferredInterruptHandlerTask( void * pvParameters )
         #endif /* ( ipconfigHAS_PRINTF != 0 ) */
 
         /* Wait for the Ethernet MAC interrupt to indicate that another packet
-         * has been received.  */
+         * has been received.  The ring is drained completely after every wake
+         * up, so all notifications given meanwhile are cleared at once. */
         if( xBytesReceived <= 0 )
         {
-            ulTaskNotifyTake( pdFALSE, ulMaxBlockTime );
+            ulTaskNotifyTake( pdTRUE, ulMaxBlockTime );
         }
 
         /* See how much data was received.  */
@@ -289,78 +324,96 @@ static void prvEMACDeferredInterruptHandlerTask( void * pvParameters )
         }
         else if( xBytesReceived > 0 )
         {
-            /* Allocate a network buffer descriptor that points to a buffer
-             * large enough to hold the received frame.  As this is the simple
-             * rather than efficient example the received data will just be copied
-             * into this buffer. */
-            pxBufferDescriptor = pxGetNetworkBufferWithDescriptor( ( size_t ) xBytesReceived, 0 );
+            /* Decide whether the frame is wanted while it is still in the
+             * driver's buffer, so that frames for other hosts or for no known
+             * end-point do not cost a network buffer and a copy. */
+            pxEndPoint = FreeRTOS_MatchingEndpoint( pxMyInterface, buffer_pointer );
 
-            if( pxBufferDescriptor != NULL )
+            if( ( eConsiderFrameForProcessing( buffer_pointer ) != eProcessBuffer ) || ( pxEndPoint == NULL ) )
             {
-                /* pxBufferDescriptor->pucEthernetBuffer now points to an Ethernet
-                 * buffer large enough to hold the received data.  Copy the
-                 * received data into pcNetworkBuffer->pucEthernetBuffer.  Here it
-                 * is assumed ReceiveData() is a peripheral driver function that
-                 * copies the received data into a buffer passed in as the function's
-                 * parameter.  Remember! While is is a simple robust technique -
-                 * it is not efficient.  An example that uses a zero copy technique
-                 * is provided further down this page. */
-                memcpy( pxBufferDescriptor->pucEthernetBuffer, buffer_pointer, ( size_t ) xBytesReceived );
-                /*ReceiveData( pxBufferDescriptor->pucEthernetBuffer ); */
-
-                /* Set the actual packet length, in case a larger buffer was returned. */
-                pxBufferDescriptor->xDataLength = ( size_t ) xBytesReceived;
-                pxBufferDescriptor->pxInterface = pxMyInterface;
-                pxBufferDescriptor->pxEndPoint = FreeRTOS_MatchingEndpoint( pxMyInterface, pxBufferDescriptor->pucEthernetBuffer );
-
+                /* The Ethernet frame can be dropped, and the driver buffer
+                 * returned to the EDMAC straight away. */
                 R_ETHER_Read_ZC2_BufRelease( ETHER_CHANNEL_0 );
+                xRxStats.ulFramesFiltered++;
+            }
+            else
+            {
+                /* Allocate a network buffer descriptor that points to a buffer
+                 * large enough to hold the received frame.  The EDMAC descriptor
+                 * ring is owned by the r_ether_rx driver, so the frame is copied
+                 * out and the driver buffer is given back to the ring at once. */
+                pxBufferDescriptor = pxGetNetworkBufferWithDescriptor( ( size_t ) xBytesReceived, 0 );
 
-                /* See if the data contained in the received Ethernet frame needs
-                * to be processed.  NOTE! It is preferable to do this in
-                * the interrupt service routine itself, which would remove the need
-                * to unblock this task for packets that don't need processing. */
-                if( ( eConsiderFrameForProcessing( pxBufferDescriptor->pucEthernetBuffer ) == eProcessBuffer ) && ( pxBufferDescriptor->pxEndPoint != NULL ) )
+                #if ( ipconfigUSE_LINKED_RX_MESSAGES != 0 )
                 {
-                    /* The event about to be sent to the TCP/IP is an Rx event. */
-                    xRxEvent.eEventType = eNetworkRxEvent;
+                    if( ( pxBufferDescriptor == NULL ) && ( pxFirstDescriptor != NULL ) )
+                    {
+                        /* The pending batch holds the free buffers.  Hand it over
+                         * and give the IP task a moment to release some. */
+                        prvPassToIPTask( pxFirstDescriptor, uxBatchCount );
+                        pxFirstDescriptor = NULL;
+                        uxBatchCount = 0;
+                        pxBufferDescriptor = pxGetNetworkBufferWithDescriptor( ( size_t ) xBytesReceived, pdMS_TO_TICKS( 2U ) );
+                    }
+                }
+                #endif /* ipconfigUSE_LINKED_RX_MESSAGES */
 
-                    /* pvData is used to point to the network buffer descriptor that
-                     * now references the received data. */
-                    xRxEvent.pvData = ( void * ) pxBufferDescriptor;
+                if( pxBufferDescriptor != NULL )
+                {
+                    memcpy( pxBufferDescriptor->pucEthernetBuffer, buffer_pointer, ( size_t ) xBytesReceived );
 
-                    /* Send the data to the TCP/IP stack. */
-                    if( xSendEventStructToIPTask( &xRxEvent, 0 ) == pdFALSE )
-                    {
-                        /* The buffer could not be sent to the IP task so the buffer must be released. */
-                        vReleaseNetworkBufferAndDescriptor( pxBufferDescriptor );
+                    /* Set the actual packet length, in case a larger buffer was returned. */
+                    pxBufferDescriptor->xDataLength = ( size_t ) xBytesReceived;
+                    pxBufferDescriptor->pxInterface = pxMyInterface;
+                    pxBufferDescriptor->pxEndPoint = pxEndPoint;
+
+                    R_ETHER_Read_ZC2_BufRelease( ETHER_CHANNEL_0 );
 
-                        /* Make a call to the standard trace macro to log the occurrence. */
-                        iptraceETHERNET_RX_EVENT_LOST();
-                        clear_all_ether_rx_discriptors( 0 );
+                    #if ( ipconfigUSE_LINKED_RX_MESSAGES != 0 )
+                    {
+                        /* Chain the frame, the batch is passed on once the ring
+                         * is empty or ETHER_RX_BATCH_MAX frames are collected. */
+                        pxBufferDescriptor->pxNextBuffer = NULL;
+
+                        if( pxFirstDescriptor == NULL )
+                        {
+                            pxFirstDescriptor = pxBufferDescriptor;
+                        }
+                        else
+                        {
+                            pxLastDescriptor->pxNextBuffer = pxBufferDescriptor;
+                        }
+
+                        pxLastDescriptor = pxBufferDescriptor;
+                        uxBatchCount++;
                     }
-                    else
+                    #else
                     {
-                        /* The message was successfully sent to the TCP/IP stack.
-                        * Call the standard trace macro to log the occurrence. */
-                        iptraceNETWORK_INTERFACE_RECEIVE();
-                        R_BSP_NOP();
+                        prvPassToIPTask( pxBufferDescriptor, 1U );
                     }
+                    #endif /* ipconfigUSE_LINKED_RX_MESSAGES */
                 }
                 else
                 {
-                    /* The Ethernet frame can be dropped, but the Ethernet buffer must be released. */
-                    vReleaseNetworkBufferAndDescriptor( pxBufferDescriptor );
+                    /* The event was lost because a network buffer was not available.
+                     * Call the standard trace macro to log the occurrence. */
+                    iptraceETHERNET_RX_EVENT_LOST();
+                    clear_all_ether_rx_discriptors( 1 );
+                    FreeRTOS_printf( ( "R_ETHER_Read_ZC2: Cleared descriptors\n" ) );
                 }
             }
-            else
+        }
+
+        #if ( ipconfigUSE_LINKED_RX_MESSAGES != 0 )
+        {
+            if( ( pxFirstDescriptor != NULL ) && ( ( xBytesReceived <= 0 ) || ( uxBatchCount >= ETHER_RX_BATCH_MAX ) ) )
             {
-                /* The event was lost because a network buffer was not available.
-                 * Call the standard trace macro to log the occurrence. */
-                iptraceETHERNET_RX_EVENT_LOST();
-                clear_all_ether_rx_discriptors( 1 );
-                FreeRTOS_printf( ( "R_ETHER_Read_ZC2: Cleared descriptors\n" ) );
+                prvPassToIPTask( pxFirstDescriptor, uxBatchCount );
+                pxFirstDescriptor = NULL;
+                uxBatchCount = 0;
             }
         }
+        #endif /* ipconfigUSE_LINKED_RX_MESSAGES */
 
         if( xBytesReceived > 0 )
         {
@@ -402,6 +455,60 @@ static void prvEMACDeferredInterruptHandlerTask( void * pvParameters )
 } /* End of function prvEMACDeferredInterruptHandlerTask() */
 
 
+/***********************************************************************************************************************
+ * Function Name: prvPassToIPTask ()
+ * Description  : Sends one eNetworkRxEvent for a received frame, or for a chain of frames linked through
+ *                pxNextBuffer, and releases the frames if the IP task queue is full.
+ * Arguments    : pxDescriptor, uxCount
+ * Return Value : none
+ **********************************************************************************************************************/
+static void prvPassToIPTask( NetworkBufferDescriptor_t * pxDescriptor,
+                             UBaseType_t uxCount )
+{
+    NetworkBufferDescriptor_t * pxNext;
+
+    /* Used to indicate that xSendEventStructToIPTask() is being called because
+     * of an Ethernet receive event. */
+    IPStackEvent_t xRxEvent;
+
+    /* The event about to be sent to the TCP/IP is an Rx event. */
+    xRxEvent.eEventType = eNetworkRxEvent;
+
+    /* pvData is used to point to the network buffer descriptor that
+     * now references the received data. */
+    xRxEvent.pvData = ( void * ) pxDescriptor;
+
+    /* Send the data to the TCP/IP stack. */
+    if( xSendEventStructToIPTask( &xRxEvent, 0 ) == pdFALSE )
+    {
+        /* The buffers could not be sent to the IP task so they must be released. */
+        while( pxDescriptor != NULL )
+        {
+            #if ( ipconfigUSE_LINKED_RX_MESSAGES != 0 )
+                pxNext = pxDescriptor->pxNextBuffer;
+            #else
+                pxNext = NULL;
+            #endif
+            vReleaseNetworkBufferAndDescriptor( pxDescriptor );
+            pxDescriptor = pxNext;
+
+            /* Make a call to the standard trace macro to log the occurrence. */
+            iptraceETHERNET_RX_EVENT_LOST();
+        }
+
+        clear_all_ether_rx_discriptors( 0 );
+    }
+    else
+    {
+        /* The message was successfully sent to the TCP/IP stack.
+        * Call the standard trace macro to log the occurrence. */
+        iptraceNETWORK_INTERFACE_RECEIVE();
+        xRxStats.ulEventsPosted++;
+        xRxStats.ulFramesPassed += ( uint32_t ) uxCount;
+    }
+} /* End of function prvPassToIPTask() */
+
+
 /***********************************************************************************************************************
  * Function Name: vNetworkInterfaceAllocateRAMToBuffers ()
  * Description  : .
@@ -521,15 +628,29 @@ static int16_t SendData( uint8_t * pucBuffer,
     uint8_t * pwrite_buffer;
     uint16_t write_buf_size;
 
-    /* (1) Retrieve the transmit buffer location controlled by the  descriptor. */
+    /* (1) Retrieve the transmit buffer location controlled by the  descriptor.
+     * ETHER_ERR_TACT means the next descriptor of the TX ring is still owned by
+     * the EDMAC, i.e. every descriptor holds a frame not yet sent. Wait for the
+     * EDMAC to hand it back and try once more. */
     ret = R_ETHER_Write_ZC2_GetBuf( ETHER_CHANNEL_0, ( void ** ) &pwrite_buffer, &write_buf_size );
 
+    if( ETHER_ERR_TACT == ret )
+    {
+        xTxStats.ulRingFull++;
+        ( void ) R_ETHER_CheckWrite( ETHER_CHANNEL_0 );
+        ret = R_ETHER_Write_ZC2_GetBuf( ETHER_CHANNEL_0, ( void ** ) &pwrite_buffer, &write_buf_size );
+    }
+
+    if( ( ETHER_SUCCESS == ret ) && ( write_buf_size < length ) )
+    {
+        /* The frame does not fit, do not hand a stale buffer to the EDMAC. */
+        ret = ETHER_ERR_INVALID_DATA;
+    }
+
     if( ETHER_SUCCESS == ret )
     {
-        if( write_buf_size >= length )
-        {
-            memcpy( pwrite_buffer, pucBuffer, length );
-        }
+        /* (2) Fill the buffer while the previous frame may still be on the wire. */
+        memcpy( pwrite_buffer, pucBuffer, length );
 
         if( length < ETHER_BUFSIZE_MIN )                                             /*under minimum*/
         {
@@ -537,16 +658,23 @@ static int16_t SendData( uint8_t * pucBuffer,
             length = ETHER_BUFSIZE_MIN;                                              /*resize*/
         }
 
+        /* (3) Wait for the previous frame to complete before activating this one,
+         * so that R_ETHER_Write_ZC2_SetBuf() always finds the EDMAC stopped and
+         * restarts it. The frame itself is not waited for here. */
+        ( void ) R_ETHER_CheckWrite( ETHER_CHANNEL_0 );
         ret = R_ETHER_Write_ZC2_SetBuf( ETHER_CHANNEL_0, ( uint16_t ) length );
-        ret = R_ETHER_CheckWrite( ETHER_CHANNEL_0 );
     }
 
     if( ETHER_SUCCESS != ret )
     {
+        xTxStats.ulErrors++;
+        FreeRTOS_debug_printf( ( "SendData: rc = %d, %u errors\n", ( int ) ret, ( unsigned ) xTxStats.ulErrors ) );
         return -5; /* XXX return meaningful value */
     }
     else
     {
+        xTxStats.ulFramesSent++;
+        xTxStats.ulBytesSent += length;
         return 0;
     }
 } /* End of function SendData() */
@@ -42,6 +42,8 @@
 #include "platform.h"
 #include "r_fwup_if.h"
 #include "r_fwup_private.h"
+#include "r_fwup_wrap_verify.h"
+#include "r_fwup_wrap_flash.h"
 #include "./src/targets/rx65n/r_flash_rx65n.h"
 #include "mbedtls/ecdsa.h"
 #include "mbedtls/asn1.h"
@@ -50,6 +52,11 @@
 #define MAX_LENGTH      (32)
 #define MAX_SIG_LENGTH  (64)
 #define HALF_SIG_LENGTH (MAX_SIG_LENGTH/2)
+#define HASH_LENGTH     (32)
+
+#if OTA_PAL_PROGRAM_UNIT_SIZE != FLASH_CF_MIN_PGM_SIZE
+#error "OTA_PAL_PROGRAM_UNIT_SIZE must match FLASH_CF_MIN_PGM_SIZE."
+#endif
 
 const char OTA_JsonFileSignatureKey[OTA_FILE_SIG_KEY_STR_MAX_LENGTH] = "sig-sha256-ecdsa";
 static OtaImageState_t OtaImageState;
@@ -59,7 +66,23 @@ uint8_t * first_ota_blocks[mqttFileDownloader_MAX_NUM_BLOCKS_REQUEST];
 
 AfrOtaJobDocumentFields_t * pOTAFileContext = NULL;
 
+/* SHA-256 of the image computed while it is written. R_FWUP_VerifyImage() hashes the
+ * descriptor followed by every program region, which is the file from offset 0 up to
+ * ulImageHashSize, so written blocks are hashed as long as they arrive in file order. */
+static BaseType_t xImageHashValid  = pdFALSE;
+static uint32_t   ulImageHashOffset = 0;
+static uint32_t   ulImageHashSize   = 0;
+
+/* Set when the file continues a download which was interrupted by a reset. The FWUP
+ * module erases the buffer area on the first write after R_FWUP_Open(), so the rest
+ * of such a file is programmed through the descriptor already in the buffer area. */
+static BaseType_t   xResumedFile = pdFALSE;
+static st_fw_desc_t xResumedDescriptor;
+
 static int ExtractECDSASignature (const unsigned char * derSignature, size_t derSignatureLength, unsigned char * rawSignature);
+static void UpdateImageHash (uint32_t ulOffset, uint8_t * const pData, uint32_t ulBlockSize);
+static uint32_t GetFileRegion (const st_fw_desc_t * pDesc, uint32_t ulOffset, uint32_t * pulAddress);
+static e_fwup_err_t WriteResumedImageProgram (uint32_t ulOffset, uint8_t * const pData, uint32_t ulProgramSize);
 
 /* Function Name: otaPal_CreateFileForRx */
 /**********************************************************************************************************************
@@ -80,6 +103,11 @@ OtaPalJobDocProcessingResult_t otaPal_CreateFileForRx(AfrOtaJobDocumentFields_t
     receiving_count      = 0;
     first_block_received = pdFALSE;
 
+    xImageHashValid   = pdTRUE;
+    ulImageHashOffset = 0;
+    ulImageHashSize   = 0;
+    xResumedFile      = pdFALSE;
+
     for (uint8_t i = 0; i < mqttFileDownloader_MAX_NUM_BLOCKS_REQUEST; i++)
     {
         first_ota_blocks[i] = NULL;
@@ -104,6 +132,245 @@ OtaPalJobDocProcessingResult_t otaPal_CreateFileForRx(AfrOtaJobDocumentFields_t
  End of function otaPal_CreateFileForRx
  *********************************************************************************************************************/
 
+/* Function Name: otaPal_ResumeFileForRx */
+/**********************************************************************************************************************
+ * @brief Continues receiving a file whose beginning is already in the buffer area
+ * @param[in] pFileContext
+ * @param[in] ulResumeOffset
+ * @return OTA Job processing result
+ * @retval OtaPalJobDocFileCreateFailed
+ * @retval OtaPalJobDocFileCreated
+ *********************************************************************************************************************/
+OtaPalJobDocProcessingResult_t otaPal_ResumeFileForRx(AfrOtaJobDocumentFields_t * const pFileContext,
+                                                      uint32_t ulResumeOffset)
+{
+#if (FWUP_CFG_UPDATE_MODE == FWUP_DUAL_BANK)
+    if (OtaPalJobDocFileCreated != otaPal_CreateFileForRx(pFileContext))
+    {
+        return OtaPalJobDocFileCreateFailed;
+    }
+
+    /* The descriptor is the first part of the file, so it must already be there. */
+    if (ulResumeOffset < sizeof(st_fw_desc_t))
+    {
+        return OtaPalJobDocFileCreateFailed;
+    }
+
+    r_fwup_wrap_flash_read((uint32_t)&xResumedDescriptor, FWUP_CFG_BUF_AREA_ADDR_L + sizeof(st_fw_header_t),
+                           sizeof(st_fw_desc_t));
+    if ((0 == xResumedDescriptor.n) || (xResumedDescriptor.n > FWUP_IMAGE_BLOCKS))
+    {
+        LogError(("otaPal_ResumeFileForRx: no valid descriptor in the buffer area"));
+        return OtaPalJobDocFileCreateFailed;
+    }
+
+    /* Keep what is in the buffer area. The image is hashed from flash when the file is
+     * closed, as the hash of the part written before the reset was lost. */
+    first_block_received = pdTRUE;
+    xImageHashValid      = pdFALSE;
+    xResumedFile         = pdTRUE;
+
+    LogInfo(("otaPal_ResumeFileForRx: resuming at offset %u", ulResumeOffset));
+
+    return OtaPalJobDocFileCreated;
+#else
+    (void) pFileContext;
+    (void) ulResumeOffset;
+
+    return OtaPalJobDocFileCreateFailed;
+#endif /* (FWUP_CFG_UPDATE_MODE == FWUP_DUAL_BANK) */
+}
+/**********************************************************************************************************************
+ End of function otaPal_ResumeFileForRx
+ *********************************************************************************************************************/
+
+/* Function Name: GetFileRegion */
+/**********************************************************************************************************************
+ * @brief Map an offset in an OTA file to the install address given by the file's descriptor
+ * @param[in]  pDesc
+ * @param[in]  ulOffset
+ * @param[out] pulAddress
+ * @return Number of bytes from ulOffset to the end of its region, 0 if ulOffset is not in a region
+ * @note  The file holds the descriptor followed by the regions of the descriptor back to back.
+ *********************************************************************************************************************/
+static uint32_t GetFileRegion(const st_fw_desc_t * pDesc, uint32_t ulOffset, uint32_t * pulAddress)
+{
+    uint32_t ulRegionStart = sizeof(st_fw_desc_t);
+    uint32_t ulRegionEnd;
+
+    for (uint32_t i = 0; (i < pDesc->n) && (i < FWUP_IMAGE_BLOCKS); i++)
+    {
+        ulRegionEnd = ulRegionStart + pDesc->fw[i].size;
+
+        if ((ulRegionStart <= ulOffset) && (ulOffset < ulRegionEnd))
+        {
+            *pulAddress = pDesc->fw[i].addr + (ulOffset - ulRegionStart);
+            return ulRegionEnd - ulOffset;
+        }
+
+        ulRegionStart = ulRegionEnd;
+    }
+
+    return 0;
+}
+/**********************************************************************************************************************
+ End of function GetFileRegion
+ *********************************************************************************************************************/
+
+/* Function Name: WriteResumedImageProgram */
+/**********************************************************************************************************************
+ * @brief Program a part of a resumed file to the install addresses given by its descriptor
+ * @param[in] ulOffset
+ * @param[in] pData
+ * @param[in] ulProgramSize
+ * @return FWUP result
+ *********************************************************************************************************************/
+static e_fwup_err_t WriteResumedImageProgram(uint32_t ulOffset, uint8_t * const pData, uint32_t ulProgramSize)
+{
+    uint8_t * pSrc = pData;
+    uint32_t  ulAddress;
+    uint32_t  ulSize;
+
+    if (ulOffset < sizeof(st_fw_desc_t))
+    {
+        return FWUP_ERR_FAILURE;
+    }
+
+    /* Padding after the last region is not programmed. */
+    while (ulProgramSize > 0)
+    {
+        ulSize = GetFileRegion(&xResumedDescriptor, ulOffset, &ulAddress);
+        if (0 == ulSize)
+        {
+            break;
+        }
+
+        if (ulSize > ulProgramSize)
+        {
+            ulSize = ulProgramSize;
+        }
+
+        /* Code flash goes to the same offset in the buffer bank, data flash is written in place. */
+        if ((FWUP_CFG_MAIN_AREA_ADDR_L <= ulAddress) && (ulAddress < (FWUP_CFG_MAIN_AREA_ADDR_L + FWUP_CFG_AREA_SIZE)))
+        {
+            ulAddress = (ulAddress - FWUP_CFG_MAIN_AREA_ADDR_L) + FWUP_CFG_BUF_AREA_ADDR_L;
+        }
+
+        if (FWUP_SUCCESS != r_fwup_wrap_flash_write((uint32_t)pSrc, ulAddress, ulSize))
+        {
+            return FWUP_ERR_FLASH;
+        }
+
+        pSrc          += ulSize;
+        ulOffset      += ulSize;
+        ulProgramSize -= ulSize;
+    }
+
+    return FWUP_SUCCESS;
+}
+/**********************************************************************************************************************
+ End of function WriteResumedImageProgram
+ *********************************************************************************************************************/
+
+/* Function Name: otaPal_ReadActiveImage */
+/**********************************************************************************************************************
+ * @brief Read a part of the running image as it was laid out in its OTA file
+ * @param[in]  ulOffset
+ * @param[out] pBuffer
+ * @param[in]  ulLength
+ * @return Read result
+ * @retval true
+ * @retval false
+ *********************************************************************************************************************/
+bool otaPal_ReadActiveImage(uint32_t ulOffset, uint8_t * const pBuffer, uint32_t ulLength)
+{
+#if (FWUP_CFG_UPDATE_MODE == FWUP_DUAL_BANK)
+    st_fw_desc_t dc;
+    uint8_t *    pDst = pBuffer;
+    uint32_t     ulAddress;
+    uint32_t     ulSize;
+
+    r_fwup_wrap_flash_read((uint32_t)&dc, FWUP_CFG_MAIN_AREA_ADDR_L + sizeof(st_fw_header_t), sizeof(st_fw_desc_t));
+
+    while (ulLength > 0)
+    {
+        if (ulOffset < sizeof(st_fw_desc_t))
+        {
+            ulAddress = FWUP_CFG_MAIN_AREA_ADDR_L + sizeof(st_fw_header_t) + ulOffset;
+            ulSize    = sizeof(st_fw_desc_t) - ulOffset;
+        }
+        else
+        {
+            ulSize = GetFileRegion(&dc, ulOffset, &ulAddress);
+
+            /* Only code flash of the running bank still holds what was installed. */
+            if ((0 == ulSize) ||
+                (ulAddress < FWUP_CFG_MAIN_AREA_ADDR_L) ||
+                ((ulAddress + ulSize) > (FWUP_CFG_MAIN_AREA_ADDR_L + FWUP_CFG_AREA_SIZE)))
+            {
+                return false;
+            }
+        }
+
+        if (ulSize > ulLength)
+        {
+            ulSize = ulLength;
+        }
+
+        r_fwup_wrap_flash_read((uint32_t)pDst, ulAddress, ulSize);
+
+        pDst     += ulSize;
+        ulOffset += ulSize;
+        ulLength -= ulSize;
+    }
+
+    return true;
+#else
+    (void) ulOffset;
+    (void) pBuffer;
+    (void) ulLength;
+
+    return false;
+#endif /* (FWUP_CFG_UPDATE_MODE == FWUP_DUAL_BANK) */
+}
+/**********************************************************************************************************************
+ End of function otaPal_ReadActiveImage
+ *********************************************************************************************************************/
+
+/* Function Name: WriteImageProgram */
+/**********************************************************************************************************************
+ * @brief Program a buffer whose size is a multiple of the code flash program unit
+ * @param[in] ulOffset
+ * @param[in] pData
+ * @param[in] ulProgramSize
+ * @return FWUP result
+ *********************************************************************************************************************/
+static e_fwup_err_t WriteImageProgram(uint32_t ulOffset, uint8_t * const pData, uint32_t ulProgramSize)
+{
+    /* Blocks can arrive out of order, so erase the buffer area before the
+     * first block written for this file rather than for the block at offset 0. */
+    if (pdFALSE == first_block_received)
+    {
+        R_FWUP_Close();
+        R_FWUP_Open();
+
+        R_FWUP_EraseArea(FWUP_AREA_BUFFER);
+
+        first_block_received = pdTRUE;
+    }
+
+    if (pdTRUE == xResumedFile)
+    {
+        return WriteResumedImageProgram(ulOffset, pData, ulProgramSize);
+    }
+
+    /* Calculate the offset from top of RSU file */
+    return R_FWUP_WriteImageProgram(FWUP_AREA_BUFFER, pData, ulOffset + sizeof(st_fw_header_t), ulProgramSize);
+}
+/**********************************************************************************************************************
+ End of function WriteImageProgram
+ *********************************************************************************************************************/
+
 /* Function Name: otaPal_WriteBlock */
 /**********************************************************************************************************************
  * @brief Write OTA data blocks
@@ -128,16 +395,6 @@ int16_t otaPal_WriteBlock(AfrOtaJobDocumentFields_t * const pFileContext,
 
     LogDebug(("otaPal_WriteBlock: receives OTA block #%d with size = %d!", usBlockIndx, ulBlockSize));
 
-    if (0 == ulOffset)
-    {
-        R_FWUP_Close();
-        R_FWUP_Open();
-
-        R_FWUP_EraseArea(FWUP_AREA_BUFFER);
-
-        first_block_received = pdTRUE;
-    }
-
     if ((ulBlockSize % FLASH_CF_MIN_PGM_SIZE) != 0)
     {
         uint32_t  paddingsize = FLASH_CF_MIN_PGM_SIZE*((int32_t)(ulBlockSize/FLASH_CF_MIN_PGM_SIZE)+1); // cast to int32_t
@@ -146,20 +403,14 @@ int16_t otaPal_WriteBlock(AfrOtaJobDocumentFields_t * const pFileContext,
         memset(pBuffTmp, 0xFF, paddingsize);
         (void)memcpy(pBuffTmp, pData, ulBlockSize);
  
-        eResult = R_FWUP_WriteImageProgram(FWUP_AREA_BUFFER, pBuffTmp,
-                ulOffset + sizeof(st_fw_header_t),
-                paddingsize);
+        eResult = WriteImageProgram(ulOffset, pBuffTmp, paddingsize);
         vPortFree(pBuffTmp);
         pBuffTmp = NULL;
  
     }
     else
     {
-    /* Calculate the offset from top of RSU file */
-    uint32_t rsu_offset = ulOffset+sizeof(st_fw_header_t);
-
-    eResult = R_FWUP_WriteImageProgram(FWUP_AREA_BUFFER,
-                            pData, rsu_offset, ulBlockSize);
+        eResult = WriteImageProgram(ulOffset, pData, ulBlockSize);
     }
     
     if ((FWUP_ERR_FLASH == eResult))
@@ -167,6 +418,7 @@ int16_t otaPal_WriteBlock(AfrOtaJobDocumentFields_t * const pFileContext,
         LogDebug(("otaPal_WriteBlock: index = %d, NG, error = %d\r\n", usBlockIndx, eResult));
         return 0;
     }
+    UpdateImageHash(ulOffset, pData, ulBlockSize);
     LogDebug (("otaPal_WriteBlock: index = %d, OK, %d bytes\r\n", usBlockIndx, ulBlockSize));
     return (int16_t)ulBlockSize; // casting to the correct data type for return value
 }
@@ -174,6 +426,110 @@ int16_t otaPal_WriteBlock(AfrOtaJobDocumentFields_t * const pFileContext,
  End of function otaPal_WriteBlock
  *********************************************************************************************************************/
 
+/* Function Name: otaPal_WritePaddedBlock */
+/**********************************************************************************************************************
+ * @brief Write an OTA data block that the caller has already padded to the program unit
+ * @param[in] pFileContext
+ * @param[in] ulOffset
+ * @param[in] pData
+ * @param[in] ulBlockSize
+ * @return Size of written block
+ * @retval 0
+ * @retval ulBlockSize
+ *********************************************************************************************************************/
+int16_t otaPal_WritePaddedBlock(AfrOtaJobDocumentFields_t * const pFileContext,
+                                 uint32_t ulOffset,
+                                 uint8_t * const pData,
+                                 uint32_t ulBlockSize)
+{
+    (void) pFileContext;
+
+    e_fwup_err_t eResult     = FWUP_SUCCESS;
+    uint32_t     programSize = ((ulBlockSize + (FLASH_CF_MIN_PGM_SIZE - 1)) / FLASH_CF_MIN_PGM_SIZE) * FLASH_CF_MIN_PGM_SIZE;
+
+    eResult = WriteImageProgram(ulOffset, pData, programSize);
+
+    if (FWUP_ERR_FLASH == eResult)
+    {
+        LogDebug(("otaPal_WritePaddedBlock: offset = %d, NG, error = %d\r\n", ulOffset, eResult));
+        return 0;
+    }
+    UpdateImageHash(ulOffset, pData, ulBlockSize);
+    LogDebug(("otaPal_WritePaddedBlock: offset = %d, OK, %d bytes\r\n", ulOffset, ulBlockSize));
+    return (int16_t)ulBlockSize; // casting to the correct data type for return value
+}
+/**********************************************************************************************************************
+ End of function otaPal_WritePaddedBlock
+ *********************************************************************************************************************/
+
+/* Function Name: UpdateImageHash */
+/**********************************************************************************************************************
+ * @brief Add a written block to the image hash
+ * @param[in] ulOffset
+ * @param[in] pData
+ * @param[in] ulBlockSize
+ * @note  A block which does not continue the hashed part of the file stops the hashing,
+ *        and the image is hashed from flash by R_FWUP_VerifyImage() instead.
+ *********************************************************************************************************************/
+static void UpdateImageHash(uint32_t ulOffset, uint8_t * const pData, uint32_t ulBlockSize)
+{
+    st_fw_desc_t dc;
+    uint32_t     ulHashSize;
+
+    if (pdFALSE == xImageHashValid)
+    {
+        return;
+    }
+
+    if (ulOffset != ulImageHashOffset)
+    {
+        LogDebug(("UpdateImageHash: block at offset %d is out of order, the image will be hashed from flash", ulOffset));
+        xImageHashValid = pdFALSE;
+        return;
+    }
+
+    if (0 == ulImageHashOffset)
+    {
+        /* The first block starts with the descriptor, which gives the size of the hashed part. */
+        if (ulBlockSize < sizeof(st_fw_desc_t))
+        {
+            xImageHashValid = pdFALSE;
+            return;
+        }
+
+        memcpy(&dc, pData, sizeof(st_fw_desc_t));
+        if (dc.n > FWUP_IMAGE_BLOCKS)
+        {
+            xImageHashValid = pdFALSE;
+            return;
+        }
+
+        ulImageHashSize = sizeof(st_fw_desc_t);
+        for (uint32_t i = 0; i < dc.n; i++)
+        {
+            ulImageHashSize += dc.fw[i].size;
+        }
+
+        r_fwup_wrap_sha256_init(r_fwup_wrap_get_crypt_context());
+    }
+
+    if (ulImageHashOffset < ulImageHashSize)
+    {
+        ulHashSize = ulImageHashSize - ulImageHashOffset;
+        if (ulHashSize > ulBlockSize)
+        {
+            ulHashSize = ulBlockSize;
+        }
+
+        r_fwup_wrap_sha256_update(r_fwup_wrap_get_crypt_context(), (C_U8_FAR *)pData, ulHashSize); // cast to C_U8_FAR *
+    }
+
+    ulImageHashOffset += ulBlockSize;
+}
+/**********************************************************************************************************************
+ End of function UpdateImageHash
+ *********************************************************************************************************************/
+
 /* Function Name: otaPal_CheckFileSignature */
 /**********************************************************************************************************************
  * @brief Verify the signature of the received file
@@ -242,8 +598,24 @@ static OtaPalStatus_t otaPal_CheckFileSignature(AfrOtaJobDocumentFields_t * cons
     }
 
 
-    /* Verify the signature */
-    eRet = R_FWUP_VerifyImage(FWUP_AREA_BUFFER);
+    /* Verify the signature. The hash computed while the image was written saves
+     * reading the whole buffer area back from flash. */
+    if ((pdTRUE == xImageHashValid) && (0 != ulImageHashSize) && (ulImageHashOffset >= ulImageHashSize))
+    {
+        uint8_t hash[HASH_LENGTH];
+
+        xImageHashValid = pdFALSE;
+        r_fwup_wrap_sha256_final(hash, r_fwup_wrap_get_crypt_context());
+
+        if (0 != r_fwup_wrap_verify_ecdsa(hash, (uint8_t *)OTA_JsonFileSignatureKey, rawSignature, MAX_SIG_LENGTH)) // cast to uint8_t *
+        {
+            eRet = FWUP_ERR_VERIFY;
+        }
+    }
+    else
+    {
+        eRet = R_FWUP_VerifyImage(FWUP_AREA_BUFFER);
+    }
 
     if (FWUP_SUCCESS != eRet)
     {
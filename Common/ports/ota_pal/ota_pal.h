@@ -62,6 +62,7 @@
 /************ End of logging configuration ****************/
 
 #define OTA_FILE_SIG_KEY_STR_MAX_LENGTH    (32) /*!< Maximum length of the file signature key. */
+#define OTA_PAL_PROGRAM_UNIT_SIZE          (128U) /*!< Code flash program unit (FLASH_CF_MIN_PGM_SIZE). */
 
 typedef enum OtaPalStatus
 {
@@ -199,6 +200,40 @@ OtaPalStatus_t otaPal_Abort (AfrOtaJobDocumentFields_t * const pFileContext);
  */
 OtaPalJobDocProcessingResult_t otaPal_CreateFileForRx (AfrOtaJobDocumentFields_t * const pFileContext);
 
+/* Function Name: otaPal_ResumeFileForRx */
+/**
+ * @brief Continue receiving a file after a reset.
+ *
+ * Opens the file like otaPal_CreateFileForRx(), but keeps the first ulResumeOffset bytes
+ * of the file which are already in the download partition instead of erasing them.
+ * The remaining blocks are then written with otaPal_WriteBlock() or otaPal_WritePaddedBlock()
+ * as usual.
+ *
+ * @param[in] pFileContext OTA file context information.
+ * @param[in] ulResumeOffset Number of bytes at the beginning of the file already written.
+ *
+ * @return OtaPalJobDocFileCreated if the download can be continued, otherwise
+ *         OtaPalJobDocFileCreateFailed and the file must be received from the beginning.
+ */
+OtaPalJobDocProcessingResult_t otaPal_ResumeFileForRx (AfrOtaJobDocumentFields_t * const pFileContext,
+                                                       uint32_t ulResumeOffset);
+
+/* Function Name: otaPal_ReadActiveImage */
+/**
+ * @brief Read a part of the running image.
+ *
+ * The running image is read as it was laid out in the OTA file it was installed from: the
+ * descriptor followed by the program regions. This is the base a delta update refers to.
+ *
+ * @param[in]  ulOffset Offset in the OTA file of the running image.
+ * @param[out] pBuffer Destination buffer.
+ * @param[in]  ulLength Number of bytes to read.
+ *
+ * @return true if the bytes were read, false if a part of the range is not in the code flash
+ *         of the running bank.
+ */
+bool otaPal_ReadActiveImage (uint32_t ulOffset, uint8_t * const pBuffer, uint32_t ulLength);
+
 /* Function Name: otaPal_CloseFile */
 /**
  * @brief Authenticate and close the underlying receive file in the specified OTA context.
@@ -273,6 +308,26 @@ int16_t otaPal_WriteBlock (AfrOtaJobDocumentFields_t * const pFileContext,
                            uint8_t * const pData,
                            uint32_t ulBlockSize);
 
+/* Function Name: otaPal_WritePaddedBlock */
+/**
+ * @brief Write a block of data that is already padded to the code flash program unit.
+ *
+ * Same as otaPal_WriteBlock(), but the caller guarantees that pData holds ulBlockSize
+ * rounded up to OTA_PAL_PROGRAM_UNIT_SIZE bytes, with the bytes after ulBlockSize set
+ * to 0xFF. The buffer is programmed as it is, without a temporary padded copy.
+ *
+ * @param[in] pFileContext OTA file context information.
+ * @param[in] ulOffset Byte offset to write to from the beginning of the file.
+ * @param[in] pData Pointer to the padded byte array of data to write.
+ * @param[in] ulBlockSize The number of valid bytes in pData.
+ *
+ * @return The number of bytes written successfully (ulBlockSize), or 0 on flash error.
+ */
+int16_t otaPal_WritePaddedBlock (AfrOtaJobDocumentFields_t * const pFileContext,
+                                 uint32_t ulOffset,
+                                 uint8_t * const pData,
+                                 uint32_t ulBlockSize);
+
 /* Function Name: otaPal_ActivateNewImage */
 /**
  * @brief Activate the newest MCU image received via OTA.
@@ -60,10 +60,13 @@
 
 #include "lfs.h"
 #include "lfs_util_config.h"
+#include "rm_littlefs_flash.h"
 
 #include "transport_mbedtls_pkcs11.h"
 
 extern lfs_t RM_STDIO_LITTLEFS_CFG_LFS;
+extern void littlFs_lock (void);
+extern void littlFs_unlock (void);
 volatile uint32_t pvwrite = 0;
 enum eObjectHandles
 {
@@ -99,6 +102,7 @@ uint8_t g_object_handle_dictionary[pkcs11configMAX_NUM_OBJECTS][pkcs11configMAX_
 #endif
 };
 void Crypto (void);
+static void prvInvalidateCertificate (CK_OBJECT_HANDLE xHandle);
 
 /**********************************************************************************************************************
  * Function Name: Crypto
@@ -159,10 +163,13 @@ CK_OBJECT_HANDLE PKCS11_PAL_SaveObject(CK_ATTRIBUTE_PTR pxLabel, CK_BYTE_PTR puc
 
     lfs_file_t file;
 
+    littlFs_lock();
+
     volatile int lfs_err = lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, pxLabel->pValue);
 
     if ((LFS_ERR_NOENT != lfs_err) && (LFS_ERR_OK != lfs_err))
     {
+        littlFs_unlock();
         return eInvalidHandle;
     }
 
@@ -170,18 +177,27 @@ CK_OBJECT_HANDLE PKCS11_PAL_SaveObject(CK_ATTRIBUTE_PTR pxLabel, CK_BYTE_PTR puc
 
     if (LFS_ERR_OK != lfs_err)
     {
+        littlFs_unlock();
         return eInvalidHandle;
     }
 
     lfs_err = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, &file, pucData, ulDataSize);
 
     pvwrite += ulDataSize;
+    if (lfs_err > 0)
+    {
+        /* Reference for the write amplification reported by the flash port. */
+        RM_LITTLEFS_FLASH_FileBytesAdd(RM_STDIO_LITTLEFS_CFG_LFS.cfg->context, (uint32_t) lfs_err);
+    }
     if (lfs_err < 0)
     {
         xHandle = eInvalidHandle;
     }
 
     lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+    littlFs_unlock();
+
+    prvInvalidateCertificate(xHandle);
 
     return xHandle;
 }
@@ -211,7 +227,13 @@ CK_OBJECT_HANDLE PKCS11_PAL_FindObject(CK_BYTE_PTR pxLabel, CK_ULONG usLength)
         if (!strcmp((char *) &g_object_handle_dictionary[i], (char *)pxLabel))
         {
             struct lfs_info xFileInfo = { 0 };
-            if (lfs_stat(&RM_STDIO_LITTLEFS_CFG_LFS, (char *)pxLabel, &xFileInfo) == LFS_ERR_OK)
+            int lfs_ret;
+
+            littlFs_lock();
+            lfs_ret = lfs_stat(&RM_STDIO_LITTLEFS_CFG_LFS, (char *)pxLabel, &xFileInfo);
+            littlFs_unlock();
+
+            if (LFS_ERR_OK == lfs_ret)
             {
                 xHandle = (CK_OBJECT_HANDLE) i;
                 break;
@@ -253,6 +275,8 @@ CK_RV PKCS11_PAL_GetObjectValue(CK_OBJECT_HANDLE xHandle,
     {
         lfs_file_t file;
 
+        littlFs_lock();
+
         int lfs_ret =
             lfs_file_open(  &RM_STDIO_LITTLEFS_CFG_LFS,
                             &file,
@@ -261,6 +285,7 @@ CK_RV PKCS11_PAL_GetObjectValue(CK_OBJECT_HANDLE xHandle,
 
         if (LFS_ERR_OK != lfs_ret)
         {
+            littlFs_unlock();
             return eInvalidHandle;
         }
 
@@ -291,6 +316,7 @@ CK_RV PKCS11_PAL_GetObjectValue(CK_OBJECT_HANDLE xHandle,
         }
 
         lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+        littlFs_unlock();
     }
 
     return xReturn;
@@ -332,12 +358,16 @@ CK_RV PKCS11_PAL_DestroyObject(CK_OBJECT_HANDLE xHandle)
 
     if (eInvalidHandle != xHandle)
     {
+        littlFs_lock();
         volatile int lfs_err = lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, (char *) g_object_handle_dictionary[xHandle]);
+        littlFs_unlock();
 
         if (LFS_ERR_OK == lfs_err)
         {
             xReturn = CKR_OK;
         }
+
+        prvInvalidateCertificate(xHandle);
     }
 
     return xReturn;
@@ -346,4 +376,26 @@ CK_RV PKCS11_PAL_DestroyObject(CK_OBJECT_HANDLE xHandle)
 End of function PKCS11_PAL_DestroyObject
 ****************************************************************************************/
 
+/**********************************************************************************************************************
+ * Function Name: prvInvalidateCertificate
+ * Description  : Makes the TLS transport parse a certificate object again
+ *                after it was written or deleted, and drops the TLS session
+ *                that was set up with the old certificate.
+ * Argument     : xHandle       Handle of the changed object.
+ * Return Value : .
+ *********************************************************************************************************************/
+static void prvInvalidateCertificate(CK_OBJECT_HANDLE xHandle)
+{
+    if ((eAwsDeviceCertificate == xHandle) || (eAwsClaimCertificate == xHandle))
+    {
+        TLS_FreeRTOS_InvalidateCredentials();
+        littlFs_lock();
+        (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, TLS_TRANSPORT_SESSION_FILE_NAME);
+        littlFs_unlock();
+    }
+}
+/*****************************************************************************************
+End of function prvInvalidateCertificate
+****************************************************************************************/
+
 /*-----------------------------------------------------------*/
@@ -62,6 +62,10 @@ static void update_dataflash_data (const struct lfs_config * c,
         lfs_size_t                size,
         uint32_t                  update_state);
 
+static void flash_operation_begin (uint32_t update_state);
+static int flash_operation_end (flash_err_t flash_error_code);
+static bool flash_area_is_blank (uint32_t address, uint32_t size);
+
 /**********************************************************************************************************************
  * Function Name: RM_LITTLEFS_FLASH_Open
  * Description  : Opens the driver and initializes lower layer driver.
@@ -75,6 +79,8 @@ fsp_err_t RM_LITTLEFS_FLASH_Open(rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_
 {
     rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) p_ctrl;
     p_instance_ctrl->p_cfg = p_cfg;
+    memset(p_instance_ctrl->erased_blocks, 0, sizeof(p_instance_ctrl->erased_blocks));
+    memset(&p_instance_ctrl->stats, 0, sizeof(p_instance_ctrl->stats));
 
     /* Call commonapi open function for Flash */
     e_commonapi_err_t common_api_err = R_Demo_Common_API_Flash_Open();
@@ -128,6 +134,90 @@ fsp_err_t RM_LITTLEFS_FLASH_Close(rm_littlefs_ctrl_t * const p_ctrl)
 End of function RM_LITTLEFS_FLASH_Close
 ****************************************************************************************/
 
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_StatsGet
+ * Description  : Returns the flash usage counters of the instance.
+ * Arguments    : p_ctrl
+ *              : p_stats
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_StatsGet(rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_stats_t * const p_stats)
+{
+    rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) p_ctrl;
+
+    *p_stats = p_instance_ctrl->stats;
+
+    return FSP_SUCCESS;
+}
+/*****************************************************************************************
+End of function RM_LITTLEFS_FLASH_StatsGet
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_WearGet
+ * Description  : Returns the lifetime wear record of the instance.
+ * Arguments    : p_ctrl
+ *              : p_wear
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_WearGet(rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_wear_t * const p_wear)
+{
+    rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) p_ctrl;
+
+    *p_wear = p_instance_ctrl->wear;
+
+    return FSP_SUCCESS;
+}
+/*****************************************************************************************
+End of function RM_LITTLEFS_FLASH_WearGet
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_WearSet
+ * Description  : Restores a wear record saved by a previous boot. Wear counted since open is added to it, so that
+ *                the erases done while mounting the file system that holds the record are not lost.
+ * Arguments    : p_ctrl
+ *              : p_wear
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_WearSet(rm_littlefs_ctrl_t * const p_ctrl, rm_littlefs_flash_wear_t const * const p_wear)
+{
+    rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) p_ctrl;
+    uint32_t block;
+
+    for (block = 0; block < LFS_FLASH_BLOCK_COUNT; block++)
+    {
+        p_instance_ctrl->wear.erase_count[block] += p_wear->erase_count[block];
+    }
+    p_instance_ctrl->wear.bytes_programmed += p_wear->bytes_programmed;
+    p_instance_ctrl->wear.file_bytes_written += p_wear->file_bytes_written;
+
+    return FSP_SUCCESS;
+}
+/*****************************************************************************************
+End of function RM_LITTLEFS_FLASH_WearSet
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: RM_LITTLEFS_FLASH_FileBytesAdd
+ * Description  : Counts file data written through LittleFS. Compared with the bytes programmed by LittleFS this gives
+ *                the write amplification of the file system.
+ * Arguments    : p_ctrl
+ *              : bytes
+ * Return Value : FSP_SUCCESS
+ *********************************************************************************************************************/
+fsp_err_t RM_LITTLEFS_FLASH_FileBytesAdd(rm_littlefs_ctrl_t * const p_ctrl, uint32_t bytes)
+{
+    rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) p_ctrl;
+
+    p_instance_ctrl->wear.file_bytes_written += bytes;
+
+    return FSP_SUCCESS;
+}
+/*****************************************************************************************
+End of function RM_LITTLEFS_FLASH_FileBytesAdd
+****************************************************************************************/
+
 /**********************************************************************************************************************
  * Function Name: rm_littlefs_flash_read
  * Description  : Read from the flash driver. Negative error codes are propogated to the user.
@@ -146,14 +236,14 @@ int rm_littlefs_flash_read(const struct lfs_config * c,
                             lfs_size_t                size)
 {
     rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) c->context;
+    uint8_t * p_src = (uint8_t *) (rm_littlefs_flash_data_start + (p_instance_ctrl->p_cfg->p_lfs_cfg->block_size * block) + off);
 
-    /* No flash access while reading */
+    /* The data flash cannot be read during a program or erase, so the flash is held for the copy. The reads of
+     * LittleFS are already serialized by the file system lock, so this adds no wait between readers. */
     xSemaphoreTake(xSemaphoreFlashAccess, portMAX_DELAY);
 
     /* Read directly from the flash. */
-    memcpy( buffer,
-            (uint8_t *) (rm_littlefs_flash_data_start + (p_instance_ctrl->p_cfg->p_lfs_cfg->block_size * block) + off),
-            size);
+    memcpy(buffer, p_src, size);
     xSemaphoreGive(xSemaphoreFlashAccess);
 
     return LFS_ERR_OK;
@@ -182,26 +272,25 @@ int rm_littlefs_flash_write(const struct lfs_config * c,
     /* if semaphore cannot be obtained then return error */
     flash_err_t flash_error_code = FLASH_ERR_BUSY;
     rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) c->context;
+    int lfs_err;
 
-    /* Flash access protect */
-    xSemaphoreTake(xSemaphoreFlashAccess, portMAX_DELAY);
+    /* The block is no longer erased once anything is written to it. */
+    p_instance_ctrl->erased_blocks[block / 32] &= ~(1UL << (block % 32));
 
-    update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_WRITE_WAIT_COMPLETE;
+    flash_operation_begin(DATA_FLASH_UPDATE_STATE_WRITE_WAIT_COMPLETE);
 
     flash_error_code = R_FLASH_Write( (uint32_t)buffer,
             (rm_littlefs_flash_data_start +
             (p_instance_ctrl->p_cfg->p_lfs_cfg->block_size * block) + off), size );
 
-    if ((FLASH_SUCCESS != flash_error_code))
+    lfs_err = flash_operation_end(flash_error_code);
+
+    if (LFS_ERR_OK == lfs_err)
     {
-        xSemaphoreGive(xSemaphoreFlashAccess);
-        return LFS_ERR_IO;
+        p_instance_ctrl->wear.bytes_programmed += size;
     }
 
-    /* wait for the semaphore to be released by callback */
-    xSemaphoreTake(xSemaphoreFlashAccess, portMAX_DELAY);
-    xSemaphoreGive(xSemaphoreFlashAccess);
-    return LFS_ERR_OK;
+    return lfs_err;
 }
 /*****************************************************************************************
 End of function rm_littlefs_flash_write
@@ -220,28 +309,117 @@ int rm_littlefs_flash_erase(const struct lfs_config * c, lfs_block_t block)
     /* if semaphore cannot be obtained then return error */
     flash_err_t flash_error_code = FLASH_ERR_BUSY;
     rm_littlefs_flash_instance_ctrl_t * p_instance_ctrl = (rm_littlefs_flash_instance_ctrl_t *) c->context;
+    uint32_t block_address = rm_littlefs_flash_data_start + (p_instance_ctrl->p_cfg->p_lfs_cfg->block_size * block);
+    uint32_t block_mask = 1UL << (block % 32);
+    int lfs_err;
 
-    /* Flash access protect */
-    xSemaphoreTake(xSemaphoreFlashAccess, portMAX_DELAY);
+    p_instance_ctrl->stats.erase_requests++;
+
+    /* An erase takes milliseconds while a blank check takes microseconds, so skip the erase when the block has not
+     * been written since it was last erased or is found blank, e.g. blocks never used since the flash was cleared. */
+    if ((0 != (p_instance_ctrl->erased_blocks[block / 32] & block_mask)) ||
+        flash_area_is_blank(block_address, p_instance_ctrl->p_cfg->p_lfs_cfg->block_size))
+    {
+        p_instance_ctrl->erased_blocks[block / 32] |= block_mask;
+        p_instance_ctrl->stats.erases_skipped++;
+        return LFS_ERR_OK;
+    }
 
-    update_data_flash_control_block.status = DATA_FLASH_UPDATE_STATE_ERASE_WAIT_COMPLETE;
+    flash_operation_begin(DATA_FLASH_UPDATE_STATE_ERASE_WAIT_COMPLETE);
 
-    flash_error_code = R_FLASH_Erase((flash_block_address_t)(rm_littlefs_flash_data_start + (p_instance_ctrl->p_cfg->p_lfs_cfg->block_size * block)),
+    flash_error_code = R_FLASH_Erase((flash_block_address_t)block_address,
                                     p_instance_ctrl->p_cfg->p_lfs_cfg->block_size / RM_LITTLEFS_FLASH_DATA_BLOCK_SIZE);
 
-    if ((FLASH_SUCCESS != flash_error_code))
+    lfs_err = flash_operation_end(flash_error_code);
+
+    if (LFS_ERR_OK == lfs_err)
     {
-        xSemaphoreGive(xSemaphoreFlashAccess);
-        return LFS_ERR_IO;
+        p_instance_ctrl->erased_blocks[block / 32] |= block_mask;
+        p_instance_ctrl->wear.erase_count[block]++;
     }
 
-    /* wait for the semaphore to be released by callback */
+    return lfs_err;
+}
+/*****************************************************************************************
+End of function rm_littlefs_flash_erase
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: flash_operation_begin
+ * Description  : Takes the flash for a program or erase and asks the flash callback to notify this task, rather
+ *                than give xSemaphoreFlashAccess, when the operation completes. The semaphore is therefore only
+ *                released by its owner and no other task can start an operation while this one is running.
+ * Argument     : update_state  State the flash callback expects on completion.
+ * Return Value : none
+ *********************************************************************************************************************/
+static void flash_operation_begin(uint32_t update_state)
+{
+    /* Flash access protect */
     xSemaphoreTake(xSemaphoreFlashAccess, portMAX_DELAY);
+
+    (void) xTaskNotifyStateClearIndexed(NULL, COMMONAPI_FLASH_NOTIFY_IDX);
+    R_Demo_Common_API_Flash_SetWaiter(xTaskGetCurrentTaskHandle());
+
+    update_data_flash_control_block.status = update_state;
+}
+/*****************************************************************************************
+End of function flash_operation_begin
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: flash_operation_end
+ * Description  : Waits for the operation started after flash_operation_begin() to complete and releases the flash.
+ * Argument     : flash_error_code  Value returned when the operation was started.
+ * Return Value : LFS_ERR_OK  The operation completed successfully.
+ *                LFS_ERR_IO  The operation could not be started or the flash reported an error.
+ *********************************************************************************************************************/
+static int flash_operation_end(flash_err_t flash_error_code)
+{
+    int lfs_err = LFS_ERR_IO;
+
+    if (FLASH_SUCCESS == flash_error_code)
+    {
+        /* wait for the notification from the callback */
+        (void) ulTaskNotifyTakeIndexed(COMMONAPI_FLASH_NOTIFY_IDX, pdTRUE, portMAX_DELAY);
+
+        if (DATA_FLASH_UPDATE_STATE_FINALIZE == update_data_flash_control_block.status)
+        {
+            lfs_err = LFS_ERR_OK;
+        }
+    }
+
+    R_Demo_Common_API_Flash_SetWaiter(NULL);
     xSemaphoreGive(xSemaphoreFlashAccess);
-    return LFS_ERR_OK;
+
+    return lfs_err;
 }
 /*****************************************************************************************
-End of function rm_littlefs_flash_erase
+End of function flash_operation_end
+****************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: flash_area_is_blank
+ * Description  : Runs a blank check on an area of the data flash.
+ * Arguments    : address     Start address of the area.
+ *              : size        The size in bytes
+ * Return Value : true        The whole area is erased.
+ *                false       The area has been written, or the blank check failed.
+ *********************************************************************************************************************/
+static bool flash_area_is_blank(uint32_t address, uint32_t size)
+{
+    flash_err_t flash_error_code;
+    flash_res_t blank_check_result = FLASH_RES_NOT_BLANK;
+
+    /* The flash callback reports the result through g_blank_check_result and leaves the update state alone. */
+    flash_operation_begin(DATA_FLASH_UPDATE_STATE_FINALIZE);
+    g_blank_check_result = FLASH_RES_NOT_BLANK;
+
+    flash_error_code = R_FLASH_BlankCheck(address, size, &blank_check_result);
+
+    return ((LFS_ERR_OK == flash_operation_end(flash_error_code)) && (FLASH_RES_BLANK == g_blank_check_result));
+}
+/*****************************************************************************************
+End of function flash_area_is_blank
 ****************************************************************************************/
 
 /**********************************************************************************************************************
@@ -80,6 +80,7 @@
 /*#include "ota_appversion32.h" */
 
 #include "ota_demo.h"
+#include "ota_image_decoder.h"
 #include "mqtt_wrapper.h"
 
 /* Include platform abstraction header. */
@@ -105,16 +106,46 @@
  */
 #define AGENT_TASK_STACK_SIZE          (4096 * 2)
 
+/**
+ * @brief Task priority and stack size of the OTA flash writer.
+ */
+#define FLASH_WRITER_TASK_PRIORITY     (AGENT_TASK_PRIORITY)
+#define FLASH_WRITER_TASK_STACK_SIZE   (1024)
+
 #define NUM_OF_BLOCKS_REQUESTED                  (mqttFileDownloader_MAX_NUM_BLOCKS_REQUEST)
 #define MAX_THING_NAME_SIZE                      (128U)
 #define MAX_JOB_ID_LENGTH                        (64U)
 #define JOB_MSG_LENGTH                           (128U)
-#define MAX_NUM_OF_OTA_DATA_BUFFERS              (2)
+#define MAX_NUM_OF_OTA_DATA_BUFFERS              (OTA_DOWNLOAD_WINDOW_SIZE)
+#define NO_BLOCK_IN_FLIGHT                       (-1)
 #define MAX_RETRY_ERASE_AREA                     (3)
 
+#if OTA_DATA_PROGRAM_UNIT_SIZE != OTA_PAL_PROGRAM_UNIT_SIZE
+#error "OTA_DATA_PROGRAM_UNIT_SIZE must match OTA_PAL_PROGRAM_UNIT_SIZE."
+#endif
+
 /* Max bytes supported for a file signature (3072 bit RSA is 384 bytes). */
 #define OTA_MAX_SIGNATURE_SIZE                   (384U)
 
+/* littlefs file holding the download journal. */
+#define OTA_JOURNAL_FILE_NAME                    "ota_journal"
+#define OTA_JOURNAL_MAGIC                        (0x4F544A31U)
+
+/**
+ * @brief Progress of the current download, saved to survive a reset.
+ *
+ * Blocks are written in file order, so the written blocks are described by their count.
+ */
+typedef struct OtaDownloadJournal
+{
+    uint32_t magic;                   /*!< OTA_JOURNAL_MAGIC. */
+    char     jobId[MAX_JOB_ID_LENGTH]; /*!< Job the download belongs to. */
+    uint32_t fileId;                  /*!< Stream file ID. */
+    uint32_t fileSize;                /*!< Size of the OTA file. */
+    uint32_t blocksWritten;           /*!< Number of blocks at the beginning of the file in flash. */
+    uint32_t bytesWritten;            /*!< Image bytes in those blocks. */
+} OtaDownloadJournal_t;
+
  static const char asciiDigits[] =
  {
       '0', '1', '2', '3',
@@ -128,6 +159,25 @@ static uint32_t numOfBlocksRemaining = 0;
 static uint32_t currentBlockOffset = 0;
 static uint8_t currentFileId = 0;
 static uint32_t totalBytesReceived = 0;
+static uint32_t numOfBlocksTotal = 0;
+
+/* One bit per block of the OTA file, set once the block is written to flash. */
+static uint8_t receivedBlockBitmap[OTA_BLOCK_BITMAP_SIZE] = {0};
+
+/* Lowest block which has not been handed to the flash writer yet. Blocks are
+ * programmed in file order, so the image can be hashed while it is written. */
+static uint32_t nextBlockToWrite = 0;
+
+/* Blocks which arrived ahead of nextBlockToWrite, indexed by block ID modulo the window size. */
+static OtaDataEvent_t *parkedBlocks[OTA_DOWNLOAD_WINDOW_SIZE];
+
+/* Blocks requested from the stream service that have not arrived yet. */
+static int32_t inFlightBlockIds[OTA_DOWNLOAD_WINDOW_SIZE];
+static TickType_t inFlightRequestTicks[OTA_DOWNLOAD_WINDOW_SIZE];
+
+/* File type from the job document. Encoded files are rebuilt into the image by imageDecoder. */
+static uint32_t currentFileType = OTA_FILE_TYPE_IMAGE;
+static OtaImageDecoder_t imageDecoder;
 char globalJobId[MAX_JOB_ID_LENGTH] = {0};
 
 /* The topic buffer to wait for job event */
@@ -144,6 +194,14 @@ static AfrOtaJobDocumentFields_t jobFields = {0};
 static uint8_t OtaImageSingatureDecoded[OTA_MAX_SIGNATURE_SIZE] = {0};
 static SemaphoreHandle_t bufferSemaphore;
 
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+/* Blocks waiting to be programmed by the flash writer task. */
+static QueueHandle_t flashWriterQueue = NULL;
+
+/* Held by the flash writer task while it programs a block. */
+static SemaphoreHandle_t flashWriterMutex = NULL;
+#endif
+
 static OtaState_t otaAgentState = OtaAgentStateInit;
 
 /**
@@ -217,14 +275,78 @@ static OtaDataEvent_t *getOtaDataEventBuffer(void);
 /**
  * @brief
  */
-static void requestDataBlock(void);
+static void requestDataBlock(uint32_t blockId);
 
 /**
  * @brief
  */
-static int16_t handleMqttStreamsBlockArrived(uint8_t *data,
+static int16_t handleMqttStreamsBlockArrived(int32_t blockId,
+                                             uint8_t *data,
                                              size_t dataLength);
 
+/**
+ * @brief
+ */
+static void resetDownloadWindow(void);
+
+/**
+ * @brief
+ */
+static void fillDownloadWindow(bool retryAll);
+
+/**
+ * @brief
+ */
+static bool isBlockReceived(uint32_t blockId);
+
+/**
+ * @brief
+ */
+static void writeParkedBlocks(void);
+
+/**
+ * @brief
+ */
+static void writeFileBlock(OtaDataEvent_t *pxBlock);
+
+/**
+ * @brief
+ */
+static void drainFlashWriter(void);
+
+/**
+ * @brief
+ */
+static void failFileDownload(void);
+
+/**
+ * @brief
+ */
+static void saveDownloadJournal(void);
+
+/**
+ * @brief
+ */
+static void clearDownloadJournal(void);
+
+/**
+ * @brief
+ */
+static bool resumeFileDownload(void);
+
+/**
+ * @brief Callbacks of imageDecoder
+ */
+static bool readBaseImage(uint32_t offset, uint8_t * const pBuffer, uint32_t length);
+static bool writeDecodedImage(uint32_t offset, uint8_t * const pData, uint32_t length);
+
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+/**
+ * @brief The task which programs received blocks to the code flash.
+ */
+static void prvOtaFlashWriterTask(void *pvParam);
+#endif
+
 /**
  * @brief
  */
@@ -233,7 +355,7 @@ static bool convertSignatureToDER(AfrOtaJobDocumentFields_t *jobFields);
 /**
  * @brief
  */
-static void initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields);
+static bool initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields);
 
 /**
  * @brief
@@ -369,6 +491,26 @@ void otaDemo_start(void)
 
     OtaInitEvent_FreeRTOS();
 
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+    if (NULL == flashWriterQueue)
+    {
+        flashWriterQueue = xQueueCreate(MAX_NUM_OF_OTA_DATA_BUFFERS, sizeof(OtaDataEvent_t *));
+        flashWriterMutex = xSemaphoreCreateMutex();
+
+        if ((NULL == flashWriterQueue) || (NULL == flashWriterMutex) ||
+            (pdPASS != xTaskCreate(prvOtaFlashWriterTask,
+                                   "OTA_FlashWriter",
+                                   FLASH_WRITER_TASK_STACK_SIZE,
+                                   NULL,
+                                   FLASH_WRITER_TASK_PRIORITY,
+                                   NULL)))
+        {
+            LogError(("Failed to start OTA flash writer task!\n"));
+            return;
+        }
+    }
+#endif
+
     initEvent.eventId = OtaAgentEventRequestJobDocument;
     OtaSendEvent_FreeRTOS(&initEvent);
 
@@ -431,9 +573,10 @@ static void requestJobDocumentHandler(void)
  * Function Name: initMqttDownloader
  * Description  : Initializes the MQTT File downloader library
  * Argument     : jobFields
- * Return Value : None
+ * Return Value : true   Initialization is successful
+ *              : false  The file does not fit in the received-block bitmap
  *****************************************************************************/
-static void initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields)
+static bool initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields)
 {
     char thingName[MAX_THING_NAME_SIZE + 1] = {0};
     size_t thingNameLength                  = 0U;
@@ -443,9 +586,16 @@ static void initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields)
     numOfBlocksRemaining += (((jobFields->fileSize %
                             mqttFileDownloader_CONFIG_BLOCK_SIZE) > 0) ? 1 : 0);
 
+    if (numOfBlocksRemaining > OTA_MAX_FILE_BLOCKS)
+    {
+        LogError(("OTA file has %u blocks, only %u are supported.\n",
+                  numOfBlocksRemaining, OTA_MAX_FILE_BLOCKS));
+        return false;
+    }
+
+    numOfBlocksTotal = numOfBlocksRemaining;
     currentFileId = (uint8_t)jobFields->fileId; // cast the file ID
-    currentBlockOffset = 0;
-    totalBytesReceived = 0;
+    resetDownloadWindow();
 
     mqttWrapper_getThingName(thingName, &thingNameLength);
 
@@ -466,6 +616,8 @@ static void initMqttDownloader(AfrOtaJobDocumentFields_t *jobFields)
     mqttWrapper_subscribe(mqttFileDownloaderContext.topicStreamData,
                           mqttFileDownloaderContext.topicStreamDataLength);
     LogInfo(("SUBSCRIBE to topic %s\n", mqttFileDownloaderContext.topicStreamData));
+
+    return true;
 }
 /******************************************************************************
  End of function initMqttDownloader
@@ -508,39 +660,522 @@ static bool convertSignatureToDER(AfrOtaJobDocumentFields_t *jobFields)
 /******************************************************************************
  * Function Name: handleMqttStreamsBlockArrived
  * Description  : Proccesses the received data block from MQTT File downloader
- * Arguments    : data
+ * Arguments    : blockId
+ *              : data
  *              : dataLength
  * Return Value : Size of received data block in bytes
  *****************************************************************************/
-static int16_t handleMqttStreamsBlockArrived(uint8_t *data,
+static int16_t handleMqttStreamsBlockArrived(int32_t blockId,
+                                             uint8_t *data,
                                              size_t dataLength)
 {
     int16_t writeblockRes = -1;
 
-    LogInfo(("Downloaded block %u of %u. \n", currentBlockOffset, (currentBlockOffset + numOfBlocksRemaining)));
+    LogInfo(("Downloaded block %d (%u of %u). \n", blockId, (currentBlockOffset + 1U), numOfBlocksTotal));
 
-    writeblockRes = otaPal_WriteBlock(&jobFields,
-                                      totalBytesReceived,
+    /* Blocks are handed over in file order, see writeParkedBlocks(). */
+    if (OTA_FILE_TYPE_IMAGE != currentFileType)
+    {
+        OtaImageDecoderStatus_t decodeRes = otaImageDecoder_Process(&imageDecoder, data, (uint32_t)dataLength);
+
+        if (OtaImageDecoderSuccess != decodeRes)
+        {
+            LogError(("Failed to decode block %d, error = %d.\n", blockId, decodeRes));
+            return 0;
+        }
+
+        return (int16_t)dataLength;
+    }
+
+    /* The data event buffer is already padded, so it is programmed without a copy. */
+    writeblockRes = otaPal_WritePaddedBlock(&jobFields,
+                                      (uint32_t)blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE,
                                       data,
                                       dataLength);
 
-    if (writeblockRes > 0)
-    {
-        totalBytesReceived += writeblockRes;
-    }
-    
     return writeblockRes;
 }
 /******************************************************************************
  End of function handleMqttStreamsBlockArrived
  *****************************************************************************/
 
+/******************************************************************************
+ * Function Name: readBaseImage
+ * Description  : Reads the running image, the base of a delta file
+ * Arguments    : offset
+ *              : pBuffer
+ *              : length
+ * Return Value : true   The bytes were read
+ *              : false  The bytes are not in the running image
+ *****************************************************************************/
+static bool readBaseImage(uint32_t offset, uint8_t * const pBuffer, uint32_t length)
+{
+    return otaPal_ReadActiveImage(offset, pBuffer, length);
+}
+/******************************************************************************
+ End of function readBaseImage
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: writeDecodedImage
+ * Description  : Programs a part of the image rebuilt from an encoded file
+ * Arguments    : offset
+ *              : pData
+ *              : length
+ * Return Value : true   The part was programmed
+ *              : false  Failed to program the part
+ *****************************************************************************/
+static bool writeDecodedImage(uint32_t offset, uint8_t * const pData, uint32_t length)
+{
+    return ((int16_t)length == otaPal_WritePaddedBlock(&jobFields, offset, pData, length));
+}
+/******************************************************************************
+ End of function writeDecodedImage
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: isBlockReceived
+ * Description  : Checks the received-block bitmap
+ * Argument     : blockId
+ * Return Value : true   The block is already written
+ *              : false  The block is still missing
+ *****************************************************************************/
+static bool isBlockReceived(uint32_t blockId)
+{
+    return (0U != (receivedBlockBitmap[blockId / 8U] & (uint8_t)(1U << (blockId % 8U))));
+}
+/******************************************************************************
+ End of function isBlockReceived
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: resetDownloadWindow
+ * Description  : Clears the received-block bitmap, the in-flight requests
+ *              : and the block counters
+ * Return Value : None
+ *****************************************************************************/
+static void resetDownloadWindow(void)
+{
+    memset(receivedBlockBitmap, 0x00, sizeof(receivedBlockBitmap));
+
+    for (uint32_t i = 0; i < OTA_DOWNLOAD_WINDOW_SIZE; i++)
+    {
+        inFlightBlockIds[i] = NO_BLOCK_IN_FLIGHT;
+        inFlightRequestTicks[i] = 0;
+
+        /* The buffers themselves are returned by resetOtaBuffers(). */
+        parkedBlocks[i] = NULL;
+    }
+
+    nextBlockToWrite = 0;
+    currentBlockOffset = 0;
+    totalBytesReceived = 0;
+}
+/******************************************************************************
+ End of function resetDownloadWindow
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: fillDownloadWindow
+ * Description  : Requests missing blocks until OTA_DOWNLOAD_WINDOW_SIZE
+ *              : requests are in flight. Only the OTA_DOWNLOAD_WINDOW_SIZE
+ *              : blocks starting at nextBlockToWrite are requested, so that
+ *              : every block which arrives early can be parked until it is
+ *              : its turn to be written. A request older than
+ *              : OTA_BLOCK_REQUEST_TIMEOUT_MS is considered lost and its
+ *              : slot is reused for the lowest missing block.
+ * Argument     : retryAll - true to drop every in-flight request, e.g. after
+ *              :            nothing has arrived for a while or a reconnect
+ * Return Value : None
+ *****************************************************************************/
+static void fillDownloadWindow(bool retryAll)
+{
+    TickType_t now         = xTaskGetTickCount();
+    uint32_t   candidate   = nextBlockToWrite;
+    uint32_t   windowEnd   = nextBlockToWrite + OTA_DOWNLOAD_WINDOW_SIZE;
+    uint32_t   numInFlight = 0;
+    uint32_t   freeBuffers = getFreeOTABuffers();
+    uint32_t   slot;
+    uint32_t   i;
+    bool       inFlight;
+
+    if (windowEnd > numOfBlocksTotal)
+    {
+        windowEnd = numOfBlocksTotal;
+    }
+
+    /* Free the slots of requests that are not going to be answered. */
+    for (slot = 0; slot < OTA_DOWNLOAD_WINDOW_SIZE; slot++)
+    {
+        if ((NO_BLOCK_IN_FLIGHT != inFlightBlockIds[slot]) &&
+            ((true == retryAll) ||
+             ((now - inFlightRequestTicks[slot]) >= pdMS_TO_TICKS(OTA_BLOCK_REQUEST_TIMEOUT_MS))))
+        {
+            LogInfo(("Block %d timed out, requesting it again.\n", inFlightBlockIds[slot]));
+            inFlightBlockIds[slot] = NO_BLOCK_IN_FLIGHT;
+        }
+
+        if (NO_BLOCK_IN_FLIGHT != inFlightBlockIds[slot])
+        {
+            numInFlight++;
+        }
+    }
+
+    for (slot = 0; slot < OTA_DOWNLOAD_WINDOW_SIZE; slot++)
+    {
+        if (NO_BLOCK_IN_FLIGHT != inFlightBlockIds[slot])
+        {
+            continue;
+        }
+
+        /* Do not request more blocks than there are buffers to receive them,
+         * e.g. while the flash writer still holds some of them. */
+        if (numInFlight >= freeBuffers)
+        {
+            break;
+        }
+
+        /* Find the lowest block which is neither received nor requested. */
+        for (; candidate < windowEnd; candidate++)
+        {
+            inFlight = false;
+
+            for (i = 0; i < OTA_DOWNLOAD_WINDOW_SIZE; i++)
+            {
+                if ((int32_t)candidate == inFlightBlockIds[i])
+                {
+                    inFlight = true;
+                    break;
+                }
+            }
+
+            if ((false == inFlight) && (false == isBlockReceived(candidate)))
+            {
+                break;
+            }
+        }
+
+        if (candidate >= windowEnd)
+        {
+            break;
+        }
+
+        inFlightBlockIds[slot] = (int32_t)candidate;
+        inFlightRequestTicks[slot] = now;
+        requestDataBlock(candidate);
+        numInFlight++;
+        candidate++;
+    }
+}
+/******************************************************************************
+ End of function fillDownloadWindow
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: writeParkedBlocks
+ * Description  : Hands the parked blocks which continue the written part of
+ *              : the file to writeFileBlock(), in file order
+ * Return Value : None
+ *****************************************************************************/
+static void writeParkedBlocks(void)
+{
+    OtaDataEvent_t *pxBlock;
+
+    while (nextBlockToWrite < numOfBlocksTotal)
+    {
+        pxBlock = parkedBlocks[nextBlockToWrite % OTA_DOWNLOAD_WINDOW_SIZE];
+
+        if ((NULL == pxBlock) || ((uint32_t)pxBlock->blockId != nextBlockToWrite))
+        {
+            break;
+        }
+
+        parkedBlocks[nextBlockToWrite % OTA_DOWNLOAD_WINDOW_SIZE] = NULL;
+        writeFileBlock(pxBlock);
+        nextBlockToWrite++;
+    }
+}
+/******************************************************************************
+ End of function writeParkedBlocks
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: writeFileBlock
+ * Description  : Programs a received block to flash. With OTA_ASYNC_FLASH_WRITE
+ *              : the block is queued to the flash writer task, otherwise it is
+ *              : programmed here. Either way OtaAgentEventWroteFileBlock
+ *              : reports the result and returns the buffer.
+ * Argument     : pxBlock
+ * Return Value : None
+ *****************************************************************************/
+static void writeFileBlock(OtaDataEvent_t *pxBlock)
+{
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+    /* The queue holds one entry per data buffer, so this never blocks. */
+    (void)xQueueSendToBack(flashWriterQueue, &pxBlock, portMAX_DELAY);
+#else
+    OtaEventMsg_t doneEvent = {0};
+
+    pxBlock->writeResult = handleMqttStreamsBlockArrived(pxBlock->blockId,
+                                                         pxBlock->data,
+                                                         pxBlock->dataLength);
+
+    doneEvent.dataEvent = pxBlock;
+    doneEvent.eventId = OtaAgentEventWroteFileBlock;
+    OtaSendEvent_FreeRTOS(&doneEvent);
+#endif
+}
+/******************************************************************************
+ End of function writeFileBlock
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: drainFlashWriter
+ * Description  : Waits until the flash writer task has programmed every
+ *              : queued block and is idle
+ * Return Value : None
+ *****************************************************************************/
+static void drainFlashWriter(void)
+{
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+    bool idle = false;
+
+    if (NULL == flashWriterQueue)
+    {
+        return;
+    }
+
+    while (false == idle)
+    {
+        /* The writer only dequeues while holding the mutex, so an empty queue
+         * seen under the mutex means that nothing is being programmed either. */
+        if (pdTRUE == xSemaphoreTake(flashWriterMutex, portMAX_DELAY))
+        {
+            idle = (0U == uxQueueMessagesWaiting(flashWriterQueue));
+            (void)xSemaphoreGive(flashWriterMutex);
+        }
+
+        if (false == idle)
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+#endif
+}
+/******************************************************************************
+ End of function drainFlashWriter
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: failFileDownload
+ * Description  : Terminates the current download after a block could not be
+ *              : written, and requests a new job document
+ * Return Value : None
+ *****************************************************************************/
+static void failFileDownload(void)
+{
+    OtaEventMsg_t nextEvent = {0};
+
+    LogError(("Failed to write the downloaded OTA file block, "
+            "please check the format of the update firmware.\n"
+            "Terminating the OTA job...\n"));
+
+    /* Blocks still queued for programming belong to the terminated download */
+    drainFlashWriter();
+    resetOtaBuffers();
+
+    /* Reset block counters */
+    resetDownloadWindow();
+    clearDownloadJournal();
+
+    sendFailedMessage();
+    vTaskDelay(pdMS_TO_TICKS(5000));
+
+    /* Request new job document */
+    nextEvent.eventId = OtaAgentEventRequestJobDocument;
+    OtaSendEvent_FreeRTOS(&nextEvent);
+}
+/******************************************************************************
+ End of function failFileDownload
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: saveDownloadJournal
+ * Description  : Saves the number of blocks written so far to the download
+ *              : journal
+ * Return Value : None
+ *****************************************************************************/
+static void saveDownloadJournal(void)
+{
+#if (OTA_DOWNLOAD_JOURNAL_INTERVAL > 0)
+    OtaDownloadJournal_t journal = {0};
+    lfs_file_t file;
+    lfs_ssize_t lfs_err;
+
+    journal.magic = OTA_JOURNAL_MAGIC;
+    strncpy(journal.jobId, globalJobId, MAX_JOB_ID_LENGTH - 1U);
+    journal.fileId = currentFileId;
+    journal.fileSize = jobFields.fileSize;
+    journal.blocksWritten = currentBlockOffset;
+    journal.bytesWritten = totalBytesReceived;
+
+    /* littlefs commits the file on close, so a reset leaves either the old or the new journal. */
+    littlFs_lock();
+    lfs_err = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, OTA_JOURNAL_FILE_NAME,
+                            LFS_O_WRONLY | LFS_O_TRUNC | LFS_O_CREAT);
+
+    if (LFS_ERR_OK == lfs_err)
+    {
+        lfs_err = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, &file, &journal, sizeof(journal));
+        (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+    }
+    littlFs_unlock();
+
+    if (lfs_err < 0)
+    {
+        LogWarn(("Failed to save the OTA download journal, error = %d\n", (int)lfs_err));
+    }
+#endif
+}
+/******************************************************************************
+ End of function saveDownloadJournal
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: clearDownloadJournal
+ * Description  : Removes the download journal once the download is finished
+ *              : or abandoned
+ * Return Value : None
+ *****************************************************************************/
+static void clearDownloadJournal(void)
+{
+#if (OTA_DOWNLOAD_JOURNAL_INTERVAL > 0)
+    littlFs_lock();
+    (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, OTA_JOURNAL_FILE_NAME);
+    littlFs_unlock();
+#endif
+}
+/******************************************************************************
+ End of function clearDownloadJournal
+ *****************************************************************************/
+
+/******************************************************************************
+ * Function Name: resumeFileDownload
+ * Description  : Opens the OTA file at the block recorded in the download
+ *              : journal, if the journal belongs to the current job
+ * Return Value : true   The download continues from the journal
+ *              : false  The file has to be downloaded from the beginning
+ *****************************************************************************/
+static bool resumeFileDownload(void)
+{
+#if (OTA_DOWNLOAD_JOURNAL_INTERVAL > 0)
+    OtaDownloadJournal_t journal = {0};
+    lfs_file_t file;
+    lfs_ssize_t lfs_ret;
+
+    littlFs_lock();
+    lfs_ret = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, OTA_JOURNAL_FILE_NAME, LFS_O_RDONLY);
+
+    if (LFS_ERR_OK != lfs_ret)
+    {
+        littlFs_unlock();
+        return false;
+    }
+
+    lfs_ret = lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, &file, &journal, sizeof(journal));
+    (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+    littlFs_unlock();
+
+    if ((sizeof(journal) != (size_t)lfs_ret) ||
+        (OTA_JOURNAL_MAGIC != journal.magic) ||
+        (0 != strncmp(journal.jobId, globalJobId, MAX_JOB_ID_LENGTH)) ||
+        (currentFileId != journal.fileId) ||
+        (jobFields.fileSize != journal.fileSize) ||
+        (0U == journal.blocksWritten) ||
+        (journal.blocksWritten >= numOfBlocksTotal))
+    {
+        return false;
+    }
+
+    if (OtaPalJobDocFileCreated != otaPal_ResumeFileForRx(&jobFields,
+                                      journal.blocksWritten * mqttFileDownloader_CONFIG_BLOCK_SIZE))
+    {
+        return false;
+    }
+
+    for (uint32_t blockId = 0; blockId < journal.blocksWritten; blockId++)
+    {
+        receivedBlockBitmap[blockId / 8U] |= (uint8_t)(1U << (blockId % 8U));
+    }
+
+    nextBlockToWrite = journal.blocksWritten;
+    currentBlockOffset = journal.blocksWritten;
+    numOfBlocksRemaining = numOfBlocksTotal - journal.blocksWritten;
+    totalBytesReceived = journal.bytesWritten;
+
+    LogInfo(("Resuming the download of job %s at block %u of %u.\n",
+             globalJobId, journal.blocksWritten, numOfBlocksTotal));
+
+    return true;
+#else
+    return false;
+#endif
+}
+/******************************************************************************
+ End of function resumeFileDownload
+ *****************************************************************************/
+
+#if (OTA_ASYNC_FLASH_WRITE == 1)
+/******************************************************************************
+ * Function Name: prvOtaFlashWriterTask
+ * Description  : Programs the blocks queued by the OTA agent, so that the agent
+ *              : can receive the next blocks while the code flash is busy
+ * Argument     : pvParam
+ * Return Value : None
+ *****************************************************************************/
+static void prvOtaFlashWriterTask(void *pvParam)
+{
+    OtaDataEvent_t *pxBlock   = NULL;
+    OtaEventMsg_t   doneEvent = {0};
+
+    (void)pvParam;
+
+    for (;;)
+    {
+        /* Peek first and dequeue under the mutex, see drainFlashWriter(). */
+        if (pdTRUE == xQueuePeek(flashWriterQueue, &pxBlock, portMAX_DELAY))
+        {
+            (void)xSemaphoreTake(flashWriterMutex, portMAX_DELAY);
+
+            if (pdTRUE == xQueueReceive(flashWriterQueue, &pxBlock, 0))
+            {
+                pxBlock->writeResult = handleMqttStreamsBlockArrived(pxBlock->blockId,
+                                                                     pxBlock->data,
+                                                                     pxBlock->dataLength);
+
+                /* Report completion before releasing the mutex, so that no event is
+                 * sent after drainFlashWriter() returned. */
+                doneEvent.dataEvent = pxBlock;
+                doneEvent.eventId = OtaAgentEventWroteFileBlock;
+                OtaSendEvent_FreeRTOS(&doneEvent);
+            }
+
+            (void)xSemaphoreGive(flashWriterMutex);
+        }
+    }
+}
+/******************************************************************************
+ End of function prvOtaFlashWriterTask
+ *****************************************************************************/
+#endif
+
 /******************************************************************************
  * Function Name: requestDataBlock
  * Description  : Publishes the request for data block
+ * Argument     : blockId
  * Return Value : None
  *****************************************************************************/
-static void requestDataBlock(void)
+static void requestDataBlock(uint32_t blockId)
 {
     char getStreamRequest[GET_STREAM_REQUEST_BUFFER_SIZE];
     size_t getStreamRequestLength = 0U;
@@ -554,7 +1189,7 @@ static void requestDataBlock(void)
     getStreamRequestLength = mqttDownloader_createGetDataBlockRequest((DataType_t)mqttFileDownloaderContext.dataType,
                                                                       currentFileId,
                                                                       mqttFileDownloader_CONFIG_BLOCK_SIZE,
-                                                                      (uint16_t)currentBlockOffset,
+                                                                      (uint16_t)blockId,
                                                                       NUM_OF_BLOCKS_REQUESTED,
                                                                       getStreamRequest,
                                                                       GET_STREAM_REQUEST_BUFFER_SIZE);
@@ -576,6 +1211,20 @@ static void requestDataBlock(void)
  *****************************************************************************/
 static bool closeFileHandler(void)
 {
+    if (OTA_FILE_TYPE_IMAGE != currentFileType)
+    {
+        OtaImageDecoderStatus_t decodeRes = otaImageDecoder_Finish(&imageDecoder);
+
+        if (OtaImageDecoderSuccess != decodeRes)
+        {
+            LogError(("Failed to rebuild the image, error = %d.\n", decodeRes));
+            return false;
+        }
+
+        LogInfo(("Rebuilt %u image bytes from %u downloaded bytes.\n",
+                 imageDecoder.outputProduced, jobFields.fileSize));
+    }
+
     return (OtaPalSuccess == otaPal_CloseFile(&jobFields));
 }
 /******************************************************************************
@@ -621,8 +1270,6 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler(OtaJobEventData
 
     OtaEventMsg_t nextEvent = {0};
 
-    memset(&jobFields, 0, sizeof(jobFields));
-
     /*
      * AWS IoT Jobs library:
      * Extracting the job ID from the received OTA job document.
@@ -634,6 +1281,9 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler(OtaJobEventData
     {
         if (strncmp(globalJobId, jobId, jobIdLength))
         {
+            /* The file fields of the job being downloaded are kept when the
+             * same job document is received again, e.g. after a reconnect. */
+            memset(&jobFields, 0, sizeof(jobFields));
             resetOtaBuffers();
             parseJobDocument = true;
             strncpy(globalJobId, jobId, jobIdLength);
@@ -647,6 +1297,8 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler(OtaJobEventData
     /* If no job exists, subscribe to the notify topic and wait */
     else /* the OTA job does not exist */
     {
+        memset(&jobFields, 0, sizeof(jobFields));
+
         char   thingName[MAX_THING_NAME_SIZE+1] = {0};
         size_t thingNameLength                  = 0U;
         mqttWrapper_getThingName(thingName, &thingNameLength);
@@ -729,19 +1381,42 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler(OtaJobEventData
             LogInfo(("SUBSCRIBE to topic %s\n", jobEventTopicBuffer));
 
             /* Initialize MQTT File Stream */
-            initMqttDownloader(&jobFields);
-
-            /* AWS IoT core returns the signature in a PEM format. We need to
-             * convert it to DER format for image signature verification. */
-            handled = convertSignatureToDER(&jobFields);
+            handled = initMqttDownloader(&jobFields);
 
             if (handled)
             {
-                xResult = otaPal_CreateFileForRx(&jobFields);
-            }
-            else
-            {
-                LogError(("Failed to decode the image signature to DER format."));
+                /* AWS IoT core returns the signature in a PEM format. We need to
+                 * convert it to DER format for image signature verification. */
+                handled = convertSignatureToDER(&jobFields);
+
+                if (handled)
+                {
+                    currentFileType = jobFields.fileType;
+
+                    /* An encoded file is rebuilt from its beginning, it cannot be resumed. */
+                    if ((OTA_FILE_TYPE_IMAGE == currentFileType) && (true == resumeFileDownload()))
+                    {
+                        xResult = OtaPalJobDocFileCreated;
+                    }
+                    else if (currentFileType <= OTA_FILE_TYPE_COMPRESSED)
+                    {
+                        clearDownloadJournal();
+                        xResult = otaPal_CreateFileForRx(&jobFields);
+
+                        /* A compressed file must not depend on the running image. */
+                        otaImageDecoder_Init(&imageDecoder,
+                                             (OTA_FILE_TYPE_DELTA == currentFileType) ? readBaseImage : NULL,
+                                             writeDecodedImage);
+                    }
+                    else
+                    {
+                        LogError(("Unsupported file type %u.", currentFileType));
+                    }
+                }
+                else
+                {
+                    LogError(("Failed to decode the image signature to DER format."));
+                }
             }
         }
         else
@@ -875,18 +1550,39 @@ bool otaDemo_handleIncomingMQTTMessage(char *topic,
         LogInfo(("Data block is receiving from topic: %.*s\n", topicLength, topic));
         OtaDataEvent_t *dataBuf = getOtaDataEventBuffer();
 
-        if (NULL != dataBuf)
+        if (NULL == dataBuf)
         {
-            memcpy(dataBuf->data, message, messageLength);
+            LogError(("Failed to get data event buffer!\n"));
+            return false;
         }
-        else
+
+        /*
+         * MQTT streams Library:
+         * Decode the block straight from the MQTT receive buffer into the data event
+         * buffer. The MQTT receive buffer is reused once this callback returns, so
+         * this decode is the only copy of the payload before it is programmed.
+         */
+        ret = mqttDownloader_processReceivedDataBlock(&mqttFileDownloaderContext,
+                                                      message,
+                                                      messageLength,
+                                                      &dataBuf->fileId,
+                                                      &dataBuf->blockId,
+                                                      &dataBuf->blockSize,
+                                                      dataBuf->data,
+                                                      &dataBuf->dataLength);
+
+        if ((MQTTFileDownloaderSuccess != ret) || (dataBuf->dataLength > mqttFileDownloader_CONFIG_BLOCK_SIZE))
         {
-            LogError(("Failed to get data event buffer!\n"));
+            /* The block is requested again when its request times out. */
+            LogError(("File block decoding error\n"));
+            freeOtaDataEventBuffer(dataBuf);
             return false;
         }
 
+        /* Pad up to the program unit so the flash writer needs no temporary buffer. */
+        memset(&dataBuf->data[dataBuf->dataLength], 0xFF, OTA_DATA_BUFFER_SIZE - dataBuf->dataLength);
+
         nextEvent.dataEvent = dataBuf;
-        dataBuf->dataLength = messageLength;
         nextEvent.eventId = OtaAgentEventReceivedFileBlock;
         OtaSendEvent_FreeRTOS(&nextEvent);
     }
@@ -1132,7 +1828,7 @@ static void processOTAEvents(void)
     OtaEvent_t        recvEventId         = OtaAgentEventStart;
     static OtaEvent_t lastRecvEventId     = OtaAgentEventStart;
     OtaEventMsg_t     nextEvent           = {0};
-    static int32_t    lastReceivedblockId = -1;
+    bool              retryAllBlocks      = false;
     bool              bResult             = false;
 
     OtaReceiveEvent_FreeRTOS(&recvEvent);
@@ -1157,14 +1853,17 @@ static void processOTAEvents(void)
         else if (OtaAgentEventRequestFileBlock == lastRecvEventId)
         {
             /* No current event and we have not received the new block
-             * trying sending request for new block again */
+             * trying sending request for the missing blocks again */
             recvEventId = lastRecvEventId;
+            retryAllBlocks = true;
 
-            /* It is likely that the network was disconnected and reconnected,
-             * we should wait for the MQTT connection to go up. */
-            while (!mqttWrapper_isConnected())
+            /* It is likely that the network was disconnected. The download state
+             * is kept, and the missing blocks are requested on a later timeout
+             * once the MQTT connection is up again. */
+            if (!mqttWrapper_isConnected())
             {
-                vTaskDelay(pdMS_TO_TICKS(100));
+                LogInfo(("MQTT is not connected, the download continues after reconnection.\n"));
+                return;
             }
         }
         else
@@ -1223,7 +1922,6 @@ static void processOTAEvents(void)
         {
         case OtaPalJobDocFileCreated:
             LogInfo(("Received OTA Job. \n"));
-            lastReceivedblockId = -1;
             nextEvent.eventId = OtaAgentEventRequestFileBlock;
             OtaSendEvent_FreeRTOS(&nextEvent);
             otaAgentState = OtaAgentStateCreatingFile;
@@ -1298,7 +1996,7 @@ static void processOTAEvents(void)
             LogInfo(("Starting The Download. \n"));
         }
 
-        requestDataBlock();
+        fillDownloadWindow(retryAllBlocks);
         LogInfo(("ReqSent----------------------------\n"));
         break;
 
@@ -1315,34 +2013,12 @@ static void processOTAEvents(void)
             break;
         }
 
-        uint8_t decodedData[mqttFileDownloader_CONFIG_BLOCK_SIZE];
-        size_t decodedDataLength = 0;
-        MQTTFileDownloaderStatus_t xReturnStatus;
-        int16_t result = -1;
-        int32_t fileId;
-        int32_t blockId;
-        int32_t blockSize;
+        /* The block was already decoded into the data event buffer by the MQTT callback. */
+        int32_t fileId = recvEvent.dataEvent->fileId;
+        int32_t blockId = recvEvent.dataEvent->blockId;
+        int32_t blockSize = recvEvent.dataEvent->blockSize;
 
-        /*
-         * MQTT streams Library:
-         * Extracting and decoding the received data block from the incoming MQTT message.
-         */
-        xReturnStatus = mqttDownloader_processReceivedDataBlock(
-            &mqttFileDownloaderContext,
-            recvEvent.dataEvent->data,
-            recvEvent.dataEvent->dataLength,
-            &fileId,
-            &blockId,
-            &blockSize,
-            decodedData,
-            &decodedDataLength);
-
-        if (MQTTFileDownloaderSuccess != xReturnStatus)
-        {
-            /* There was some failure in trying to decode the block. */
-            LogError(("File block decoding error\n"));
-        }
-        else if (fileId != jobFields.fileId)
+        if (fileId != jobFields.fileId)
         {
             /* Error - the file ID doesn't match with the one we received in the job document. */
             LogError(("File ID mismatched\n"));
@@ -1353,50 +2029,87 @@ static void processOTAEvents(void)
              * the last block may or may not be of exact size. */
             LogError(("File block size mismatched\n"));
         }
-        else if (blockId <= lastReceivedblockId)
+        else if ((blockId < 0) || ((uint32_t)blockId >= numOfBlocksTotal))
         {
-            /* Ignore this block. */
-            LogInfo(("Received file block #%d that received before (%d). Ignored this block\n", blockId, lastReceivedblockId));
-
-            freeOtaDataEventBuffer(recvEvent.dataEvent);
-            nextEvent.eventId = OtaAgentEventRequestFileBlock;
-            OtaSendEvent_FreeRTOS(&nextEvent);
-            break;
+            /* Error - the block does not belong to this file. */
+            LogError(("File block #%d is out of range\n", blockId));
         }
         else
         {
-            result = handleMqttStreamsBlockArrived(decodedData, decodedDataLength);
-            lastReceivedblockId = blockId;
+            /* Whatever happens next, this block no longer occupies a window slot. */
+            for (uint32_t slot = 0; slot < OTA_DOWNLOAD_WINDOW_SIZE; slot++)
+            {
+                if (blockId == inFlightBlockIds[slot])
+                {
+                    inFlightBlockIds[slot] = NO_BLOCK_IN_FLIGHT;
+                }
+            }
+
+            if (isBlockReceived((uint32_t)blockId) ||
+                ((uint32_t)blockId < nextBlockToWrite) ||
+                ((uint32_t)blockId >= (nextBlockToWrite + OTA_DOWNLOAD_WINDOW_SIZE)))
+            {
+                /* Ignore this block. A block outside the window is a late answer to a
+                 * request which has already been retried. */
+                LogInfo(("Received file block #%d that received before. Ignored this block\n", blockId));
+
+                freeOtaDataEventBuffer(recvEvent.dataEvent);
+                nextEvent.eventId = OtaAgentEventRequestFileBlock;
+                OtaSendEvent_FreeRTOS(&nextEvent);
+                break;
+            }
+
+            /* Claim the block now, so that it is not requested again while it is
+             * parked or being programmed. The buffer is released on OtaAgentEventWroteFileBlock. */
+            receivedBlockBitmap[(uint32_t)blockId / 8U] |= (uint8_t)(1U << ((uint32_t)blockId % 8U));
+            parkedBlocks[(uint32_t)blockId % OTA_DOWNLOAD_WINDOW_SIZE] = recvEvent.dataEvent;
+            writeParkedBlocks();
+
+            /* A block which had to be parked leaves a buffer for the gap in front of it. */
+            if (NULL != parkedBlocks[(uint32_t)blockId % OTA_DOWNLOAD_WINDOW_SIZE])
+            {
+                nextEvent.eventId = OtaAgentEventRequestFileBlock;
+                OtaSendEvent_FreeRTOS(&nextEvent);
+            }
+            break;
         }
 
+        /* File block is invalid */
         freeOtaDataEventBuffer(recvEvent.dataEvent);
+        failFileDownload();
+        break;
 
-        if (result > 0)
+    case OtaAgentEventWroteFileBlock:
+        LogInfo(("Wrote File Block event Received \n"));
+        LogInfo(("---------------------------------------\n"));
+
+        /* A buffer released by resetOtaBuffers() belongs to a download that was already terminated. */
+        if (false == recvEvent.dataEvent->bufferUsed)
         {
-            numOfBlocksRemaining--;
-            currentBlockOffset++;
+            LogInfo(("File block of a terminated download is ignored. \n"));
+            break;
         }
 
+        int16_t result = recvEvent.dataEvent->writeResult;
+        freeOtaDataEventBuffer(recvEvent.dataEvent);
+
         /* File block cannot be written */
-        else /* if (0 == result) */
+        if (result <= 0)
         {
-            LogError(("Failed to write the downloaded OTA file block, "
-                    "please check the format of the update firmware.\n"
-                    "Terminating the OTA job...\n"));
-
-            /* Reset block counters */
-            lastReceivedblockId = -1;
-            currentBlockOffset = 0;
-            totalBytesReceived = 0;
+            failFileDownload();
+            break;
+        }
 
-            sendFailedMessage();
-            vTaskDelay(pdMS_TO_TICKS(5000));
+        numOfBlocksRemaining--;
+        currentBlockOffset++;
+        totalBytesReceived += result;
 
-            /* Request new job document */
-            nextEvent.eventId = OtaAgentEventRequestJobDocument;
-            OtaSendEvent_FreeRTOS(&nextEvent);
-            break;
+#if (OTA_DOWNLOAD_JOURNAL_INTERVAL > 0)
+        if ((0 != numOfBlocksRemaining) && (0 == (currentBlockOffset % OTA_DOWNLOAD_JOURNAL_INTERVAL)))
+        {
+            saveDownloadJournal();
         }
+#endif
 
         if ((numOfBlocksRemaining % 10) == 0)
         {
@@ -1410,11 +2123,9 @@ static void processOTAEvents(void)
         }
         else
         {
-            if ((currentBlockOffset % NUM_OF_BLOCKS_REQUESTED) == 0)
-            {
-                nextEvent.eventId = OtaAgentEventRequestFileBlock;
-                OtaSendEvent_FreeRTOS(&nextEvent);
-            }
+            /* Refill the window now that a buffer is free again. */
+            nextEvent.eventId = OtaAgentEventRequestFileBlock;
+            OtaSendEvent_FreeRTOS(&nextEvent);
         }
 
         break;
@@ -1441,6 +2152,9 @@ static void processOTAEvents(void)
             LogError(("Failed to UNSUBSCRIBE to jobs event topic!\n"));
         }
 
+        /* The whole file is in flash, nothing is left to resume. */
+        clearDownloadJournal();
+
         if (true == closeFileHandler())
         {
             nextEvent.eventId = OtaAgentEventActivateImage;
@@ -1504,6 +2218,9 @@ static void processOTAEvents(void)
             LogError(("Failed to UNSUBSCRIBE to job event!\n"));
         }
 
+        /* Let the flash writer finish before its completion events are dropped with the queue */
+        drainFlashWriter();
+
         /* Reset the OTA Event queue */
         OtaDeinitEvent_FreeRTOS();
         OtaInitEvent_FreeRTOS();
@@ -1520,9 +2237,8 @@ static void processOTAEvents(void)
         resetOtaBuffers();
 
         /* Reset the block count */
-        currentBlockOffset = 0;
-        totalBytesReceived = 0;
-        lastReceivedblockId = -1;
+        resetDownloadWindow();
+        clearDownloadJournal();
 
         /* Start requesting for new job after suspended for some time (reset OTA-agent to initial state) */
         nextEvent.eventId = OtaAgentEventRequestJobDocument;
@@ -19,6 +19,84 @@
 #define OTA_DATA_BLOCK_SIZE    mqttFileDownloader_CONFIG_BLOCK_SIZE
 #define JOB_DOC_SIZE           (2048U)
 
+/**
+ * @brief Number of data block requests kept in flight at the same time.
+ *
+ * Each request asks the stream service for a single block, so a window of N
+ * keeps N blocks travelling to the device at once. Blocks may arrive in any
+ * order. One OTA data event buffer is reserved per in-flight block.
+ * Set to 1 to get the former stop-and-wait behaviour.
+ */
+#ifndef OTA_DOWNLOAD_WINDOW_SIZE
+#define OTA_DOWNLOAD_WINDOW_SIZE         (4U)
+#endif
+
+/**
+ * @brief Time after which a requested block that has not arrived is requested again.
+ */
+#ifndef OTA_BLOCK_REQUEST_TIMEOUT_MS
+#define OTA_BLOCK_REQUEST_TIMEOUT_MS     (3000U)
+#endif
+
+/**
+ * @brief Maximum number of blocks in one OTA file. This sizes the received-block bitmap.
+ * The default covers a 1 MB code flash bank.
+ */
+#ifndef OTA_MAX_FILE_BLOCKS
+#define OTA_MAX_FILE_BLOCKS              ((1024U * 1024U) / OTA_DATA_BLOCK_SIZE)
+#endif
+
+#define OTA_BLOCK_BITMAP_SIZE            ((OTA_MAX_FILE_BLOCKS + 7U) / 8U)
+
+/**
+ * @brief Code flash program unit. Must match OTA_PAL_PROGRAM_UNIT_SIZE of the OTA PAL.
+ */
+#define OTA_DATA_PROGRAM_UNIT_SIZE       (128U)
+
+/**
+ * @brief Size of an OTA data event buffer: one decoded block rounded up to the program unit,
+ * so that the buffer can be programmed to flash without a padded copy.
+ */
+#define OTA_DATA_BUFFER_SIZE             (((OTA_DATA_BLOCK_SIZE + OTA_DATA_PROGRAM_UNIT_SIZE - 1U) / \
+                                           OTA_DATA_PROGRAM_UNIT_SIZE) * OTA_DATA_PROGRAM_UNIT_SIZE)
+
+/**
+ * @brief Program received blocks on a dedicated flash writer task.
+ *
+ * When enabled, the OTA agent hands each decoded block to the flash writer task and keeps
+ * receiving and requesting blocks while the code flash is being programmed. The data event
+ * buffers (one per window slot) are the staging buffers between the two tasks.
+ * Set to 0 to program each block on the OTA agent task.
+ */
+#ifndef OTA_ASYNC_FLASH_WRITE
+#define OTA_ASYNC_FLASH_WRITE            (1)
+#endif
+
+/**
+ * @brief Number of written blocks after which the download progress is saved to the
+ * download journal in littlefs. After a reset the download of the same job continues
+ * from the last saved block. Set to 0 to disable the journal.
+ */
+#ifndef OTA_DOWNLOAD_JOURNAL_INTERVAL
+#define OTA_DOWNLOAD_JOURNAL_INTERVAL    (16U)
+#endif
+
+/**
+ * @brief Values of the fileType field of the job document.
+ *
+ * OTA_FILE_TYPE_IMAGE is a plain RSU image. OTA_FILE_TYPE_DELTA is an encoded image that
+ * is rebuilt on the device from the running image, OTA_FILE_TYPE_COMPRESSED an encoded image
+ * that is rebuilt from itself alone, see ota_image_decoder.h.
+ * Encoded files are signed over the rebuilt image, not over the transferred file.
+ */
+#define OTA_FILE_TYPE_IMAGE              (0U)
+#define OTA_FILE_TYPE_DELTA              (1U)
+#define OTA_FILE_TYPE_COMPRESSED         (2U)
+
+#if OTA_DOWNLOAD_WINDOW_SIZE < 1
+#error "OTA_DOWNLOAD_WINDOW_SIZE must be at least 1."
+#endif
+
 typedef enum OtaEvent
 {
     OtaAgentEventStart = 0,           /*!< @brief Start the OTA state machine */
@@ -28,6 +106,7 @@ typedef enum OtaEvent
     OtaAgentEventCreateFile,          /*!< @brief Event to create a file. */
     OtaAgentEventRequestFileBlock,    /*!< @brief Event to request file blocks. */
     OtaAgentEventReceivedFileBlock,   /*!< @brief Event to trigger when file block is received. */
+    OtaAgentEventWroteFileBlock,      /*!< @brief Event to trigger when file block is programmed to flash. */
     OtaAgentEventCloseFile,           /*!< @brief Event to trigger closing file. */
     OtaAgentEventActivateImage,       /*!< @brief Event to activate the new image. */
     OtaAgentEventVersionCheck,        /*!< @brief Event to verify the new image version. */
@@ -69,9 +148,13 @@ typedef enum OtaState
 
 typedef struct OtaDataEvent
 {
-    uint8_t data[OTA_DATA_BLOCK_SIZE * 2]; /*!< Buffer for storing event information. */
-    size_t dataLength;                       /*!< Total space required for the event. */
-    bool bufferUsed;                         /*!< Flag set when buffer is used otherwise cleared. */
+    uint8_t data[OTA_DATA_BUFFER_SIZE]; /*!< Decoded block, padded with 0xFF up to the program unit. */
+    size_t dataLength;                  /*!< Number of decoded bytes in data. */
+    int32_t fileId;                     /*!< File ID decoded from the stream response. */
+    int32_t blockId;                    /*!< Block ID decoded from the stream response. */
+    int32_t blockSize;                  /*!< Block size decoded from the stream response. */
+    int16_t writeResult;                /*!< Bytes programmed by the flash writer, 0 on error. */
+    bool bufferUsed;                    /*!< Flag set when buffer is used otherwise cleared. */
 } OtaDataEvent_t;
 
 typedef struct OtaJobEventData
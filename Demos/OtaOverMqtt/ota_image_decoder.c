@@ -0,0 +1,625 @@
+/*
+* Copyright (c) 2025 Renesas Electronics Corporation and/or its affiliates
+*
+* SPDX-License-Identifier: MIT
+*/
+
+/***********************************************************************************************************************
+ * File Name    : ota_image_decoder.c
+ * Description  : Streaming decoder for encoded OTA files, see ota_image_decoder.h for the file layout.
+ **********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ Includes   <System Includes> , "Project Includes"
+ *********************************************************************************************************************/
+#include <string.h>
+
+#include "ota_image_decoder.h"
+
+/**********************************************************************************************************************
+ * Macro definitions
+ *********************************************************************************************************************/
+#define LITERAL_ARGUMENTS_SIZE      (2U)
+#define COPY_BASE_ARGUMENTS_SIZE    (6U)
+#define COPY_OUTPUT_ARGUMENTS_SIZE  (4U)
+#define WINDOW_MASK                 (OTA_IMAGE_WINDOW_SIZE - 1U)
+
+#if (OTA_IMAGE_WINDOW_SIZE & WINDOW_MASK) != 0
+#error "OTA_IMAGE_WINDOW_SIZE must be a power of two."
+#endif
+
+/**********************************************************************************************************************
+ Private (static) variables
+ *********************************************************************************************************************/
+/* CRC-32 (IEEE 802.3, reflected) of each nibble value. */
+static const uint32_t s_crc32_nibble_table[16] =
+{
+    0x00000000U, 0x1DB71064U, 0x3B6E20C8U, 0x26D930ACU, 0x76DC4190U, 0x6B6B51F4U, 0x4DB26158U, 0x5005713CU,
+    0xEDB88320U, 0xF00F9344U, 0xD6D6A3E8U, 0xCB61B38CU, 0x9B64C2B0U, 0x86D3D2D4U, 0xA00AE278U, 0xBDBDF21CU
+};
+
+/**********************************************************************************************************************
+ Private (static) functions
+ *********************************************************************************************************************/
+static uint32_t read_u32 (const uint8_t * p);
+static uint32_t crc32_update (uint32_t crc, const uint8_t * p, uint32_t length);
+static OtaImageDecoderStatus_t fail (OtaImageDecoder_t * pDecoder, OtaImageDecoderStatus_t status);
+static OtaImageDecoderStatus_t flush_staging (OtaImageDecoder_t * pDecoder);
+static void store_window (OtaImageDecoder_t * pDecoder, const uint8_t * pData, uint32_t length);
+static OtaImageDecoderStatus_t advance_staging (OtaImageDecoder_t * pDecoder, uint32_t length);
+static OtaImageDecoderStatus_t emit_literal (OtaImageDecoder_t * pDecoder, const uint8_t * pData, uint32_t length);
+static OtaImageDecoderStatus_t emit_base (OtaImageDecoder_t * pDecoder, uint32_t offset, uint32_t length);
+static OtaImageDecoderStatus_t emit_output (OtaImageDecoder_t * pDecoder, uint32_t distance, uint32_t length);
+static OtaImageDecoderStatus_t check_base (OtaImageDecoder_t * pDecoder, uint32_t expectedCrc);
+static OtaImageDecoderStatus_t parse_header (OtaImageDecoder_t * pDecoder);
+static OtaImageDecoderStatus_t parse_arguments (OtaImageDecoder_t * pDecoder);
+
+/* Function Name: read_u32 */
+/**********************************************************************************************************************
+ * @brief Read a little endian 32 bit value.
+ * @param[in] p
+ * @return uint32_t
+ *********************************************************************************************************************/
+static uint32_t read_u32(const uint8_t * p)
+{
+    return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+/**********************************************************************************************************************
+ End of function read_u32
+ *********************************************************************************************************************/
+
+/* Function Name: crc32_update */
+/**********************************************************************************************************************
+ * @brief Continue a CRC-32 over the next bytes. The CRC starts and ends inverted, as zlib crc32().
+ * @param[in] crc
+ * @param[in] p
+ * @param[in] length
+ * @return uint32_t
+ *********************************************************************************************************************/
+static uint32_t crc32_update(uint32_t crc, const uint8_t * p, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        crc ^= p[i];
+        crc = (crc >> 4) ^ s_crc32_nibble_table[crc & 0x0FU];
+        crc = (crc >> 4) ^ s_crc32_nibble_table[crc & 0x0FU];
+    }
+
+    return crc;
+}
+/**********************************************************************************************************************
+ End of function crc32_update
+ *********************************************************************************************************************/
+
+/* Function Name: fail */
+/**********************************************************************************************************************
+ * @brief Stop decoding the file.
+ * @param[in] pDecoder
+ * @param[in] status
+ * @return status
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t fail(OtaImageDecoder_t * pDecoder, OtaImageDecoderStatus_t status)
+{
+    pDecoder->state  = OtaImageDecoderStateError;
+    pDecoder->status = status;
+
+    return status;
+}
+/**********************************************************************************************************************
+ End of function fail
+ *********************************************************************************************************************/
+
+/* Function Name: flush_staging */
+/**********************************************************************************************************************
+ * @brief Hand the staged bytes to the write callback, padded with 0xFF.
+ * @param[in] pDecoder
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t flush_staging(OtaImageDecoder_t * pDecoder)
+{
+    if (0U == pDecoder->stagingLength)
+    {
+        return OtaImageDecoderSuccess;
+    }
+
+    memset(&pDecoder->staging[pDecoder->stagingLength], 0xFF,
+           OTA_IMAGE_DECODER_STAGING_SIZE - pDecoder->stagingLength);
+
+    if (false == pDecoder->writeOutput(pDecoder->stagingOffset, pDecoder->staging, pDecoder->stagingLength))
+    {
+        return fail(pDecoder, OtaImageDecoderWriteFailed);
+    }
+
+    pDecoder->stagingOffset += pDecoder->stagingLength;
+    pDecoder->stagingLength = 0U;
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function flush_staging
+ *********************************************************************************************************************/
+
+/* Function Name: store_window */
+/**********************************************************************************************************************
+ * @brief Keep rebuilt bytes for OTA_IMAGE_OP_COPY_OUTPUT. Called before outputProduced counts them.
+ * @param[in] pDecoder
+ * @param[in] pData
+ * @param[in] length
+ * @return void
+ *********************************************************************************************************************/
+static void store_window(OtaImageDecoder_t * pDecoder, const uint8_t * pData, uint32_t length)
+{
+    uint32_t position = pDecoder->outputProduced;
+
+    for (uint32_t i = 0; i < length; i++)
+    {
+        pDecoder->window[(position + i) & WINDOW_MASK] = pData[i];
+    }
+}
+/**********************************************************************************************************************
+ End of function store_window
+ *********************************************************************************************************************/
+
+/* Function Name: advance_staging */
+/**********************************************************************************************************************
+ * @brief Count bytes placed at the end of the staging buffer and flush it when it is full.
+ * @param[in] pDecoder
+ * @param[in] length
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t advance_staging(OtaImageDecoder_t * pDecoder, uint32_t length)
+{
+    pDecoder->stagingLength  += length;
+    pDecoder->outputProduced += length;
+
+    if (OTA_IMAGE_DECODER_STAGING_SIZE == pDecoder->stagingLength)
+    {
+        return flush_staging(pDecoder);
+    }
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function advance_staging
+ *********************************************************************************************************************/
+
+/* Function Name: emit_literal */
+/**********************************************************************************************************************
+ * @brief Append bytes of the encoded file to the rebuilt image.
+ * @param[in] pDecoder
+ * @param[in] pData
+ * @param[in] length
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t emit_literal(OtaImageDecoder_t * pDecoder, const uint8_t * pData, uint32_t length)
+{
+    uint32_t chunk;
+
+    while (length > 0U)
+    {
+        chunk = OTA_IMAGE_DECODER_STAGING_SIZE - pDecoder->stagingLength;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        memcpy(&pDecoder->staging[pDecoder->stagingLength], pData, chunk);
+        store_window(pDecoder, pData, chunk);
+        pData  += chunk;
+        length -= chunk;
+
+        if (OtaImageDecoderSuccess != advance_staging(pDecoder, chunk))
+        {
+            return pDecoder->status;
+        }
+    }
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function emit_literal
+ *********************************************************************************************************************/
+
+/* Function Name: emit_base */
+/**********************************************************************************************************************
+ * @brief Append bytes of the base to the rebuilt image.
+ * @param[in] pDecoder
+ * @param[in] offset
+ * @param[in] length
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t emit_base(OtaImageDecoder_t * pDecoder, uint32_t offset, uint32_t length)
+{
+    uint32_t chunk;
+
+    while (length > 0U)
+    {
+        chunk = OTA_IMAGE_DECODER_STAGING_SIZE - pDecoder->stagingLength;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        if (false == pDecoder->readBase(offset, &pDecoder->staging[pDecoder->stagingLength], chunk))
+        {
+            return fail(pDecoder, OtaImageDecoderBaseMismatch);
+        }
+
+        store_window(pDecoder, &pDecoder->staging[pDecoder->stagingLength], chunk);
+        offset += chunk;
+        length -= chunk;
+
+        if (OtaImageDecoderSuccess != advance_staging(pDecoder, chunk))
+        {
+            return pDecoder->status;
+        }
+    }
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function emit_base
+ *********************************************************************************************************************/
+
+/* Function Name: emit_output */
+/**********************************************************************************************************************
+ * @brief Append a copy of earlier rebuilt bytes to the rebuilt image.
+ * @param[in] pDecoder
+ * @param[in] distance
+ * @param[in] length
+ * @return OtaImageDecoderStatus_t
+ * @note  Bytes are copied one at a time, so a copy longer than its distance repeats a pattern.
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t emit_output(OtaImageDecoder_t * pDecoder, uint32_t distance, uint32_t length)
+{
+    uint32_t chunk;
+    uint32_t position;
+    uint8_t  value;
+
+    while (length > 0U)
+    {
+        chunk = OTA_IMAGE_DECODER_STAGING_SIZE - pDecoder->stagingLength;
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        position = pDecoder->outputProduced;
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            value = pDecoder->window[(position + i - distance) & WINDOW_MASK];
+            pDecoder->window[(position + i) & WINDOW_MASK] = value;
+            pDecoder->staging[pDecoder->stagingLength + i] = value;
+        }
+        length -= chunk;
+
+        if (OtaImageDecoderSuccess != advance_staging(pDecoder, chunk))
+        {
+            return pDecoder->status;
+        }
+    }
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function emit_output
+ *********************************************************************************************************************/
+
+/* Function Name: check_base */
+/**********************************************************************************************************************
+ * @brief Check that the base is the image the encoded file was made for.
+ * @param[in] pDecoder
+ * @param[in] expectedCrc
+ * @return OtaImageDecoderStatus_t
+ * @note  The staging buffer is empty while the header is parsed, so it is used as the read buffer.
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t check_base(OtaImageDecoder_t * pDecoder, uint32_t expectedCrc)
+{
+    uint32_t crc = 0xFFFFFFFFU;
+    uint32_t offset = 0U;
+    uint32_t chunk;
+
+    if ((NULL == pDecoder->readBase) && (0U != pDecoder->baseSize))
+    {
+        return fail(pDecoder, OtaImageDecoderBaseMismatch);
+    }
+
+    while (offset < pDecoder->baseSize)
+    {
+        chunk = pDecoder->baseSize - offset;
+        if (chunk > OTA_IMAGE_DECODER_STAGING_SIZE)
+        {
+            chunk = OTA_IMAGE_DECODER_STAGING_SIZE;
+        }
+
+        if (false == pDecoder->readBase(offset, pDecoder->staging, chunk))
+        {
+            return fail(pDecoder, OtaImageDecoderBaseMismatch);
+        }
+
+        crc = crc32_update(crc, pDecoder->staging, chunk);
+        offset += chunk;
+    }
+
+    if ((crc ^ 0xFFFFFFFFU) != expectedCrc)
+    {
+        return fail(pDecoder, OtaImageDecoderBaseMismatch);
+    }
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function check_base
+ *********************************************************************************************************************/
+
+/* Function Name: parse_header */
+/**********************************************************************************************************************
+ * @brief Check the collected header and the base it names.
+ * @param[in] pDecoder
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t parse_header(OtaImageDecoder_t * pDecoder)
+{
+    const uint8_t * p = pDecoder->field;
+
+    if ((0 != memcmp(p, OTA_IMAGE_MAGIC, 4)) || (OTA_IMAGE_VERSION != p[4]))
+    {
+        return fail(pDecoder, OtaImageDecoderBadHeader);
+    }
+
+    pDecoder->outputSize = read_u32(&p[8]);
+    pDecoder->baseSize   = read_u32(&p[12]);
+
+    if (0U == pDecoder->outputSize)
+    {
+        return fail(pDecoder, OtaImageDecoderBadHeader);
+    }
+
+    return check_base(pDecoder, read_u32(&p[16]));
+}
+/**********************************************************************************************************************
+ End of function parse_header
+ *********************************************************************************************************************/
+
+/* Function Name: parse_arguments */
+/**********************************************************************************************************************
+ * @brief Run the operation whose arguments were collected.
+ * @param[in] pDecoder
+ * @return OtaImageDecoderStatus_t
+ *********************************************************************************************************************/
+static OtaImageDecoderStatus_t parse_arguments(OtaImageDecoder_t * pDecoder)
+{
+    const uint8_t * p = pDecoder->field;
+    uint32_t offset;
+    uint32_t length;
+
+    if (OTA_IMAGE_OP_LITERAL == pDecoder->operation)
+    {
+        length = ((uint32_t)p[0]) | ((uint32_t)p[1] << 8);
+        offset = 0U;
+    }
+    else if (OTA_IMAGE_OP_COPY_OUTPUT == pDecoder->operation)
+    {
+        offset = ((uint32_t)p[0]) | ((uint32_t)p[1] << 8);
+        length = ((uint32_t)p[2]) | ((uint32_t)p[3] << 8);
+    }
+    else
+    {
+        offset = read_u32(p);
+        length = ((uint32_t)p[4]) | ((uint32_t)p[5] << 8);
+    }
+
+    if ((0U == length) || (length > (pDecoder->outputSize - pDecoder->outputProduced)))
+    {
+        return fail(pDecoder, OtaImageDecoderBadOperation);
+    }
+
+    if (OTA_IMAGE_OP_LITERAL == pDecoder->operation)
+    {
+        pDecoder->literalRemaining = length;
+        pDecoder->state = OtaImageDecoderStateLiteral;
+        return OtaImageDecoderSuccess;
+    }
+
+    if (OTA_IMAGE_OP_COPY_OUTPUT == pDecoder->operation)
+    {
+        /* offset is the distance back from the end of the rebuilt bytes */
+        if ((0U == offset) || (offset > OTA_IMAGE_WINDOW_SIZE) || (offset > pDecoder->outputProduced))
+        {
+            return fail(pDecoder, OtaImageDecoderBadOperation);
+        }
+
+        if (OtaImageDecoderSuccess != emit_output(pDecoder, offset, length))
+        {
+            return pDecoder->status;
+        }
+    }
+    else
+    {
+        if ((length > pDecoder->baseSize) || (offset > (pDecoder->baseSize - length)))
+        {
+            return fail(pDecoder, OtaImageDecoderBadOperation);
+        }
+
+        if (OtaImageDecoderSuccess != emit_base(pDecoder, offset, length))
+        {
+            return pDecoder->status;
+        }
+    }
+
+    pDecoder->state = (pDecoder->outputProduced == pDecoder->outputSize) ?
+                      OtaImageDecoderStateDone : OtaImageDecoderStateOperation;
+
+    return OtaImageDecoderSuccess;
+}
+/**********************************************************************************************************************
+ End of function parse_arguments
+ *********************************************************************************************************************/
+
+/* Function Name: otaImageDecoder_Init */
+/**********************************************************************************************************************
+ * @brief Prepare a decoder for a new encoded file.
+ * @param[out] pDecoder
+ * @param[in] readBase     NULL if the file must not refer to a base (compressed file)
+ * @param[in] writeOutput
+ * @return void
+ *********************************************************************************************************************/
+void otaImageDecoder_Init(OtaImageDecoder_t * pDecoder,
+                          OtaImageReadBase_t readBase,
+                          OtaImageWriteOutput_t writeOutput)
+{
+    memset(pDecoder, 0, sizeof(OtaImageDecoder_t));
+
+    pDecoder->readBase    = readBase;
+    pDecoder->writeOutput = writeOutput;
+    pDecoder->state       = OtaImageDecoderStateHeader;
+    pDecoder->status      = OtaImageDecoderSuccess;
+    pDecoder->fieldNeeded = OTA_IMAGE_HEADER_SIZE;
+}
+/**********************************************************************************************************************
+ End of function otaImageDecoder_Init
+ *********************************************************************************************************************/
+
+/* Function Name: otaImageDecoder_Process */
+/**********************************************************************************************************************
+ * @brief Decode the next part of the encoded file. Parts must be passed in file order.
+ * @param[in] pDecoder
+ * @param[in] pData
+ * @param[in] ulLength
+ * @return OtaImageDecoderStatus_t
+ * @retval OtaImageDecoderSuccess   the part was decoded, else the first error of the file
+ *********************************************************************************************************************/
+OtaImageDecoderStatus_t otaImageDecoder_Process(OtaImageDecoder_t * pDecoder,
+                                                const uint8_t * pData,
+                                                uint32_t ulLength)
+{
+    uint32_t chunk;
+
+    while ((ulLength > 0U) && (OtaImageDecoderStateError != pDecoder->state))
+    {
+        switch (pDecoder->state)
+        {
+            case OtaImageDecoderStateHeader:
+            case OtaImageDecoderStateArguments:
+            {
+                chunk = pDecoder->fieldNeeded - pDecoder->fieldLength;
+                if (chunk > ulLength)
+                {
+                    chunk = ulLength;
+                }
+
+                memcpy(&pDecoder->field[pDecoder->fieldLength], pData, chunk);
+                pDecoder->fieldLength += chunk;
+                pData    += chunk;
+                ulLength -= chunk;
+
+                if (pDecoder->fieldLength == pDecoder->fieldNeeded)
+                {
+                    if (OtaImageDecoderStateHeader == pDecoder->state)
+                    {
+                        if (OtaImageDecoderSuccess == parse_header(pDecoder))
+                        {
+                            pDecoder->state = OtaImageDecoderStateOperation;
+                        }
+                    }
+                    else
+                    {
+                        (void) parse_arguments(pDecoder);
+                    }
+                }
+                break;
+            }
+
+            case OtaImageDecoderStateOperation:
+            {
+                pDecoder->operation = *pData;
+                pData++;
+                ulLength--;
+
+                if (OTA_IMAGE_OP_LITERAL == pDecoder->operation)
+                {
+                    pDecoder->fieldNeeded = LITERAL_ARGUMENTS_SIZE;
+                }
+                else if (OTA_IMAGE_OP_COPY_BASE == pDecoder->operation)
+                {
+                    pDecoder->fieldNeeded = COPY_BASE_ARGUMENTS_SIZE;
+                }
+                else if (OTA_IMAGE_OP_COPY_OUTPUT == pDecoder->operation)
+                {
+                    pDecoder->fieldNeeded = COPY_OUTPUT_ARGUMENTS_SIZE;
+                }
+                else
+                {
+                    (void) fail(pDecoder, OtaImageDecoderBadOperation);
+                    break;
+                }
+
+                pDecoder->fieldLength = 0U;
+                pDecoder->state = OtaImageDecoderStateArguments;
+                break;
+            }
+
+            case OtaImageDecoderStateLiteral:
+            {
+                chunk = pDecoder->literalRemaining;
+                if (chunk > ulLength)
+                {
+                    chunk = ulLength;
+                }
+
+                if (OtaImageDecoderSuccess != emit_literal(pDecoder, pData, chunk))
+                {
+                    break;
+                }
+
+                pData    += chunk;
+                ulLength -= chunk;
+                pDecoder->literalRemaining -= chunk;
+
+                if (0U == pDecoder->literalRemaining)
+                {
+                    pDecoder->state = (pDecoder->outputProduced == pDecoder->outputSize) ?
+                                      OtaImageDecoderStateDone : OtaImageDecoderStateOperation;
+                }
+                break;
+            }
+
+            default:
+            {
+                /* Data after the rebuilt image is complete. */
+                (void) fail(pDecoder, OtaImageDecoderBadOperation);
+                break;
+            }
+        }
+    }
+
+    return pDecoder->status;
+}
+/**********************************************************************************************************************
+ End of function otaImageDecoder_Process
+ *********************************************************************************************************************/
+
+/* Function Name: otaImageDecoder_Finish */
+/**********************************************************************************************************************
+ * @brief Write the rest of the rebuilt image after the last part of the file.
+ * @param[in] pDecoder
+ * @return OtaImageDecoderStatus_t
+ * @retval OtaImageDecoderSuccess   the whole image was rebuilt, else the first error of the file
+ *********************************************************************************************************************/
+OtaImageDecoderStatus_t otaImageDecoder_Finish(OtaImageDecoder_t * pDecoder)
+{
+    if (OtaImageDecoderStateError == pDecoder->state)
+    {
+        return pDecoder->status;
+    }
+
+    if (OtaImageDecoderStateDone != pDecoder->state)
+    {
+        return fail(pDecoder, OtaImageDecoderIncomplete);
+    }
+
+    return flush_staging(pDecoder);
+}
+/**********************************************************************************************************************
+ End of function otaImageDecoder_Finish
+ *********************************************************************************************************************/
@@ -0,0 +1,147 @@
+/*
+* Copyright (c) 2025 Renesas Electronics Corporation and/or its affiliates
+*
+* SPDX-License-Identifier: MIT
+*/
+
+/***********************************************************************************************************************
+ * File Name    : ota_image_decoder.h
+ * Description  : Streaming decoder for encoded OTA files. An encoded file rebuilds the RSU image on the device,
+ *                either from the running image (delta update) or from earlier bytes of itself (compression),
+ *                so fewer bytes are downloaded.
+ **********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ Includes   <System Includes> , "Project Includes"
+ *********************************************************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef OTA_IMAGE_DECODER_H_
+#define OTA_IMAGE_DECODER_H_
+
+/**
+ * @brief Encoded file layout, all values little endian. Tools/ota/ota_image_encoder.py creates it.
+ *
+ * Header (20 bytes):
+ *   "RXIE", version (1 byte), 3 reserved bytes,
+ *   size of the rebuilt image, size of the base, CRC-32 of the base.
+ * The base is the running image, read as the OTA file it was installed from. A compressed file has no base
+ * (base size 0, CRC-32 0).
+ * Then a sequence of operations, each producing the next bytes of the rebuilt image:
+ *   OTA_IMAGE_OP_LITERAL     : length (2 bytes), then length bytes of data.
+ *   OTA_IMAGE_OP_COPY_BASE   : base offset (4 bytes), length (2 bytes).
+ *   OTA_IMAGE_OP_COPY_OUTPUT : distance back from the end of the rebuilt bytes (2 bytes, at most
+ *                              OTA_IMAGE_WINDOW_SIZE), length (2 bytes). The copy may overlap its own output.
+ * The operations end when the rebuilt image is complete.
+ */
+#define OTA_IMAGE_MAGIC                  "RXIE"
+#define OTA_IMAGE_VERSION                (1U)
+#define OTA_IMAGE_HEADER_SIZE            (20U)
+
+#define OTA_IMAGE_OP_LITERAL             (0x01U)
+#define OTA_IMAGE_OP_COPY_BASE           (0x02U)
+#define OTA_IMAGE_OP_COPY_OUTPUT         (0x03U)
+
+/**
+ * @brief Number of rebuilt bytes that OTA_IMAGE_OP_COPY_OUTPUT can refer back to.
+ * Part of the file format, the encoder uses the same value.
+ */
+#define OTA_IMAGE_WINDOW_SIZE            (2048U)
+
+/**
+ * @brief Rebuilt bytes collected before they are handed to the write callback.
+ * Must be a multiple of the code flash program unit.
+ */
+#ifndef OTA_IMAGE_DECODER_STAGING_SIZE
+#define OTA_IMAGE_DECODER_STAGING_SIZE   (1024U)
+#endif
+
+/**
+ * @brief Read bytes of the base image.
+ */
+typedef bool (* OtaImageReadBase_t)(uint32_t ulOffset, uint8_t * const pBuffer, uint32_t ulLength);
+
+/**
+ * @brief Write bytes of the rebuilt image. pData is padded with 0xFF up to the program unit.
+ */
+typedef bool (* OtaImageWriteOutput_t)(uint32_t ulOffset, uint8_t * const pData, uint32_t ulLength);
+
+typedef enum
+{
+    OtaImageDecoderSuccess = 0,      /*!< The data was decoded. */
+    OtaImageDecoderBadHeader,        /*!< The file is not an encoded OTA file of a supported version. */
+    OtaImageDecoderBaseMismatch,     /*!< The running image is not the base the file was made for. */
+    OtaImageDecoderBadOperation,     /*!< An operation is unknown or exceeds the base or the image. */
+    OtaImageDecoderWriteFailed,      /*!< The write callback failed. */
+    OtaImageDecoderIncomplete        /*!< The file ended before the image was rebuilt. */
+} OtaImageDecoderStatus_t;
+
+typedef enum
+{
+    OtaImageDecoderStateHeader = 0,
+    OtaImageDecoderStateOperation,
+    OtaImageDecoderStateArguments,
+    OtaImageDecoderStateLiteral,
+    OtaImageDecoderStateDone,
+    OtaImageDecoderStateError
+} OtaImageDecoderState_t;
+
+/**
+ * @brief Decoder context. Fields are split at any byte across calls of otaImageDecoder_Process().
+ */
+typedef struct
+{
+    OtaImageReadBase_t readBase;
+    OtaImageWriteOutput_t writeOutput;
+    OtaImageDecoderState_t state;
+    OtaImageDecoderStatus_t status;
+    uint8_t field[OTA_IMAGE_HEADER_SIZE];    /*!< Header or operation arguments being collected. */
+    uint32_t fieldLength;
+    uint32_t fieldNeeded;
+    uint8_t operation;
+    uint32_t literalRemaining;
+    uint32_t outputSize;
+    uint32_t outputProduced;
+    uint32_t baseSize;
+    uint32_t stagingOffset;                  /*!< Image offset of staging[0]. */
+    uint32_t stagingLength;
+    uint8_t staging[OTA_IMAGE_DECODER_STAGING_SIZE];
+    uint8_t window[OTA_IMAGE_WINDOW_SIZE];   /*!< Last rebuilt bytes, indexed by outputProduced modulo the size. */
+} OtaImageDecoder_t;
+
+/* Function Name: otaImageDecoder_Init */
+/**********************************************************************************************************************
+ * @brief Prepare a decoder for a new encoded file.
+ * @param[out] pDecoder
+ * @param[in] readBase     NULL if the file must not refer to a base (compressed file)
+ * @param[in] writeOutput
+ * @return void
+ *********************************************************************************************************************/
+void otaImageDecoder_Init (OtaImageDecoder_t * pDecoder,
+                           OtaImageReadBase_t readBase,
+                           OtaImageWriteOutput_t writeOutput);
+
+/* Function Name: otaImageDecoder_Process */
+/**********************************************************************************************************************
+ * @brief Decode the next part of the encoded file. Parts must be passed in file order.
+ * @param[in] pDecoder
+ * @param[in] pData
+ * @param[in] ulLength
+ * @return OtaImageDecoderStatus_t
+ * @retval OtaImageDecoderSuccess   the part was decoded, else the first error of the file
+ *********************************************************************************************************************/
+OtaImageDecoderStatus_t otaImageDecoder_Process (OtaImageDecoder_t * pDecoder,
+                                                 const uint8_t * pData,
+                                                 uint32_t ulLength);
+
+/* Function Name: otaImageDecoder_Finish */
+/**********************************************************************************************************************
+ * @brief Write the rest of the rebuilt image after the last part of the file.
+ * @param[in] pDecoder
+ * @return OtaImageDecoderStatus_t
+ * @retval OtaImageDecoderSuccess   the whole image was rebuilt, else the first error of the file
+ *********************************************************************************************************************/
+OtaImageDecoderStatus_t otaImageDecoder_Finish (OtaImageDecoder_t * pDecoder);
+
+#endif /* OTA_IMAGE_DECODER_H_ */
@@ -75,6 +75,10 @@ static BaseType_t prvFormat ( char * pcWriteBuffer,
                               size_t xWriteBufferLen,
                               const char * pcCommandString );
 
+static BaseType_t prvFlashWear ( char * pcWriteBuffer,
+                                 size_t xWriteBufferLen,
+                                 const char * pcCommandString );
+
 /*
  * The function that registers the commands that are defined within this file.
  */
@@ -207,6 +211,18 @@ static CLI_Command_Definition_t xFormat =
         .cExpectedNumberOfParameters = -1
 };
 
+static CLI_Command_Definition_t xFlashWear =
+{
+        .pcCommand                   = "flashwear",
+        .pcHelpString                = "\r\n"
+                                       "flashwear:\r\n"
+                                       "    Command to show the wear of the Data Flash used by the file system.\r\n"
+                                       "    Usage: flashwear [save]\r\n"
+                                       "           save : to store the erase counters to Data Flash\r\n",
+        .pxCommandInterpreter        = prvFlashWear,
+        .cExpectedNumberOfParameters = -1
+};
+
 static CLI_Command_Definition_t xWait =
 {
         .pcCommand                   = "CLI",
@@ -233,6 +249,7 @@ void vRegisterSampleCLICommands( void )
     FreeRTOS_CLIRegisterCommand( &xParameterEcho );
     FreeRTOS_CLIRegisterCommand( &xReset );
     FreeRTOS_CLIRegisterCommand( &xFormat );
+    FreeRTOS_CLIRegisterCommand( &xFlashWear );
     FreeRTOS_CLIRegisterCommand( &xWait );
 
     #if( configGENERATE_RUN_TIME_STATS == 1 )
@@ -432,6 +449,7 @@ static BaseType_t prvFormat( char * pcWriteBuffer,
     int32_t err;
 
     /* File system is already mounted, unmount it to free up memory. */
+    littlFs_lock();
     lfs_unmount(&g_rm_littlefs0_lfs);
     RM_LITTLEFS_FLASH_Open(g_rm_littlefs0.p_ctrl, g_rm_littlefs0.p_cfg);
 
@@ -448,6 +466,7 @@ static BaseType_t prvFormat( char * pcWriteBuffer,
     {
         sprintf( pcWriteBuffer, "Format NG !\r\n");
     }
+    littlFs_unlock();
 
     /* There is no more data to return after this single string, so return
     pdFALSE. */
@@ -457,6 +476,101 @@ static BaseType_t prvFormat( char * pcWriteBuffer,
  End of function prvFormat
  *********************************************************************************************************************/
 
+/**********************************************************************************************************************
+ * Function Name: prvFlashWear
+ * Description  : Prints the erase counts of the Data Flash blocks and the write amplification of the file system.
+ *                The summary is returned by the first call and the per-block counts by the following calls, one line
+ *                at a time, so that the output fits in the CLI output buffer.
+ * Arguments    : pcWriteBuffer
+ *              : xWriteBufferLen
+ *              : pcCommandString
+ * Return Value : pdTRUE while there are more lines to print, otherwise pdFALSE.
+ *********************************************************************************************************************/
+static BaseType_t prvFlashWear( char * pcWriteBuffer,
+                                           size_t xWriteBufferLen,
+                                           const char * pcCommandString )
+{
+    static rm_littlefs_flash_wear_t wear;
+    static uint32_t next_block = 0;
+    static BaseType_t xPrinting = pdFALSE;
+    rm_littlefs_flash_stats_t stats;
+    const char * pParameter;
+    BaseType_t parameterLength = 0;
+    uint32_t total = 0;
+    uint32_t max_block = 0;
+    uint32_t block;
+    uint32_t ratio;
+    int length;
+
+    (void)xWriteBufferLen;
+    configASSERT( pcWriteBuffer );
+
+    if (pdTRUE == xPrinting)
+    {
+        /* Cast to type "int" to be compatible with parameter type */
+        length = sprintf(pcWriteBuffer, "%3d:", (int)next_block);
+        for (block = next_block; (block < LFS_FLASH_BLOCK_COUNT) && (block < (next_block + 10)); block++)
+        {
+            /* Cast to type "unsigned long" to be compatible with parameter type */
+            length += sprintf(&pcWriteBuffer[length], " %lu", (unsigned long)wear.erase_count[block]);
+        }
+        sprintf(&pcWriteBuffer[length], "\r\n");
+
+        next_block = block;
+        xPrinting = (next_block < LFS_FLASH_BLOCK_COUNT) ? pdTRUE : pdFALSE;
+        return xPrinting;
+    }
+
+    pParameter = FreeRTOS_CLIGetParameter(pcCommandString, 1, &parameterLength);
+    if ((NULL != pParameter) && (0 == strncmp(pParameter, "save", parameterLength)))
+    {
+        if (LFS_ERR_OK == littlFs_wear_save())
+        {
+            sprintf(pcWriteBuffer, "Erase counters saved.\r\n");
+        }
+        else
+        {
+            sprintf(pcWriteBuffer, "Error: Could not save erase counters to Data Flash.\r\n");
+        }
+        return pdFALSE;
+    }
+
+    RM_LITTLEFS_FLASH_WearGet(g_rm_littlefs0.p_ctrl, &wear);
+    RM_LITTLEFS_FLASH_StatsGet(g_rm_littlefs0.p_ctrl, &stats);
+
+    for (block = 0; block < LFS_FLASH_BLOCK_COUNT; block++)
+    {
+        total += wear.erase_count[block];
+        if (wear.erase_count[block] > wear.erase_count[max_block])
+        {
+            max_block = block;
+        }
+    }
+
+    /* Write amplification in hundredths, 0 until file data has been counted. */
+    ratio = (0 != wear.file_bytes_written) ?
+            (uint32_t)(((uint64_t)wear.bytes_programmed * 100U) / wear.file_bytes_written) : 0;
+
+    /* Cast to type "unsigned long" to be compatible with parameter type */
+    sprintf(pcWriteBuffer,
+            "Erases: %lu total, %lu on the most worn block %lu\r\n"
+            "Programmed %lu bytes for %lu bytes of file data, write amplification %lu.%02lu\r\n"
+            "Since mount: %lu erase requests, %lu skipped\r\n"
+            "Erase count per block:\r\n",
+            (unsigned long)total, (unsigned long)wear.erase_count[max_block], (unsigned long)max_block,
+            (unsigned long)wear.bytes_programmed, (unsigned long)wear.file_bytes_written,
+            (unsigned long)(ratio / 100U), (unsigned long)(ratio % 100U),
+            (unsigned long)stats.erase_requests, (unsigned long)stats.erases_skipped);
+
+    /* The per-block counts are printed by the following calls. */
+    next_block = 0;
+    xPrinting = pdTRUE;
+    return pdTRUE;
+}
+/**********************************************************************************************************************
+ End of function prvFlashWear
+ *********************************************************************************************************************/
+
 /**********************************************************************************************************************
  * Function Name: prvConfigCommandHandler
  * Description  : .
@@ -538,6 +652,9 @@ static BaseType_t prvConfigCommandHandler( char * pcWriteBuffer,
                 /* Cast to type "int" to be compatible with parameter type */
                 sprintf(pcWriteBuffer, "Configuration save %d bytes to Data Flash. Total used size is %d bytes .\r\n", (int)pvwrite, (int)totalSize );
                 pvwrite = 0;
+
+                /* Credential rewrites are what wears the Data Flash, keep their erase counts. */
+                (void)littlFs_wear_save();
             }
             else
             {
@@ -32,6 +32,10 @@
 
 #include "aws_dev_mode_key_provisioning.h"
 #include "core_pkcs11_pal.h"
+#include "rm_littlefs_flash.h"
+
+/* TLS transport, to drop the root CA parsed from the previous value. */
+#include "transport_mbedtls_pkcs11.h"
 
 const char * keys[KVS_NUM_KEYS] = KVSTORE_KEYS;
 KeyValueStore_t gKeyValueStore = { 0 };
@@ -39,43 +43,461 @@ extern volatile uint32_t pvwrite;
 extern CK_RV vDevModeKeyPreProvisioning ( KeyValueStore_t Keystore, KVStoreKey_t ID, int32_t xvaluelength );
 BaseType_t xPending;
 
+/* Values other than the PKCS #11 objects are kept in one append-only log file. A commit appends the changed values
+ * with a single littlefs file write, which littlefs makes visible atomically when the file is closed, so either all
+ * values of a commit are stored or none of them. An index in RAM locates the latest value of each key in the log. */
+#define KVS_LOG_FILE_NAME        "kvs_log"
+#define KVS_LOG_TMP_FILE_NAME    "kvs_log.tmp"
+#define KVS_LOG_TAG              (0x4B560000UL)
+#define KVS_LOG_TAG_MASK         (0xFFFF0000UL)
+#define KVS_LOG_NO_VALUE         (-1)
+#define KVS_LOG_LEGACY_FILE      (-2)
+#define KVS_LOG_COPY_CHUNK       (64)
+
+/* Superseded bytes allowed in the log before a commit compacts it. */
+#ifndef KVS_LOG_GARBAGE_MAX
+#define KVS_LOG_GARBAGE_MAX      (1024)
+#endif
+
+typedef struct KVStoreLogRecord
+{
+    uint32_t ulTag;                 /* KVS_LOG_TAG | key */
+    uint32_t ulLength;              /* Length of the value that follows */
+} KVStoreLogRecord_t;
+
+typedef struct KVStoreLogIndex
+{
+    lfs_soff_t xOffset;             /* Offset of the value in the log, KVS_LOG_NO_VALUE or KVS_LOG_LEGACY_FILE */
+    uint32_t ulLength;
+} KVStoreLogIndex_t;
+
+typedef struct KVStoreLogItem
+{
+    KVStoreKey_t xKey;
+    const char * pcData;
+    uint32_t ulLength;
+} KVStoreLogItem_t;
+
+static KVStoreLogIndex_t xLogIndex[KVS_NUM_KEYS];
+static lfs_soff_t xLogSize = 0;
+static BaseType_t xLogLoaded = pdFALSE;
+static BaseType_t xLogNeedsCompaction = pdFALSE;
+
+static BaseType_t prvIsPkcs11Key ( uint32_t key );
+static void prvKvsLogLoad ( void );
+static int prvKvsLogWriteRecord ( lfs_file_t * pxFile, KVStoreKey_t xKey, const char * pcData, uint32_t ulLength );
+static int prvKvsLogCopyValue ( lfs_file_t * pxDst, lfs_file_t * pxLog, KVStoreKey_t xKey );
+static BaseType_t prvKvsLogCommit ( const KVStoreLogItem_t * pxItems, size_t xCount );
+
 /**********************************************************************************************************************
- * Function Name: xprvWriteValueToImpl
- * Description  : Write a value for a given key to Data Flash.
- * Arguments    : KVStoreKey_t keyIndex to store the given value in.
- *              : pucData Pointer to a buffer containing the value to be stored.
- *              : ulDataSize length of the value given in pucData.
- * Return Value : lfs_err
+ * Function Name: prvIsPkcs11Key
+ * Description  : Tells whether the value of a key is stored as a PKCS #11 object rather than in the log.
+ * Argument     : key
+ * Return Value : pdTRUE for the certificates and keys provisioned through PKCS #11.
  *********************************************************************************************************************/
-BaseType_t xprvWriteValueToImpl(KVStoreKey_t keyIndex, char *pucData, uint32_t ulDataSize)
+static BaseType_t prvIsPkcs11Key( uint32_t key )
 {
-        lfs_file_t file;
-        lfs_ssize_t lfs_err;
+    return ((KVS_DEVICE_CERT_ID == key) || (KVS_DEVICE_PRIVKEY_ID == key) || (KVS_DEVICE_PUBKEY_ID == key) ||
+            (KVS_CLAIM_CERT_ID == key) || (KVS_CLAIM_PRIVKEY_ID == key)) ? pdTRUE : pdFALSE;
+}
+/**********************************************************************************************************************
+ End of function prvIsPkcs11Key
+ *********************************************************************************************************************/
 
-        /* Cast to type "char *" to be compatible with parameter type */
-        lfs_err = lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, (char *)keys[keyIndex]);
 
-        if ((LFS_ERR_NOENT != lfs_err) && (LFS_ERR_OK != lfs_err))
+/**********************************************************************************************************************
+ * Function Name: prvKvsLogLoad
+ * Description  : Builds the index of the log on first use. A log cut short by a bad record is indexed up to that
+ *                record and compacted by the next commit. Without a log, the files written by earlier versions
+ *                with one file per key are indexed instead and moved into the log by the next commit.
+ *                Called with the file system lock held.
+ * Return Value : .
+ *********************************************************************************************************************/
+static void prvKvsLogLoad( void )
+{
+    lfs_file_t file;
+    KVStoreLogRecord_t xRecord;
+    struct lfs_info xFileInfo;
+    lfs_soff_t xFileSize;
+    lfs_soff_t xOffset = 0;
+    lfs_ssize_t lfs_ret;
+    uint32_t key;
+
+    if (pdTRUE == xLogLoaded)
+    {
+        return;
+    }
+
+    for (key = 0; key < KVS_NUM_KEYS; key++)
+    {
+        xLogIndex[key].xOffset = KVS_LOG_NO_VALUE;
+        xLogIndex[key].ulLength = 0;
+    }
+    xLogNeedsCompaction = pdFALSE;
+
+    lfs_ret = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, KVS_LOG_FILE_NAME, LFS_O_RDONLY);
+    if (LFS_ERR_OK == lfs_ret)
+    {
+        xFileSize = lfs_file_size(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+
+        /* Cast to type "lfs_size_t" to be compatible with parameter type */
+        while (lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, &file, &xRecord, (lfs_size_t)sizeof(xRecord)) ==
+               (lfs_ssize_t)sizeof(xRecord))
         {
-                return -1;
+            key = xRecord.ulTag & ~KVS_LOG_TAG_MASK;
+            if ((KVS_LOG_TAG != (xRecord.ulTag & KVS_LOG_TAG_MASK)) || (key >= KVS_NUM_KEYS) ||
+                (xRecord.ulLength > (uint32_t)(xFileSize - xOffset - (lfs_soff_t)sizeof(xRecord))))
+            {
+                break;
+            }
+
+            xLogIndex[key].xOffset = xOffset + (lfs_soff_t)sizeof(xRecord);
+            xLogIndex[key].ulLength = xRecord.ulLength;
+            xOffset = xLogIndex[key].xOffset + (lfs_soff_t)xRecord.ulLength;
+
+            /* Cast to type "lfs_soff_t" to be compatible with parameter type */
+            if (lfs_file_seek(&RM_STDIO_LITTLEFS_CFG_LFS, &file, xOffset, LFS_SEEK_SET) < 0)
+            {
+                break;
+            }
         }
+        (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
 
+        if (xOffset != xFileSize)
+        {
+            xLogNeedsCompaction = pdTRUE;
+        }
+    }
+    else
+    {
+        for (key = 0; key < KVS_NUM_KEYS; key++)
+        {
+            /* Cast to type "char *" to be compatible with parameter type */
+            if ((pdFALSE == prvIsPkcs11Key(key)) &&
+                (lfs_stat(&RM_STDIO_LITTLEFS_CFG_LFS, (char *)keys[key], &xFileInfo) == LFS_ERR_OK))
+            {
+                xLogIndex[key].xOffset = KVS_LOG_LEGACY_FILE;
+                xLogIndex[key].ulLength = xFileInfo.size;
+                xLogNeedsCompaction = pdTRUE;
+            }
+        }
+    }
+
+    xLogSize = xOffset;
+    xLogLoaded = pdTRUE;
+}
+/**********************************************************************************************************************
+ End of function prvKvsLogLoad
+ *********************************************************************************************************************/
+
+
+/**********************************************************************************************************************
+ * Function Name: prvKvsLogWriteRecord
+ * Description  : Writes one record, a header followed by the value, at the current position of a log file.
+ * Arguments    : pxFile
+ *              : xKey
+ *              : pcData      The value, or NULL to write only the header and leave the value to the caller.
+ *              : ulLength
+ * Return Value : LFS_ERR_OK or a LittleFS error.
+ *********************************************************************************************************************/
+static int prvKvsLogWriteRecord( lfs_file_t * pxFile, KVStoreKey_t xKey, const char * pcData, uint32_t ulLength )
+{
+    KVStoreLogRecord_t xRecord;
+    lfs_ssize_t lfs_ret;
+
+    /* Cast to type "uint32_t" to be compatible with the record tag */
+    xRecord.ulTag = KVS_LOG_TAG | (uint32_t)xKey;
+    xRecord.ulLength = ulLength;
+
+    lfs_ret = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, pxFile, &xRecord, sizeof(xRecord));
+    vLfsSSizeToErr(&lfs_ret, sizeof(xRecord));
+
+    if ((LFS_ERR_OK == lfs_ret) && (NULL != pcData) && (ulLength > 0))
+    {
+        lfs_ret = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, pxFile, pcData, ulLength);
+        vLfsSSizeToErr(&lfs_ret, ulLength);
+    }
+
+    return (int)lfs_ret;
+}
+/**********************************************************************************************************************
+ End of function prvKvsLogWriteRecord
+ *********************************************************************************************************************/
+
+
+/**********************************************************************************************************************
+ * Function Name: prvKvsLogCopyValue
+ * Description  : Copies the stored value of a key, from the log or from a file of an earlier version, as a record at
+ *                the current position of another log file.
+ * Arguments    : pxDst       Log file being written.
+ *              : pxLog       The current log, open for reading.
+ *              : xKey
+ * Return Value : LFS_ERR_OK or a LittleFS error.
+ *********************************************************************************************************************/
+static int prvKvsLogCopyValue( lfs_file_t * pxDst, lfs_file_t * pxLog, KVStoreKey_t xKey )
+{
+    char cChunk[KVS_LOG_COPY_CHUNK];
+    lfs_file_t legacy;
+    lfs_file_t * pxSrc = pxLog;
+    BaseType_t xLegacyOpen = pdFALSE;
+    uint32_t ulRemaining = xLogIndex[xKey].ulLength;
+    lfs_ssize_t xChunkLength;
+    lfs_ssize_t lfs_ret;
+
+    if (KVS_LOG_LEGACY_FILE == xLogIndex[xKey].xOffset)
+    {
         /* Cast to type "char *" to be compatible with parameter type */
-        lfs_err = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, (char *)keys[keyIndex], LFS_O_WRONLY | LFS_O_TRUNC | LFS_O_CREAT);
+        lfs_ret = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &legacy, (char *)keys[xKey], LFS_O_RDONLY);
+        xLegacyOpen = (LFS_ERR_OK == lfs_ret) ? pdTRUE : pdFALSE;
+        pxSrc = &legacy;
+    }
+    else
+    {
+        lfs_ret = lfs_file_seek(&RM_STDIO_LITTLEFS_CFG_LFS, pxLog, xLogIndex[xKey].xOffset, LFS_SEEK_SET);
+        if (lfs_ret >= 0)
+        {
+            lfs_ret = LFS_ERR_OK;
+        }
+    }
+
+    if (LFS_ERR_OK == lfs_ret)
+    {
+        lfs_ret = prvKvsLogWriteRecord(pxDst, xKey, NULL, ulRemaining);
+    }
+
+    while ((LFS_ERR_OK == lfs_ret) && (ulRemaining > 0))
+    {
+        xChunkLength = (ulRemaining < sizeof(cChunk)) ? (lfs_ssize_t)ulRemaining : (lfs_ssize_t)sizeof(cChunk);
+
+        /* Cast to type "lfs_size_t" to be compatible with parameter type */
+        lfs_ret = lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, pxSrc, cChunk, (lfs_size_t)xChunkLength);
+        vLfsSSizeToErr(&lfs_ret, (size_t)xChunkLength);
+
+        if (LFS_ERR_OK == lfs_ret)
+        {
+            /* Cast to type "lfs_size_t" to be compatible with parameter type */
+            lfs_ret = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, pxDst, cChunk, (lfs_size_t)xChunkLength);
+            vLfsSSizeToErr(&lfs_ret, (size_t)xChunkLength);
+        }
+        ulRemaining -= (uint32_t)xChunkLength;
+    }
+
+    if (pdTRUE == xLegacyOpen)
+    {
+        (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &legacy);
+    }
+
+    return (int)lfs_ret;
+}
+/**********************************************************************************************************************
+ End of function prvKvsLogCopyValue
+ *********************************************************************************************************************/
+
+
+/**********************************************************************************************************************
+ * Function Name: prvKvsLogCommit
+ * Description  : Stores the values of several keys as one transaction. The records are appended to the log, or, when
+ *                that would leave more than KVS_LOG_GARBAGE_MAX superseded bytes in it, a compacted log holding
+ *                only the latest value of each key is written and renamed over the log. Both are a single littlefs
+ *                commit, so a reset leaves either all or none of the values stored.
+ *                Called with the file system lock held.
+ * Arguments    : pxItems     The keys and their new values, at most one item per key.
+ *              : xCount      Number of items.
+ * Return Value : pdTRUE if all values were stored, pdFALSE if none was.
+ *********************************************************************************************************************/
+static BaseType_t prvKvsLogCommit( const KVStoreLogItem_t * pxItems, size_t xCount )
+{
+    KVStoreLogIndex_t xNewIndex[KVS_NUM_KEYS];
+    const KVStoreLogItem_t * pxItemOfKey[KVS_NUM_KEYS] = { NULL };
+    lfs_file_t file;
+    lfs_file_t log;
+    lfs_soff_t xOffset;
+    lfs_soff_t xLiveSize = 0;
+    lfs_soff_t xBatchSize = 0;
+    BaseType_t xLogOpen = pdFALSE;
+    BaseType_t xCompact;
+    int lfs_err;
+    uint32_t key;
+    size_t i;
+
+    prvKvsLogLoad();
+
+    for (i = 0; i < xCount; i++)
+    {
+        pxItemOfKey[pxItems[i].xKey] = &pxItems[i];
+        xBatchSize += (lfs_soff_t)(sizeof(KVStoreLogRecord_t) + pxItems[i].ulLength);
+    }
+
+    for (key = 0; key < KVS_NUM_KEYS; key++)
+    {
+        xNewIndex[key] = xLogIndex[key];
+        if (NULL != pxItemOfKey[key])
+        {
+            xLiveSize += (lfs_soff_t)(sizeof(KVStoreLogRecord_t) + pxItemOfKey[key]->ulLength);
+        }
+        else if (KVS_LOG_NO_VALUE != xLogIndex[key].xOffset)
+        {
+            xLiveSize += (lfs_soff_t)(sizeof(KVStoreLogRecord_t) + xLogIndex[key].ulLength);
+        }
+        else
+        {
+            /* No value */
+        }
+    }
+
+    xCompact = ((pdTRUE == xLogNeedsCompaction) || ((xLogSize + xBatchSize - xLiveSize) > KVS_LOG_GARBAGE_MAX)) ?
+               pdTRUE : pdFALSE;
+
+    if (pdFALSE == xCompact)
+    {
+        xOffset = xLogSize;
+        lfs_err = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, KVS_LOG_FILE_NAME,
+                                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+        if (LFS_ERR_OK != lfs_err)
+        {
+            return pdFALSE;
+        }
+
+        for (i = 0; (i < xCount) && (LFS_ERR_OK == lfs_err); i++)
+        {
+            lfs_err = prvKvsLogWriteRecord(&file, pxItems[i].xKey, pxItems[i].pcData, pxItems[i].ulLength);
+            xNewIndex[pxItems[i].xKey].xOffset = xOffset + (lfs_soff_t)sizeof(KVStoreLogRecord_t);
+            xNewIndex[pxItems[i].xKey].ulLength = pxItems[i].ulLength;
+            xOffset += (lfs_soff_t)(sizeof(KVStoreLogRecord_t) + pxItems[i].ulLength);
+        }
+
+        /* The appended records become part of the file only when it is closed. */
+        if (LFS_ERR_OK == lfs_err)
+        {
+            lfs_err = lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+        }
+        else
+        {
+            (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+        }
+    }
+    else
+    {
+        xOffset = 0;
+        lfs_err = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, KVS_LOG_TMP_FILE_NAME,
+                                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+        if (LFS_ERR_OK != lfs_err)
+        {
+            return pdFALSE;
+        }
+
+        if (xLogSize > 0)
+        {
+            lfs_err = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &log, KVS_LOG_FILE_NAME, LFS_O_RDONLY);
+            xLogOpen = (LFS_ERR_OK == lfs_err) ? pdTRUE : pdFALSE;
+        }
+
+        for (key = 0; (key < KVS_NUM_KEYS) && (LFS_ERR_OK == lfs_err); key++)
+        {
+            if (NULL != pxItemOfKey[key])
+            {
+                /* Cast to type "KVStoreKey_t" to be compatible with parameter type */
+                lfs_err = prvKvsLogWriteRecord(&file, (KVStoreKey_t)key, pxItemOfKey[key]->pcData,
+                                               pxItemOfKey[key]->ulLength);
+                xNewIndex[key].ulLength = pxItemOfKey[key]->ulLength;
+            }
+            else if (KVS_LOG_NO_VALUE != xLogIndex[key].xOffset)
+            {
+                /* Cast to type "KVStoreKey_t" to be compatible with parameter type */
+                lfs_err = prvKvsLogCopyValue(&file, &log, (KVStoreKey_t)key);
+            }
+            else
+            {
+                continue;
+            }
+            xNewIndex[key].xOffset = xOffset + (lfs_soff_t)sizeof(KVStoreLogRecord_t);
+            xOffset = xNewIndex[key].xOffset + (lfs_soff_t)xNewIndex[key].ulLength;
+        }
+
+        if (pdTRUE == xLogOpen)
+        {
+            (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &log);
+        }
+
+        if (LFS_ERR_OK == lfs_err)
+        {
+            lfs_err = lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+        }
+        else
+        {
+            (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+        }
+
+        /* The rename replaces the log in one littlefs commit. */
+        if (LFS_ERR_OK == lfs_err)
+        {
+            lfs_err = lfs_rename(&RM_STDIO_LITTLEFS_CFG_LFS, KVS_LOG_TMP_FILE_NAME, KVS_LOG_FILE_NAME);
+        }
 
         if (LFS_ERR_OK != lfs_err)
         {
-                return -1;
+            (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, KVS_LOG_TMP_FILE_NAME);
         }
+        else
+        {
+            /* The values of the files written by earlier versions are in the log now. */
+            for (key = 0; key < KVS_NUM_KEYS; key++)
+            {
+                if (KVS_LOG_LEGACY_FILE == xLogIndex[key].xOffset)
+                {
+                    /* Cast to type "char *" to be compatible with parameter type */
+                    (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, (char *)keys[key]);
+                }
+            }
+            xLogNeedsCompaction = pdFALSE;
+        }
+    }
 
-        lfs_err = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, &file, pucData, ulDataSize);
-        pvwrite += ulDataSize;
+    if (LFS_ERR_OK != lfs_err)
+    {
+        return pdFALSE;
+    }
+
+    (void)memcpy(xLogIndex, xNewIndex, sizeof(xLogIndex));
+    xLogSize = xOffset;
 
-        /* Cast to type "lfs_ssize_t" to be compatible with parameter type */
-        vLfsSSizeToErr( &lfs_err, (lfs_ssize_t)ulDataSize );
+    for (i = 0; i < xCount; i++)
+    {
+        pvwrite += pxItems[i].ulLength;
 
-        lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
-        return ( lfs_err == LFS_ERR_OK );
+        /* Reference for the write amplification reported by the flash port. */
+        RM_LITTLEFS_FLASH_FileBytesAdd(RM_STDIO_LITTLEFS_CFG_LFS.cfg->context, pxItems[i].ulLength);
+    }
+
+    return pdTRUE;
+}
+/**********************************************************************************************************************
+ End of function prvKvsLogCommit
+ *********************************************************************************************************************/
+
+
+/**********************************************************************************************************************
+ * Function Name: xprvWriteValueToImpl
+ * Description  : Write a value for a given key to Data Flash.
+ * Arguments    : KVStoreKey_t keyIndex to store the given value in.
+ *              : pucData Pointer to a buffer containing the value to be stored.
+ *              : ulDataSize length of the value given in pucData.
+ * Return Value : pdTRUE if the value was stored.
+ *********************************************************************************************************************/
+BaseType_t xprvWriteValueToImpl(KVStoreKey_t keyIndex, char *pucData, uint32_t ulDataSize)
+{
+    KVStoreLogItem_t xItem;
+    BaseType_t xResult;
+
+    xItem.xKey = keyIndex;
+    xItem.pcData = pucData;
+    xItem.ulLength = ulDataSize;
+
+    littlFs_lock();
+    xResult = prvKvsLogCommit(&xItem, 1);
+    littlFs_unlock();
+
+    return xResult;
 }
 /**********************************************************************************************************************
  End of function xprvWriteValueToImpl
@@ -96,38 +518,56 @@ int32_t xprvReadValueFromImpl(KVStoreKey_t keyIndex,
                 uint32_t *pulDataSize,
                 size_t xBufferSize)
 {
+    lfs_file_t file;
+    lfs_ssize_t lfs_ret;
+    lfs_soff_t xOffset = 0;
 
-        lfs_file_t file;
-        lfs_ssize_t lfs_ret =
-                lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS,
-                                          &file,
-                                          (char *) keys[keyIndex],
-                                          LFS_O_RDONLY);
+    littlFs_lock();
+    prvKvsLogLoad();
 
-        lfs_ret = lfs_file_size(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+    if (KVS_LOG_NO_VALUE == xLogIndex[keyIndex].xOffset)
+    {
+        littlFs_unlock();
+        return pdFALSE;
+    }
 
-        /* Cast to type "size_t" to be compatible with parameter type */
-        *ppucData = pvPortMalloc((size_t)lfs_ret);
+    if (KVS_LOG_LEGACY_FILE == xLogIndex[keyIndex].xOffset)
+    {
+        /* Cast to type "char *" to be compatible with parameter type */
+        lfs_ret = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, (char *)keys[keyIndex], LFS_O_RDONLY);
+    }
+    else
+    {
+        xOffset = xLogIndex[keyIndex].xOffset;
+        lfs_ret = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &file, KVS_LOG_FILE_NAME, LFS_O_RDONLY);
+    }
 
-        if ((lfs_ret >= 0) && (NULL != (*ppucData)))
-        {
-                /* Cast to type "lfs_size_t" to be compatible with parameter type */
-                lfs_ret = lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, &file, *ppucData, (lfs_size_t)lfs_ret);
+    if (LFS_ERR_OK != lfs_ret)
+    {
+        littlFs_unlock();
+        return pdFALSE;
+    }
 
-                if (lfs_ret >= 0)
-                {
-                        /* Cast to type "uint32_t" to be compatible with parameter type */
-                        *pulDataSize = (uint32_t) lfs_ret;
+    lfs_ret = lfs_file_seek(&RM_STDIO_LITTLEFS_CFG_LFS, &file, xOffset, LFS_SEEK_SET);
 
-                        /* Cast to type "lfs_ssize_t" to be compatible with parameter type */
-                        vLfsSSizeToErr( &lfs_ret, (lfs_ssize_t)xBufferSize );
-                }
-        }
-        if ( lfs_ret == LFS_ERR_OK )
+    /* Cast to type "size_t" to be compatible with parameter type */
+    *ppucData = pvPortMalloc((size_t)xLogIndex[keyIndex].ulLength);
+
+    if ((lfs_ret >= 0) && (NULL != (*ppucData)))
+    {
+        lfs_ret = lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, &file, *ppucData, xLogIndex[keyIndex].ulLength);
+
+        if (lfs_ret >= 0)
         {
-                lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
-        }
+            /* Cast to type "uint32_t" to be compatible with parameter type */
+            *pulDataSize = (uint32_t) lfs_ret;
 
+            /* Cast to type "lfs_ssize_t" to be compatible with parameter type */
+            vLfsSSizeToErr( &lfs_ret, (lfs_ssize_t)xBufferSize );
+        }
+    }
+    (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &file);
+    littlFs_unlock();
 
     return (LFS_ERR_OK == lfs_ret);
 }
@@ -144,15 +584,25 @@ int32_t xprvReadValueFromImpl(KVStoreKey_t keyIndex,
  *********************************************************************************************************************/
 int32_t xprvGetValueLengthFromImpl( KVStoreKey_t keyIndex)
 {
-        size_t xLength = 0;
-        struct lfs_info xFileInfo = { 0 };
+    size_t xLength = 0;
+    struct lfs_info xFileInfo = { 0 };
 
+    littlFs_lock();
+    if (pdTRUE == prvIsPkcs11Key((uint32_t)keyIndex))
+    {
         /* Cast to type "char *" to be compatible with parameter type */
         if ( lfs_stat( &RM_STDIO_LITTLEFS_CFG_LFS, (char *) keys[keyIndex], &xFileInfo ) == LFS_ERR_OK )
         {
-                xLength =  xFileInfo.size;
+            xLength =  xFileInfo.size;
         }
-        return xLength;
+    }
+    else
+    {
+        prvKvsLogLoad();
+        xLength = xLogIndex[keyIndex].ulLength;
+    }
+    littlFs_unlock();
+    return xLength;
 
 }
 /**********************************************************************************************************************
@@ -169,14 +619,11 @@ int32_t xprvGetValueLengthFromImpl( KVStoreKey_t keyIndex)
 int32_t GetTotalLengthFromImpl()
 {
     size_t xLength = 0;
-    struct lfs_info xFileInfo = { 0 };
+
     for (uint32_t i = 0; i < KVS_NUM_KEYS; i++)
     {
-    	/* Cast to type "char *" to be compatible with parameter type */
-        if (lfs_stat (&RM_STDIO_LITTLEFS_CFG_LFS, (char*) keys[i], &xFileInfo) == LFS_ERR_OK)
-        {
-            xLength += xFileInfo.size;
-        }
+        /* Cast to type "KVStoreKey_t" to be compatible with parameter type */
+        xLength += xprvGetValueLengthFromImpl((KVStoreKey_t)i);
     }
 
     return xLength;
@@ -386,15 +833,76 @@ int32_t Filename2Handle( char * pcFileName, size_t KeyLength)
 
 /**********************************************************************************************************************
  * Function Name: KVStore_xCommitChanges
- * Description  : Commit data and save it into Data Flash
+ * Description  : Commit data and save it into Data Flash. The changed values other than the PKCS #11 objects are
+ *                stored together as one transaction, then the PKCS #11 objects are provisioned one by one. Keys
+ *                that could not be stored stay pending, so that a later commit retries them.
  * Return Value : True if successfully.
  *********************************************************************************************************************/
 BaseType_t KVStore_xCommitChanges(void)
 {
 
     BaseType_t xSuccess = pdFALSE;
-    CK_SESSION_HANDLE xP11Session;
+    BaseType_t xPkcs11Pending = pdFALSE;
+    CK_SESSION_HANDLE xP11Session = CK_INVALID_HANDLE;
     CK_RV xResult = CKR_OK;
+    KVStoreLogItem_t xItems[KVS_NUM_KEYS];
+    size_t xItemCount = 0;
+
+    for (size_t i = 0; i < KVS_NUM_KEYS; i++)
+    {
+        if (pdTRUE != gKeyValueStore.table[i].xChangePending)
+        {
+            continue;
+        }
+
+        if (pdTRUE == prvIsPkcs11Key(i))
+        {
+            xPkcs11Pending = pdTRUE;
+        }
+        else if ((KVS_TSIP_ROOTCA_PUBKEY_ID == i) ||
+                 (KVS_TSIP_CLIENT_PUBKEY_ID == i) ||
+                 (KVS_TSIP_CLIENT_PRIKEY_ID == i))
+        {
+            /* No commit processing */
+        }
+        else
+        {
+            /* Cast to type "KVStoreKey_t" to be compatible with the item */
+            xItems[xItemCount].xKey = (KVStoreKey_t)i;
+            xItems[xItemCount].pcData = gKeyValueStore.table[i].value;
+            xItems[xItemCount].ulLength = gKeyValueStore.table[i].valueLength;
+            xItemCount++;
+        }
+    }
+
+    if (xItemCount > 0)
+    {
+        littlFs_lock();
+        if (pdTRUE != prvKvsLogCommit(xItems, xItemCount))
+        {
+            littlFs_unlock();
+            LogError(("Failed to store the configuration."));
+            return pdFALSE;
+        }
+
+        for (size_t i = 0; i < xItemCount; i++)
+        {
+            gKeyValueStore.table[xItems[i].xKey].xChangePending = pdFALSE;
+
+            if (KVS_ROOT_CA_ID == xItems[i].xKey)
+            {
+                TLS_FreeRTOS_InvalidateCredentials();
+                (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, TLS_TRANSPORT_SESSION_FILE_NAME);
+            }
+        }
+        littlFs_unlock();
+        xSuccess = pdTRUE;
+    }
+
+    if (pdFALSE == xPkcs11Pending)
+    {
+        return xSuccess;
+    }
 
     /* Initialize the PKCS Module */
     xResult = xInitializePkcs11Token();
@@ -417,7 +925,7 @@ BaseType_t KVStore_xCommitChanges(void)
                 xSuccess = vDevModeKeyPreProvisioning(gKeyValueStore, (KVStoreKey_t)i, gKeyValueStore.table[i].valueLength);
                 if (xSuccess == pdFALSE)
                 {
-                    return xSuccess;
+                    break;
                 }
 
                 gKeyValueStore.table[i].xChangePending = pdFALSE;
@@ -432,7 +940,8 @@ BaseType_t KVStore_xCommitChanges(void)
                 if (xResult != CKR_OK)
                 {
                     LogError(("Failed to store claim certificate."));
-                    return pdFALSE;
+                    xSuccess = pdFALSE;
+                    break;
                 }
                 else
                 {
@@ -450,7 +959,8 @@ BaseType_t KVStore_xCommitChanges(void)
                 if (xResult != CKR_OK)
                 {
                     LogError(("Failed to store claim private key."));
-                    return pdFALSE;
+                    xSuccess = pdFALSE;
+                    break;
                 }
                 else
                 {
@@ -458,28 +968,17 @@ BaseType_t KVStore_xCommitChanges(void)
                     gKeyValueStore.table[i].xChangePending = pdFALSE;
                 }
             }
-            else if ((KVS_TSIP_ROOTCA_PUBKEY_ID == i) ||
-                     (KVS_TSIP_CLIENT_PUBKEY_ID == i) ||
-                     (KVS_TSIP_CLIENT_PRIKEY_ID == i))
-            {
-                /* No commit processing */
-            }
-            /*
-             * Check if others
-             */
             else
             {
-                xSuccess = xprvWriteValueToImpl((KVStoreKey_t)i, (char *)gKeyValueStore.table[i].value,
-                                                gKeyValueStore.table[i].valueLength);
-                if (xSuccess != pdTRUE)
-                {
-                    return pdFALSE;
-                }
-                gKeyValueStore.table[i].xChangePending = pdFALSE;
+                /* Stored in the log above */
             }
         }
     }
-    xPkcs11CloseSession(xP11Session);
+
+    if (CK_INVALID_HANDLE != xP11Session)
+    {
+        xPkcs11CloseSession(xP11Session);
+    }
     return xSuccess;
 }
 /**********************************************************************************************************************
@@ -691,6 +1190,9 @@ void vprvCacheFormat(void)
         memset(gKeyValueStore.table[i].key, 0, KVSTORE_KEY_MAX_LEN);
         vClearDataBuffer ((KVStoreKey_t)i);
     }
+
+    /* The file system was formatted, the log is rebuilt on next use. */
+    xLogLoaded = pdFALSE;
 }
 /**********************************************************************************************************************
  End of function vprvCacheFormat
@@ -39,6 +39,10 @@
 
 extern lfs_t RM_STDIO_LITTLEFS_CFG_LFS;
 
+/* LittleFS is not thread safe, hold this lock around every call on RM_STDIO_LITTLEFS_CFG_LFS. */
+extern void littlFs_lock (void);
+extern void littlFs_unlock (void);
+
 #define KVSTORE_KEY_MAX_LEN (32)
 #define KVSTORE_VAL_MAX_LEN (2048)
 
@@ -829,7 +829,7 @@ BaseType_t xEstablishMqttSession(MQTTContext_t *pxMqttContext,
         xTransport.pNetworkContext = pxNetworkContext;
         xTransport.send = TLS_FreeRTOS_send;
         xTransport.recv = TLS_FreeRTOS_recv;
-        xTransport.writev = NULL;
+        xTransport.writev = TLS_FreeRTOS_writev;
 
         /* Initialize MQTT library. */
         xMQTTStatus = MQTT_Init(pxMqttContext,
@@ -38,6 +38,7 @@
 
 /* Kernel includes. */
 #include "FreeRTOS.h"
+#include "task.h"
 #include "semphr.h"
 
 /* Header include. */
@@ -48,8 +49,28 @@
 #include "demo_config.h"
 /*-----------------------------------------------------------*/
 
-#define QUEUE_NOT_INITIALIZED (0U)
-#define QUEUE_INITIALIZED (1U)
+/**
+ * @brief Number of command structures in the overflow arena. They are handed out only
+ * when all MQTT_COMMAND_CONTEXTS_POOL_SIZE structures are in use, to absorb a burst of
+ * commands. The overflowAllocations statistic shows how often a burst needed them.
+ * MQTT_AGENT_COMMAND_QUEUE_LENGTH should cover both pools. Set to 0 to disable the arena.
+ */
+#ifndef MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE
+#define MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE (0U)
+#endif
+
+/**
+ * @brief Number of calling tasks for which Agent_GetCommand() statistics are kept.
+ */
+#ifndef MQTT_COMMAND_POOL_STATS_CALLERS
+#define MQTT_COMMAND_POOL_STATS_CALLERS (8U)
+#endif
+
+#define POOL_NOT_INITIALIZED (0U)
+#define POOL_INITIALIZED (1U)
+
+#define POOL_TOTAL_SIZE (MQTT_COMMAND_CONTEXTS_POOL_SIZE + MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE)
+#define POOL_BITMAP_WORDS ((POOL_TOTAL_SIZE + 31U) / 32U)
 
 /**
  * @brief The pool of command structures used to hold information on commands (such
@@ -58,55 +79,296 @@
  */
 static MQTTAgentCommand_t commandStructurePool[MQTT_COMMAND_CONTEXTS_POOL_SIZE];
 
+#if (MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE > 0)
+
+/**
+ * @brief Command structures used once commandStructurePool is exhausted.
+ */
+static MQTTAgentCommand_t commandStructureOverflowPool[MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE];
+#endif
+
 /**
- * @brief The message context used to guard the pool of MQTTAgentCommand_t structures.
- * For FreeRTOS, this is implemented with a queue. Structures may be
- * obtained by receiving a pointer from the queue, and returned by
- * sending the pointer back into it.
+ * @brief Free structures, one bit per structure of commandStructurePool followed by
+ * commandStructureOverflowPool. A set bit is a free structure.
+ *
+ * The bitmap is changed in short critical sections with a fixed bound, so a
+ * structure can be obtained and returned from tasks and interrupts without the
+ * queue operation and possible context switch of a FreeRTOS queue. The RX cores
+ * have no compare-and-swap instruction, so masking interrupts is the cheapest
+ * atomic update available.
  */
-static MQTTAgentMessageContext_t commandStructMessageCtx;
+static uint32_t freeBitmap[POOL_BITMAP_WORDS];
 
 /**
- * @brief Initialization status of the queue.
+ * @brief Counting semaphore given when a structure is returned while a task
+ * waits in Agent_GetCommand(). A woken task retries the bitmap.
  */
-static volatile uint8_t initStatus = QUEUE_NOT_INITIALIZED;
+static SemaphoreHandle_t releasedSemaphore;
+
+/**
+ * @brief Number of tasks waiting in Agent_GetCommand().
+ */
+static UBaseType_t waitingTasks;
+
+static CommandPoolStats_t poolStats;
+static CommandPoolCallerStats_t callerStats[MQTT_COMMAND_POOL_STATS_CALLERS];
+
+/**
+ * @brief Initialization status of the pool.
+ */
+static volatile uint8_t initStatus = POOL_NOT_INITIALIZED;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Take a free structure from the bitmap, preferring commandStructurePool.
+ * Must be called in a critical section.
+ */
+static MQTTAgentCommand_t *prvTakeFreeCommand(void);
+
+/**
+ * @brief Index of a pool structure, or POOL_TOTAL_SIZE if the structure is not from the pool.
+ */
+static size_t prvCommandIndex(const MQTTAgentCommand_t *pCommand);
+
+/**
+ * @brief Update the statistics of an Agent_GetCommand() call. Must be called in a critical section.
+ */
+static void prvRecordGet(TaskHandle_t caller,
+                          bool obtained,
+                          TickType_t waitTicks);
+
+/**
+ * @brief Return a structure to the bitmap.
+ *
+ * @return pdTRUE if a waiting task must be woken.
+ */
+static BaseType_t prvPutCommand(size_t index);
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvTakeFreeCommand
+ * Description  : Take the first free structure of the bitmap.
+ * Return Value : Structure, or NULL if all structures are in use.
+ *********************************************************************************************************************/
+static MQTTAgentCommand_t *prvTakeFreeCommand(void)
+{
+    MQTTAgentCommand_t *pCommand = NULL;
+    size_t word;
+    size_t bit;
+    size_t index;
+
+    for (word = 0U; (word < POOL_BITMAP_WORDS) && (NULL == pCommand); word++)
+    {
+        if (0U != freeBitmap[word])
+        {
+            for (bit = 0U; 0U == (freeBitmap[word] & (1UL << bit)); bit++)
+            {
+            }
+
+            freeBitmap[word] &= ~(1UL << bit);
+            index = (word *32U) + bit;
+
+            poolStats.inUse++;
+
+            if (poolStats.inUse > poolStats.peakInUse)
+            {
+                poolStats.peakInUse = poolStats.inUse;
+            }
+
+            if (index < MQTT_COMMAND_CONTEXTS_POOL_SIZE)
+            {
+                pCommand = &commandStructurePool[index];
+            }
+
+#if (MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE > 0)
+            else
+            {
+                pCommand = &commandStructureOverflowPool[index - MQTT_COMMAND_CONTEXTS_POOL_SIZE];
+                poolStats.overflowAllocations++;
+            }
+#endif
+        }
+    }
+
+    return pCommand;
+}
+/**********************************************************************************************************************
+ End of function prvTakeFreeCommand
+ *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvCommandIndex
+ * Description  : Find the bitmap index of a structure.
+ * Argument     : pCommand
+ * Return Value : Index, or POOL_TOTAL_SIZE if the structure is not from the pool.
+ *********************************************************************************************************************/
+static size_t prvCommandIndex(const MQTTAgentCommand_t *pCommand)
+{
+    size_t index = POOL_TOTAL_SIZE;
+
+    if ((pCommand >= commandStructurePool) &&
+        (pCommand < (commandStructurePool + MQTT_COMMAND_CONTEXTS_POOL_SIZE)))
+    {
+        index = (size_t)(pCommand - commandStructurePool);
+    }
+
+#if (MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE > 0)
+    else if ((pCommand >= commandStructureOverflowPool) &&
+             (pCommand < (commandStructureOverflowPool + MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE)))
+    {
+        index = MQTT_COMMAND_CONTEXTS_POOL_SIZE + (size_t)(pCommand - commandStructureOverflowPool);
+    }
+#endif
+
+    return index;
+}
+/**********************************************************************************************************************
+ End of function prvCommandIndex
+ *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvRecordGet
+ * Description  : Update the pool and caller statistics of an Agent_GetCommand() call.
+ * Argument     : caller - calling task, NULL for an interrupt.
+ *                obtained - a structure was obtained.
+ *                waitTicks - time spent waiting for a structure.
+ * Return Value : None.
+ *********************************************************************************************************************/
+static void prvRecordGet(TaskHandle_t caller,
+                          bool obtained,
+                          TickType_t waitTicks)
+{
+    CommandPoolCallerStats_t *pStats = NULL;
+    size_t i;
+
+    if (obtained)
+    {
+        poolStats.allocations++;
+    }
+    else
+    {
+        poolStats.failures++;
+    }
+
+    if (waitTicks > poolStats.maxWaitTicks)
+    {
+        poolStats.maxWaitTicks = waitTicks;
+    }
+
+    for (i = 0U; (i < MQTT_COMMAND_POOL_STATS_CALLERS) && (NULL == pStats); i++)
+    {
+        if ((callerStats[i].used) && (callerStats[i].caller == caller))
+        {
+            pStats = &callerStats[i];
+        }
+    }
+
+    for (i = 0U; (i < MQTT_COMMAND_POOL_STATS_CALLERS) && (NULL == pStats); i++)
+    {
+        if (!callerStats[i].used)
+        {
+            pStats = &callerStats[i];
+            pStats->used = true;
+            pStats->caller = caller;
+        }
+    }
+
+    /* Callers beyond MQTT_COMMAND_POOL_STATS_CALLERS are only counted in poolStats. */
+    if (NULL != pStats)
+    {
+        if (obtained)
+        {
+            pStats->allocations++;
+        }
+        else
+        {
+            pStats->failures++;
+        }
+
+        pStats->totalWaitTicks += waitTicks;
+
+        if (waitTicks > pStats->maxWaitTicks)
+        {
+            pStats->maxWaitTicks = waitTicks;
+        }
+    }
+}
+/**********************************************************************************************************************
+ End of function prvRecordGet
+ *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvPutCommand
+ * Description  : Mark a structure as free.
+ * Argument     : index - bitmap index of the structure.
+ * Return Value : pdTRUE if a task waits for a structure, otherwise pdFALSE.
+ *********************************************************************************************************************/
+static BaseType_t prvPutCommand(size_t index)
+{
+    UBaseType_t savedInterruptStatus;
+    BaseType_t wakeWaiter = pdFALSE;
+    uint32_t mask = 1UL << (index % 32U);
+
+    savedInterruptStatus = taskENTER_CRITICAL_FROM_ISR();
+    {
+        /* A structure returned twice is only freed once. */
+        configASSERT(0U == (freeBitmap[index / 32U] & mask));
+
+        if (0U == (freeBitmap[index / 32U] & mask))
+        {
+            freeBitmap[index / 32U] |= mask;
+            poolStats.inUse--;
+            wakeWaiter = (waitingTasks > 0U) ? pdTRUE : pdFALSE;
+        }
+    }
+    taskEXIT_CRITICAL_FROM_ISR(savedInterruptStatus);
+
+    return wakeWaiter;
+}
+/**********************************************************************************************************************
+ End of function prvPutCommand
+ *********************************************************************************************************************/
 
 /*-----------------------------------------------------------*/
 
 /**********************************************************************************************************************
  * Function Name: Agent_InitializePool
- * Description  : .
- * Return Value : .
+ * Description  : Mark every structure of the pool as free.
+ * Return Value : None.
  *********************************************************************************************************************/
 void Agent_InitializePool(void)
 {
     size_t i;
-    MQTTAgentCommand_t *pCommand;
-    static uint8_t staticQueueStorageArea[MQTT_COMMAND_CONTEXTS_POOL_SIZE * sizeof(MQTTAgentCommand_t *)];
-    static StaticQueue_t staticQueueStructure;
-    bool commandAdded = false;
+    static StaticSemaphore_t staticSemaphoreStructure;
 
-    if (QUEUE_NOT_INITIALIZED == initStatus)
+    if (POOL_NOT_INITIALIZED == initStatus)
     {
         memset((void *)commandStructurePool, 0x00, sizeof(commandStructurePool));
-        commandStructMessageCtx.queue = xQueueCreateStatic(MQTT_COMMAND_CONTEXTS_POOL_SIZE,
-                                                           sizeof(MQTTAgentCommand_t *),
-                                                           staticQueueStorageArea,
-                                                           &staticQueueStructure);
-        configASSERT(commandStructMessageCtx.queue);
-
-        /* Populate the queue. */
-        for (i = 0; i < MQTT_COMMAND_CONTEXTS_POOL_SIZE; i++)
-        {
-            /* Store the address as a variable. */
-            pCommand = &commandStructurePool[i];
+#if (MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE > 0)
+        memset((void *)commandStructureOverflowPool, 0x00, sizeof(commandStructureOverflowPool));
+#endif
+        memset((void *)freeBitmap, 0x00, sizeof(freeBitmap));
+        memset((void *)&poolStats, 0x00, sizeof(poolStats));
+        memset((void *)callerStats, 0x00, sizeof(callerStats));
+        waitingTasks = 0U;
 
-            /* Send the pointer to the queue. */
-            commandAdded = Agent_MessageSend(&commandStructMessageCtx, &pCommand, 0U);
-            configASSERT(commandAdded);
+        releasedSemaphore = xSemaphoreCreateCountingStatic(POOL_TOTAL_SIZE, 0U, &staticSemaphoreStructure);
+        configASSERT(releasedSemaphore);
+
+        for (i = 0U; i < POOL_TOTAL_SIZE; i++)
+        {
+            freeBitmap[i / 32U] |= 1UL << (i % 32U);
         }
 
-        initStatus = QUEUE_INITIALIZED;
+        initStatus = POOL_INITIALIZED;
     }
 }
 /**********************************************************************************************************************
@@ -117,22 +379,63 @@ void Agent_InitializePool(void)
 
 /**********************************************************************************************************************
  * Function Name: Agent_GetCommand
- * Description  : .
+ * Description  : Take a free structure. If none is free, wait until one is
+ *                returned or blockTimeMs expires.
  * Argument     : blockTimeMs
- * Return Value : .
+ * Return Value : Structure, or NULL if none became free in time.
  *********************************************************************************************************************/
 MQTTAgentCommand_t *Agent_GetCommand(uint32_t blockTimeMs)
 {
     MQTTAgentCommand_t *structToUse = NULL;
-    bool structRetrieved = false;
+    TickType_t ticksToWait = pdMS_TO_TICKS(blockTimeMs);
+    TickType_t startTicks = xTaskGetTickCount();
+    TimeOut_t timeOut;
+    bool waiting = false;
+    bool timedOut = false;
+
+    /* Check the pool has been initialized. */
+    configASSERT(POOL_INITIALIZED == initStatus);
 
-    /* Check queue has been created. */
-    configASSERT(QUEUE_INITIALIZED == initStatus);
+    vTaskSetTimeOutState(&timeOut);
+
+    while ((NULL == structToUse) && (!timedOut))
+    {
+        taskENTER_CRITICAL();
+        {
+            structToUse = prvTakeFreeCommand();
+
+            if (waiting)
+            {
+                waitingTasks--;
+                waiting = false;
+            }
+
+            if (NULL != structToUse)
+            {
+                prvRecordGet(xTaskGetCurrentTaskHandle(), true, xTaskGetTickCount() - startTicks);
+            }
+            else if (xTaskCheckForTimeOut(&timeOut, &ticksToWait) != pdFALSE)
+            {
+                timedOut = true;
+                prvRecordGet(xTaskGetCurrentTaskHandle(), false, xTaskGetTickCount() - startTicks);
+            }
+            else
+            {
+                /* Registered in the same critical section as the failed take, so a
+                 * structure returned from now on gives releasedSemaphore. */
+                waitingTasks++;
+                waiting = true;
+            }
+        }
+        taskEXIT_CRITICAL();
 
-    /* Retrieve a struct from the queue. */
-    structRetrieved = Agent_MessageReceive(&commandStructMessageCtx, &(structToUse), blockTimeMs);
+        if (waiting)
+        {
+            (void)xSemaphoreTake(releasedSemaphore, ticksToWait);
+        }
+    }
 
-    if (!structRetrieved)
+    if (NULL == structToUse)
     {
         LogError(("No command structure available."));
     }
@@ -145,29 +448,58 @@ MQTTAgentCommand_t *Agent_GetCommand(uint32_t blockTimeMs)
 
 /*-----------------------------------------------------------*/
 
+/**********************************************************************************************************************
+ * Function Name: Agent_GetCommandFromISR
+ * Description  : Take a free structure without waiting.
+ * Return Value : Structure, or NULL if all structures are in use.
+ *********************************************************************************************************************/
+MQTTAgentCommand_t *Agent_GetCommandFromISR(void)
+{
+    MQTTAgentCommand_t *structToUse;
+    UBaseType_t savedInterruptStatus;
+
+    configASSERT(POOL_INITIALIZED == initStatus);
+
+    savedInterruptStatus = taskENTER_CRITICAL_FROM_ISR();
+    {
+        structToUse = prvTakeFreeCommand();
+        prvRecordGet(NULL, (NULL != structToUse), 0U);
+    }
+    taskEXIT_CRITICAL_FROM_ISR(savedInterruptStatus);
+
+    return structToUse;
+}
+/**********************************************************************************************************************
+ End of function Agent_GetCommandFromISR
+ *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
 /**********************************************************************************************************************
  * Function Name: Agent_ReleaseCommand
- * Description  : .
+ * Description  : Return a structure to the pool and wake a waiting task.
  * Argument     : pCommandToRelease
- * Return Value : .
+ * Return Value : true if the structure was returned, false if it is not from the pool.
  *********************************************************************************************************************/
 bool Agent_ReleaseCommand(MQTTAgentCommand_t *pCommandToRelease)
 {
     bool structReturned = false;
+    size_t index;
 
-    configASSERT(QUEUE_INITIALIZED == initStatus);
+    configASSERT(POOL_INITIALIZED == initStatus);
 
     /* See if the structure being returned is actually from the pool. */
-    if ((pCommandToRelease >= commandStructurePool) &&
-        (pCommandToRelease < (commandStructurePool + MQTT_COMMAND_CONTEXTS_POOL_SIZE)))
+    index = prvCommandIndex(pCommandToRelease);
+
+    if (index < POOL_TOTAL_SIZE)
     {
-        structReturned = Agent_MessageSend(&commandStructMessageCtx, &pCommandToRelease, 0U);
+        if (pdTRUE == prvPutCommand(index))
+        {
+            (void)xSemaphoreGive(releasedSemaphore);
+        }
 
-        /* The send should not fail as the queue was created to hold every command
-         * in the pool. */
-        configASSERT(structReturned);
-        LogDebug(("Returned Command Context %d to pool",
-                  (int)(pCommandToRelease - commandStructurePool)));
+        structReturned = true;
+        LogDebug(("Returned Command Context %d to pool", (int)index));
     }
 
     return structReturned;
@@ -175,3 +507,81 @@ bool Agent_ReleaseCommand(MQTTAgentCommand_t *pCommandToRelease)
 /**********************************************************************************************************************
  End of function Agent_ReleaseCommand
  *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: Agent_ReleaseCommandFromISR
+ * Description  : Return a structure to the pool from an interrupt.
+ * Argument     : pCommandToRelease
+ *                pHigherPriorityTaskWoken - set to pdTRUE if a context switch should be requested.
+ * Return Value : true if the structure was returned, false if it is not from the pool.
+ *********************************************************************************************************************/
+bool Agent_ReleaseCommandFromISR(MQTTAgentCommand_t *pCommandToRelease,
+                                  BaseType_t *pHigherPriorityTaskWoken)
+{
+    bool structReturned = false;
+    size_t index;
+
+    configASSERT(POOL_INITIALIZED == initStatus);
+
+    index = prvCommandIndex(pCommandToRelease);
+
+    if (index < POOL_TOTAL_SIZE)
+    {
+        if (pdTRUE == prvPutCommand(index))
+        {
+            (void)xSemaphoreGiveFromISR(releasedSemaphore, pHigherPriorityTaskWoken);
+        }
+
+        structReturned = true;
+    }
+
+    return structReturned;
+}
+/**********************************************************************************************************************
+ End of function Agent_ReleaseCommandFromISR
+ *********************************************************************************************************************/
+
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: Agent_GetCommandPoolStats
+ * Description  : Copy the pool and caller statistics.
+ * Argument     : pStats - pool statistics.
+ *                pCallerStats - caller statistics, may be NULL.
+ *                maxCallers - number of entries of pCallerStats.
+ * Return Value : Number of entries written to pCallerStats.
+ *********************************************************************************************************************/
+size_t Agent_GetCommandPoolStats(CommandPoolStats_t *pStats,
+                                  CommandPoolCallerStats_t *pCallerStats,
+                                  size_t maxCallers)
+{
+    size_t i;
+    size_t callers = 0U;
+
+    taskENTER_CRITICAL();
+    {
+        if (NULL != pStats)
+        {
+            *pStats = poolStats;
+            pStats->size = MQTT_COMMAND_CONTEXTS_POOL_SIZE;
+            pStats->overflowSize = MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE;
+        }
+
+        for (i = 0U; (i < MQTT_COMMAND_POOL_STATS_CALLERS) && (NULL != pCallerStats) && (callers < maxCallers); i++)
+        {
+            if (callerStats[i].used)
+            {
+                pCallerStats[callers] = callerStats[i];
+                callers++;
+            }
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    return callers;
+}
+/**********************************************************************************************************************
+ End of function Agent_GetCommandPoolStats
+ *********************************************************************************************************************/
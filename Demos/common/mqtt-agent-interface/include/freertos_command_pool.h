@@ -31,9 +31,41 @@
 #ifndef FREERTOS_COMMAND_POOL_H
 #define FREERTOS_COMMAND_POOL_H
 
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
 /* MQTT agent includes. */
 #include "core_mqtt_agent.h"
 
+/**
+ * @brief Statistics of the command structure pool.
+ */
+typedef struct CommandPoolStats
+{
+    size_t size;                 /**< MQTT_COMMAND_CONTEXTS_POOL_SIZE. */
+    size_t overflowSize;         /**< MQTT_COMMAND_CONTEXTS_OVERFLOW_POOL_SIZE. */
+    size_t inUse;                /**< Structures currently obtained. */
+    size_t peakInUse;            /**< Most structures obtained at the same time. */
+    uint32_t allocations;        /**< Structures obtained. */
+    uint32_t overflowAllocations; /**< Structures obtained from the overflow arena. */
+    uint32_t failures;           /**< Calls that returned NULL. */
+    TickType_t maxWaitTicks;     /**< Longest wait for a structure. */
+} CommandPoolStats_t;
+
+/**
+ * @brief Statistics of the Agent_GetCommand() calls of one task.
+ */
+typedef struct CommandPoolCallerStats
+{
+    TaskHandle_t caller;         /**< Calling task, NULL for Agent_GetCommandFromISR(). */
+    bool used;
+    uint32_t allocations;
+    uint32_t failures;
+    TickType_t totalWaitTicks;
+    TickType_t maxWaitTicks;
+} CommandPoolCallerStats_t;
+
 /**
  * @brief Initialize the common task pool. Not thread safe.
  */
@@ -80,4 +112,37 @@ MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs );
  */
 bool Agent_ReleaseCommand( MQTTAgentCommand_t * pCommandToRelease );
 
+/**
+ * @brief Obtain a MQTTAgentCommand_t structure from an interrupt. Does not wait.
+ *
+ * @return A pointer to a MQTTAgentCommand_t structure, or NULL if all are in use.
+ */
+MQTTAgentCommand_t * Agent_GetCommandFromISR( void );
+
+/**
+ * @brief Give a MQTTAgentCommand_t structure back to the pool from an interrupt.
+ *
+ * @param[in] pCommandToRelease A pointer to the MQTTAgentCommand_t structure to return to
+ * the pool.
+ * @param[out] pHigherPriorityTaskWoken Set to pdTRUE if a task waiting for a structure
+ * was woken and a context switch should be requested before the interrupt exits.
+ *
+ * @return true if the MQTTAgentCommand_t structure was returned to the pool, otherwise false.
+ */
+bool Agent_ReleaseCommandFromISR( MQTTAgentCommand_t * pCommandToRelease,
+                                  BaseType_t * pHigherPriorityTaskWoken );
+
+/**
+ * @brief Get the statistics of the pool and of the tasks calling Agent_GetCommand().
+ *
+ * @param[out] pStats Pool statistics, may be NULL.
+ * @param[out] pCallerStats Caller statistics, may be NULL.
+ * @param[in] maxCallers Number of entries of pCallerStats.
+ *
+ * @return Number of entries written to pCallerStats.
+ */
+size_t Agent_GetCommandPoolStats( CommandPoolStats_t * pStats,
+                                  CommandPoolCallerStats_t * pCallerStats,
+                                  size_t maxCallers );
+
 #endif /* FREERTOS_COMMAND_POOL_H */
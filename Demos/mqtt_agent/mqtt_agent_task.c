@@ -135,6 +135,15 @@
 #define democonfigMQTT_BROKER_PORT (clientcredentialMQTT_BROKER_PORT)
 #endif
 
+#ifndef democonfigTLS_MAX_FRAGMENT_LENGTH
+
+/**
+ * @brief TLS maximum fragment length to negotiate with the broker in bytes: 512, 1024,
+ * 2048, 4096, or 16384 for none. 0 keeps the default of the TLS transport.
+ */
+#define democonfigTLS_MAX_FRAGMENT_LENGTH (0U)
+#endif
+
 /**
  * @brief The maximum number of times to run the subscribe publish loop in this
  * demo.
@@ -159,6 +168,81 @@
 #define MQTT_AGENT_MAX_SUBSCRIPTIONS (10U)
 #endif
 
+/**
+ * @brief Number of hash buckets indexing the subscription store. Must be a power of two.
+ *
+ * A filter without wildcards is indexed by its whole text, a filter with wildcards by the
+ * levels before its first wildcard level. An incoming publish only visits the buckets of its
+ * own topic and of the level prefixes of the topic, so the dispatch cost depends on the number
+ * of topic levels rather than on the number of subscriptions.
+ */
+#ifndef MQTT_AGENT_SUBSCRIPTION_BUCKETS
+#define MQTT_AGENT_SUBSCRIPTION_BUCKETS (16U)
+#endif
+
+#if (MQTT_AGENT_SUBSCRIPTION_BUCKETS & (MQTT_AGENT_SUBSCRIPTION_BUCKETS - 1U)) != 0
+#error "MQTT_AGENT_SUBSCRIPTION_BUCKETS must be a power of two."
+#endif
+
+/**
+ * @brief End of a subscription bucket chain.
+ */
+#define mqttexampleSUBSCRIPTION_NONE (0xFFFFU)
+
+/**
+ * @brief Lock-free reads of the subscription store that are retried before the agent falls back
+ * to reading it under xSubscriptionsMutex.
+ */
+#define mqttexampleSUBSCRIPTION_READ_RETRIES (3U)
+
+/**
+ * @brief Tasks running subscription callbacks: the MQTT agent and the dispatch task.
+ */
+#define mqttexampleCALLBACK_RUN_AGENT (0U)
+#define mqttexampleCALLBACK_RUN_DISPATCH (1U)
+#define mqttexampleCALLBACK_RUNS (2U)
+
+/**
+ * @brief Number of buffers for publishes to subscriptions added with xAddMQTTTopicFilterDeferredCallback().
+ *
+ * Such publishes are copied and their callbacks run on the dispatch task, so a slow callback does not
+ * stop the MQTT agent command loop. When all buffers are in use, further publishes for deferred
+ * subscriptions are dropped and counted, see vGetMQTTAgentDispatchStats().
+ * Deferred dispatch is disabled by default, so no dispatch task, queues or buffers are created and
+ * xAddMQTTTopicFilterDeferredCallback() fails. Set it to e.g. 4 to enable it.
+ */
+#ifndef MQTT_AGENT_DISPATCH_QUEUE_LENGTH
+#define MQTT_AGENT_DISPATCH_QUEUE_LENGTH (0U)
+#endif
+
+/**
+ * @brief Size of a dispatch buffer. It holds the topic and the payload of one publish.
+ */
+#ifndef MQTT_AGENT_DISPATCH_BUFFER_SIZE
+#define MQTT_AGENT_DISPATCH_BUFFER_SIZE (512U)
+#endif
+
+/**
+ * @brief Time the MQTT agent waits for a free dispatch buffer before a publish is dropped.
+ */
+#ifndef MQTT_AGENT_DISPATCH_BLOCK_TIME_MS
+#define MQTT_AGENT_DISPATCH_BLOCK_TIME_MS (0U)
+#endif
+
+#ifndef MQTT_AGENT_DISPATCH_TASK_STACK_SIZE
+#define MQTT_AGENT_DISPATCH_TASK_STACK_SIZE (2048U)
+#endif
+
+#ifndef MQTT_AGENT_DISPATCH_TASK_PRIORITY
+#define MQTT_AGENT_DISPATCH_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+
+/**
+ * @brief FNV-1a parameters of the subscription index hash.
+ */
+#define mqttexampleFNV_OFFSET_BASIS (2166136261UL)
+#define mqttexampleFNV_PRIME        (16777619UL)
+
 /**
  * @brief Timeout for receiving CONNACK after sending an MQTT CONNECT packet.
  * Defined in milliseconds.
@@ -213,6 +297,19 @@
  */
 #define mqttexamplePERSISTENT_SESSION_REQUIRED       ( 1 )
 
+/**
+ * @brief Keep the TLS session in littlefs, so the first connection after a reset can
+ * also resume it. The file holds the session master secret. It is removed once loaded,
+ * as the time spent in reset does not count towards the session lifetime.
+ * Set to 0 to keep the session in RAM only.
+ */
+#define mqttexampleTLS_SESSION_STORE_ENABLE (1)
+
+/**
+ * @brief Largest size of the littlefs file holding the TLS session.
+ */
+#define mqttexampleTLS_SESSION_MAX_SIZE (512U)
+
 /**
  * @brief Used to convert times to/from ticks and milliseconds.
  */
@@ -272,8 +369,46 @@ typedef struct TopicFilterSubscription
     uint16_t usTopicFilterLength;
     const char *pcTopicFilter;
     BaseType_t xManageResubscription;
+    uint32_t ulKeyHash;          /* Hash of the first usKeyLength characters of the filter. */
+    uint16_t usKeyLength;        /* Whole filter, or the levels before the first wildcard level. */
+    bool xHasWildcard;
+    bool xDeferred;              /* The callback runs on the dispatch task. */
+    uint16_t usNextInBucket;     /* Next subscription in the same bucket. */
 } TopicFilterSubscription_t;
 
+/**
+ * @brief A subscription matching the incoming publish.
+ */
+typedef struct SubscriptionMatch
+{
+    IncomingPubCallback_t pxIncomingPublishCallback;
+    void *pvIncomingPublishCallbackContext;
+    uint16_t usIndex;
+    bool xDeferred;
+} SubscriptionMatch_t;
+
+/**
+ * @brief Subscription callback being run by a task, so that removing a subscription can wait
+ * for its callback to return.
+ */
+typedef struct CallbackRun
+{
+    TaskHandle_t xTask;          /* Task running a callback, NULL while none runs. */
+    uint32_t ulReturned;         /* Number of callbacks of the task that returned. */
+} CallbackRun_t;
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+/**
+ * @brief Copy of a publish waiting for the dispatch task.
+ */
+typedef struct DeferredPublish
+{
+    SubscriptionMatch_t xMatch;
+    MQTTPublishInfo_t xPublishInfo;
+    uint8_t ucBuffer[MQTT_AGENT_DISPATCH_BUFFER_SIZE];
+} DeferredPublish_t;
+#endif
+
 /*-----------------------------------------------------------*/
 
 static TlsTransportParams_t xTlsTransportParams;
@@ -354,6 +489,62 @@ static void prvIncomingPublishCallback (MQTTAgentContext_t *pMqttAgentContext,
 
 static bool prvMatchTopicFilterSubscriptions (MQTTPublishInfo_t *pxPublishInfo);
 
+/**
+ * @brief Run the callback of a matched subscription unless it was removed meanwhile.
+ */
+static void prvRunSubscriptionCallback (uint32_t ulRun,
+                                        const SubscriptionMatch_t *pxMatch,
+                                        MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Continue the subscription index hash over more characters.
+ */
+static uint32_t prvSubscriptionHash (uint32_t ulHash, const char *pcText, size_t xLength);
+
+/**
+ * @brief Find the index key of a topic filter: its whole text, or the levels before the first
+ * wildcard level.
+ */
+static uint16_t prvSubscriptionKeyLength (const char *pcTopicFilter, uint16_t usTopicFilterLength, bool *pxHasWildcard);
+
+/**
+ * @brief Append the subscriptions in one bucket whose key is the given topic prefix and which match
+ * the publish to xSubscriptionMatches.
+ */
+static uint32_t prvCollectSubscriptionBucket (MQTTPublishInfo_t *pxPublishInfo,
+                                              uint32_t ulKeyHash,
+                                              uint16_t usKeyLength,
+                                              bool xHasWildcard,
+                                              uint32_t ulMatches);
+
+/**
+ * @brief Collect the subscriptions matching the publish to xSubscriptionMatches.
+ */
+static uint32_t prvCollectSubscriptions (MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Register a topic filter callback, see xAddMQTTTopicFilterCallback().
+ */
+static BaseType_t prvAddTopicFilterCallback (const char *pcTopicFilter,
+                                             uint16_t usTopicFilterLength,
+                                             IncomingPubCallback_t pxCallback,
+                                             void *pvCallbackContext,
+                                             BaseType_t xManageResubscription,
+                                             bool xDeferred);
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+/**
+ * @brief Copy a publish for a deferred subscription and queue it to the dispatch task.
+ */
+static void prvDeferPublish (const SubscriptionMatch_t *pxMatch,
+                             const MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Task running the callbacks of deferred subscriptions.
+ */
+static void prvDispatchTask (void *pvParameters);
+#endif
+
 static void prvSetMQTTAgentState (MQTTAgentState_t xAgentState);
 
 /**
@@ -372,6 +563,16 @@ static uint32_t prvGetTimeMs (void);
  */
 static MQTTConnectionStatus_t prvConnectToMQTTBroker (bool xIsReconnect);
 
+/**
+ * @brief Cache the TLS session stored in littlefs by prvStoreTLSSession().
+ */
+static void prvLoadTLSSession (void);
+
+/**
+ * @brief Store the TLS session in littlefs after a full handshake.
+ */
+static void prvStoreTLSSession (void);
+
 /**
  * @brief Get the string value for a key from the KV store.
  * Memory allocated for the string should be freed by calling vPortFree.
@@ -411,6 +612,37 @@ static MQTTAgentMessageContext_t xCommandQueue;
 
 static TopicFilterSubscription_t xTopicFilterSubscriptions[MQTT_AGENT_MAX_SUBSCRIPTIONS];
 
+/* First subscription of each bucket, mqttexampleSUBSCRIPTION_NONE if the bucket is empty. */
+static uint16_t usSubscriptionBuckets[MQTT_AGENT_SUBSCRIPTION_BUCKETS];
+
+/* Incremented by every change of the subscription store. The MQTT agent reads the store without
+ * xSubscriptionsMutex and repeats the read if the sequence changed meanwhile. Changes are made in
+ * a critical section, so a read never sees a half-made change of a single entry. */
+static volatile uint32_t ulSubscriptionSequence = 0U;
+
+/* Subscriptions matching the publish being dispatched. Only used by the MQTT agent task. */
+static SubscriptionMatch_t xSubscriptionMatches[MQTT_AGENT_MAX_SUBSCRIPTIONS];
+
+/* Callbacks being run, changed in a critical section. */
+static volatile CallbackRun_t xCallbackRuns[mqttexampleCALLBACK_RUNS];
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+static DeferredPublish_t xDeferredPublishes[MQTT_AGENT_DISPATCH_QUEUE_LENGTH];
+
+/* Free dispatch buffers, and buffers waiting for the dispatch task. */
+static QueueHandle_t xDispatchFreeQueue;
+static QueueHandle_t xDispatchQueue;
+#endif
+
+static MQTTAgentDispatchStats_t xDispatchStats;
+
+#if (mqttexampleTLS_SESSION_STORE_ENABLE == 1)
+static unsigned char ucTLSSessionBuffer[mqttexampleTLS_SESSION_MAX_SIZE];
+
+/* Full handshakes of the TLS transport when the session was last stored. */
+static uint32_t ulStoredFullHandshakes = 0U;
+#endif
+
 static SemaphoreHandle_t xSubscriptionsMutex;
 
 /**
@@ -464,7 +696,7 @@ static MQTTStatus_t prvMQTTInit(void)
     xTransport.pNetworkContext = &xNetworkContext;
     xTransport.send = TLS_FreeRTOS_send;
     xTransport.recv = TLS_FreeRTOS_recv;
-    xTransport.writev = NULL;
+    xTransport.writev = TLS_FreeRTOS_writev;
 
     /* Initialize MQTT library. */
     xReturn = MQTTAgent_Init(&xGlobalMqttAgentContext,
@@ -623,6 +855,7 @@ static BaseType_t prvCreateTLSConnection(NetworkContext_t *pxNetworkContext)
     xNetworkCredentials.pPrivateKeyLabel = pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS;
 
     xNetworkCredentials.disableSni = democonfigDISABLE_SNI;
+    xNetworkCredentials.maxFragmentLength = democonfigTLS_MAX_FRAGMENT_LENGTH;
     BackoffAlgorithm_InitializeParams(&xReconnectParams,
                                       RETRY_BACKOFF_BASE_MS,
                                       RETRY_MAX_BACKOFF_DELAY_MS,
@@ -893,6 +1126,15 @@ void vStartMQTTAgent(configSTACK_DEPTH_TYPE uxStackSize,
                 NULL,
                 uxPriority,
                 NULL);
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+    xTaskCreate(prvDispatchTask,
+                "MQTTDisp",
+                MQTT_AGENT_DISPATCH_TASK_STACK_SIZE,
+                NULL,
+                MQTT_AGENT_DISPATCH_TASK_PRIORITY,
+                NULL);
+#endif
 }
 /**********************************************************************************************************************
  End of function vStartMQTTAgent
@@ -970,6 +1212,7 @@ void prvMQTTAgentTask(void *pvParameters)
 
     if (MQTTSuccess == xMQTTStatus)
     {
+        prvLoadTLSSession();
         pMqttContext->connectStatus = prvConnectToMQTTBroker(false);
 
         while (MQTTConnected == pMqttContext->connectStatus)
@@ -1102,6 +1345,7 @@ static MQTTConnectionStatus_t prvConnectToMQTTBroker(bool xIsReconnect)
             {
                 LogInfo(("Successfully connected to MQTT broker."));
                 xConnectionStatus = MQTTConnected;
+                prvStoreTLSSession();
             }
         }
 
@@ -1135,6 +1379,107 @@ static MQTTConnectionStatus_t prvConnectToMQTTBroker(bool xIsReconnect)
  *********************************************************************************************************************/
 /*-----------------------------------------------------------*/
 
+/**********************************************************************************************************************
+ * Function Name: prvLoadTLSSession
+ * Description  : Read the TLS session stored by prvStoreTLSSession() and hand
+ *                it to the TLS transport, so the first connection can resume it.
+ *                The file is removed, a stored session serves a single reset.
+ * Arguments    : None.
+ * Return Value : None.
+ *********************************************************************************************************************/
+static void prvLoadTLSSession(void)
+{
+#if (mqttexampleTLS_SESSION_STORE_ENABLE == 1)
+    lfs_file_t xFile;
+    lfs_ssize_t xLength;
+
+    littlFs_lock();
+    xLength = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile, TLS_TRANSPORT_SESSION_FILE_NAME, LFS_O_RDONLY);
+
+    if (LFS_ERR_OK == xLength)
+    {
+        xLength = lfs_file_read(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile, ucTLSSessionBuffer, sizeof(ucTLSSessionBuffer));
+        (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile);
+        (void)lfs_remove(&RM_STDIO_LITTLEFS_CFG_LFS, TLS_TRANSPORT_SESSION_FILE_NAME);
+        littlFs_unlock();
+
+        if ((xLength <= 0) ||
+            (TLS_TRANSPORT_SUCCESS != TLS_FreeRTOS_LoadSession(ucTLSSessionBuffer, (size_t)xLength)))
+        {
+            LogWarn(("Stored TLS session is not usable."));
+        }
+
+        (void)memset(ucTLSSessionBuffer, 0, sizeof(ucTLSSessionBuffer));
+    }
+    else
+    {
+        littlFs_unlock();
+    }
+#endif
+}
+/**********************************************************************************************************************
+ End of function prvLoadTLSSession
+ *********************************************************************************************************************/
+/*-----------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvStoreTLSSession
+ * Description  : Store the TLS session in littlefs. Only sessions created by
+ *                a full handshake are stored, so resumed reconnects of a
+ *                flapping link do not wear the flash.
+ * Arguments    : None.
+ * Return Value : None.
+ *********************************************************************************************************************/
+static void prvStoreTLSSession(void)
+{
+    TlsTransportStats_t xStats;
+#if (mqttexampleTLS_SESSION_STORE_ENABLE == 1)
+    lfs_file_t xFile;
+    lfs_ssize_t xLfsErr;
+    size_t xLength = 0U;
+#endif
+
+    TLS_FreeRTOS_GetStats(&xStats);
+
+    LogInfo(("TLS handshakes: %u full, %u resumed, %u failed. Last handshake %u ms, %u bytes.",
+             (unsigned int)xStats.fullHandshakes,
+             (unsigned int)xStats.resumedHandshakes,
+             (unsigned int)xStats.failedHandshakes,
+             (unsigned int)xStats.lastHandshakeMs,
+             (unsigned int)(xStats.lastHandshakeBytesSent + xStats.lastHandshakeBytesReceived)));
+
+#if (mqttexampleTLS_SESSION_STORE_ENABLE == 1)
+    if ((xStats.fullHandshakes != ulStoredFullHandshakes) &&
+        (TLS_TRANSPORT_SUCCESS == TLS_FreeRTOS_SaveSession(ucTLSSessionBuffer, sizeof(ucTLSSessionBuffer), &xLength)))
+    {
+        ulStoredFullHandshakes = xStats.fullHandshakes;
+
+        /* littlefs commits the file on close, so a reset leaves either the old or the new session. */
+        littlFs_lock();
+        xLfsErr = lfs_file_open(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile, TLS_TRANSPORT_SESSION_FILE_NAME,
+                                LFS_O_WRONLY | LFS_O_TRUNC | LFS_O_CREAT);
+
+        if (LFS_ERR_OK == xLfsErr)
+        {
+            xLfsErr = lfs_file_write(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile, ucTLSSessionBuffer, xLength);
+            (void)lfs_file_close(&RM_STDIO_LITTLEFS_CFG_LFS, &xFile);
+        }
+        littlFs_unlock();
+
+        if (xLfsErr < 0)
+        {
+            LogWarn(("Failed to store the TLS session, error = %d", (int)xLfsErr));
+        }
+
+        (void)memset(ucTLSSessionBuffer, 0, sizeof(ucTLSSessionBuffer));
+    }
+#endif
+}
+/**********************************************************************************************************************
+ End of function prvStoreTLSSession
+ *********************************************************************************************************************/
+/*-----------------------------------------------------------*/
+
 /**********************************************************************************************************************
  * Function Name: prvGetTimeMs
  * Description  : Return the elapsed time in milliseconds since the global
@@ -1165,48 +1510,405 @@ static uint32_t prvGetTimeMs(void)
  *********************************************************************************************************************/
 /*-----------------------------------------------------------*/
 
+/**********************************************************************************************************************
+ * Function Name: prvSubscriptionHash
+ * Description  : Continue the FNV-1a hash of the subscription index over more
+ *                characters.
+ * Arguments    : uint32_t ulHash - hash of the preceding characters.
+ *                const char * pcText - next characters.
+ *                size_t xLength - number of characters.
+ * Return Value : uint32_t - hash including the characters.
+ *********************************************************************************************************************/
+static uint32_t prvSubscriptionHash(uint32_t ulHash, const char *pcText, size_t xLength)
+{
+    size_t xIndex;
+
+    for (xIndex = 0U; xIndex < xLength; xIndex++)
+    {
+        ulHash ^= (uint8_t)pcText[xIndex];
+        ulHash *= mqttexampleFNV_PRIME;
+    }
+
+    return ulHash;
+}
+/**********************************************************************************************************************
+ End of function prvSubscriptionHash
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: prvSubscriptionKeyLength
+ * Description  : Find the index key of a topic filter. A filter without
+ *                wildcards is its own key. A filter with wildcards is keyed
+ *                by the levels before its first wildcard level, including
+ *                the trailing '/', e.g. "a/b/" for "a/b/+/c".
+ * Arguments    : const char * pcTopicFilter - topic filter.
+ *                uint16_t usTopicFilterLength - length of the topic filter.
+ *                bool * pxHasWildcard - set if the filter has a wildcard.
+ * Return Value : uint16_t - length of the key.
+ *********************************************************************************************************************/
+static uint16_t prvSubscriptionKeyLength(const char *pcTopicFilter, uint16_t usTopicFilterLength, bool *pxHasWildcard)
+{
+    uint16_t usLevelStart = 0U;
+    uint16_t usIndex;
+
+    for (usIndex = 0U; usIndex < usTopicFilterLength; usIndex++)
+    {
+        if (('+' == pcTopicFilter[usIndex]) || ('#' == pcTopicFilter[usIndex]))
+        {
+            *pxHasWildcard = true;
+            return usLevelStart;
+        }
+
+        if ('/' == pcTopicFilter[usIndex])
+        {
+            usLevelStart = usIndex + 1U;
+        }
+    }
+
+    *pxHasWildcard = false;
+    return usTopicFilterLength;
+}
+/**********************************************************************************************************************
+ End of function prvSubscriptionKeyLength
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: prvCollectSubscriptionBucket
+ * Description  : Append the subscriptions in one bucket whose key is the
+ *                given prefix of the incoming topic and which match the
+ *                publish. A filter without wildcards must equal the topic,
+ *                a filter with wildcards is checked with MQTT_MatchTopic().
+ *                The store may change during the walk, see
+ *                prvCollectSubscriptions(), so every value is read once and
+ *                the walk is bounded.
+ * Arguments    : MQTTPublishInfo_t * pxPublishInfo - incoming publish info.
+ *                uint32_t ulKeyHash - hash of the topic prefix.
+ *                uint16_t usKeyLength - length of the topic prefix.
+ *                bool xHasWildcard - visit the filters with or without wildcards.
+ *                uint32_t ulMatches - number of subscriptions already collected.
+ * Return Value : uint32_t - number of subscriptions collected.
+ *********************************************************************************************************************/
+static uint32_t prvCollectSubscriptionBucket(MQTTPublishInfo_t *pxPublishInfo,
+                                             uint32_t ulKeyHash,
+                                             uint16_t usKeyLength,
+                                             bool xHasWildcard,
+                                             uint32_t ulMatches)
+{
+    /* The store is read through volatile pointers, so that neither CC-RX nor GCC moves these reads
+     * across the reads of ulSubscriptionSequence in prvCollectSubscriptions(). */
+    const volatile uint16_t *pusBuckets = usSubscriptionBuckets;
+    const volatile TopicFilterSubscription_t *pxSubscription;
+    const char *pcTopicFilter;
+    uint16_t usIndex = pusBuckets[ulKeyHash & (MQTT_AGENT_SUBSCRIPTION_BUCKETS - 1U)];
+    uint32_t ulSteps;
+    bool isMatched;
+
+    for (ulSteps = 0U;
+         (mqttexampleSUBSCRIPTION_NONE != usIndex) && (usIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS) &&
+         (ulSteps < MQTT_AGENT_MAX_SUBSCRIPTIONS) && (ulMatches < MQTT_AGENT_MAX_SUBSCRIPTIONS);
+         ulSteps++)
+    {
+        pxSubscription = &xTopicFilterSubscriptions[usIndex];
+        pcTopicFilter = pxSubscription->pcTopicFilter;
+
+        if ((NULL == pcTopicFilter) ||
+            (pxSubscription->ulKeyHash != ulKeyHash) ||
+            (pxSubscription->usKeyLength != usKeyLength) ||
+            (pxSubscription->xHasWildcard != xHasWildcard))
+        {
+            usIndex = pxSubscription->usNextInBucket;
+            continue;
+        }
+
+        if (false == xHasWildcard)
+        {
+            isMatched = (0 == memcmp(pcTopicFilter, pxPublishInfo->pTopicName, usKeyLength));
+        }
+        else
+        {
+            isMatched = false;
+            MQTT_MatchTopic(pxPublishInfo->pTopicName,
+                            pxPublishInfo->topicNameLength,
+                            pcTopicFilter,
+                            pxSubscription->usTopicFilterLength,
+                            &isMatched);
+        }
+
+        if (true == isMatched)
+        {
+            xSubscriptionMatches[ulMatches].pxIncomingPublishCallback = pxSubscription->pxIncomingPublishCallback;
+            xSubscriptionMatches[ulMatches].pvIncomingPublishCallbackContext = pxSubscription->pvIncomingPublishCallbackContext;
+            xSubscriptionMatches[ulMatches].usIndex = usIndex;
+            xSubscriptionMatches[ulMatches].xDeferred = pxSubscription->xDeferred;
+            ulMatches++;
+        }
+
+        usIndex = pxSubscription->usNextInBucket;
+    }
+
+    return ulMatches;
+}
+/**********************************************************************************************************************
+ End of function prvCollectSubscriptionBucket
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: prvCollectSubscriptions
+ * Description  : Collect the subscriptions matching an incoming publish.
+ *                Only the buckets of the topic and of its level prefixes
+ *                are visited. The store is read without xSubscriptionsMutex
+ *                and the read is repeated if it changed meanwhile. After
+ *                mqttexampleSUBSCRIPTION_READ_RETRIES attempts, the store is
+ *                read under the mutex, which also lets a lower priority
+ *                writer finish.
+ * Arguments    : MQTTPublishInfo_t * pxPublishInfo - incoming publish info.
+ * Return Value : uint32_t - number of subscriptions in xSubscriptionMatches.
+ *********************************************************************************************************************/
+static uint32_t prvCollectSubscriptions(MQTTPublishInfo_t *pxPublishInfo)
+{
+    const char *pcTopic = pxPublishInfo->pTopicName;
+    uint16_t usTopicLength = pxPublishInfo->topicNameLength;
+    uint32_t ulHash;
+    uint32_t ulSequence;
+    uint32_t ulMatches = 0U;
+    uint32_t ulAttempt;
+    uint16_t usIndex;
+    bool xLocked = false;
+
+    for (ulAttempt = 0U; ulAttempt <= mqttexampleSUBSCRIPTION_READ_RETRIES; ulAttempt++)
+    {
+        if (mqttexampleSUBSCRIPTION_READ_RETRIES == ulAttempt)
+        {
+            xSemaphoreTake(xSubscriptionsMutex, portMAX_DELAY);
+            xLocked = true;
+        }
+
+        ulSequence = ulSubscriptionSequence;
+
+        ulHash = mqttexampleFNV_OFFSET_BASIS;
+        ulMatches = 0U;
+
+        /* Filters starting with a wildcard level, e.g. "#" or "+/status". */
+        ulMatches = prvCollectSubscriptionBucket(pxPublishInfo, ulHash, 0U, true, ulMatches);
+
+        /* Filters whose wildcard follows one of the levels of the topic. */
+        for (usIndex = 0U; usIndex < usTopicLength; usIndex++)
+        {
+            ulHash = prvSubscriptionHash(ulHash, &pcTopic[usIndex], 1U);
+
+            if ('/' == pcTopic[usIndex])
+            {
+                ulMatches = prvCollectSubscriptionBucket(pxPublishInfo, ulHash, usIndex + 1U, true, ulMatches);
+            }
+        }
+
+        /* Filters equal to the topic. */
+        ulMatches = prvCollectSubscriptionBucket(pxPublishInfo, ulHash, usTopicLength, false, ulMatches);
+
+        /* "a/b/#" also matches its parent level "a/b". */
+        ulHash = prvSubscriptionHash(ulHash, "/", 1U);
+        ulMatches = prvCollectSubscriptionBucket(pxPublishInfo, ulHash, usTopicLength + 1U, true, ulMatches);
+
+        if (xLocked || (ulSequence == ulSubscriptionSequence))
+        {
+            break;
+        }
+    }
+
+    if (xLocked)
+    {
+        xSemaphoreGive(xSubscriptionsMutex);
+    }
+
+    return ulMatches;
+}
+/**********************************************************************************************************************
+ End of function prvCollectSubscriptions
+ *********************************************************************************************************************/
+
 /**********************************************************************************************************************
  * Function Name: prvMatchTopicFilterSubscriptions
  * Description  : Match an incoming publish against the locally registered
  *                topic filter subscriptions and invoke their callbacks.
+ *                Callbacks run without xSubscriptionsMutex held, see
+ *                prvRunSubscriptionCallback(). Callbacks of deferred
+ *                subscriptions are queued to the dispatch task.
  * Arguments    : MQTTPublishInfo_t * pxPublishInfo - incoming publish info.
  * Return Value : bool - true if any subscription handled the publish,
  *                otherwise false.
  *********************************************************************************************************************/
 static bool prvMatchTopicFilterSubscriptions(MQTTPublishInfo_t *pxPublishInfo)
 {
-    uint32_t ulIndex = 0;
-    bool isMatched = false;
-    bool publishHandled = false;
+    uint32_t ulMatches = prvCollectSubscriptions(pxPublishInfo);
+    uint32_t ulIndex;
 
-    xSemaphoreTake(xSubscriptionsMutex, portMAX_DELAY);
+    for (ulIndex = 0U; ulIndex < ulMatches; ulIndex++)
     {
-        for (ulIndex = 0U; ulIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS; ulIndex++)
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+        if (true == xSubscriptionMatches[ulIndex].xDeferred)
         {
-            if (xTopicFilterSubscriptions[ulIndex].usTopicFilterLength > 0)
-            {
-                MQTT_MatchTopic(pxPublishInfo->pTopicName,
-                                pxPublishInfo->topicNameLength,
-                                xTopicFilterSubscriptions[ulIndex].pcTopicFilter,
-                                xTopicFilterSubscriptions[ulIndex].usTopicFilterLength,
-                                &isMatched);
-
-                if (true == isMatched)
-                {
-                    xTopicFilterSubscriptions[ulIndex].pxIncomingPublishCallback(xTopicFilterSubscriptions[ulIndex].pvIncomingPublishCallbackContext,
-                                                                                 pxPublishInfo);
-                    publishHandled = true;
-                }
-            }
+            prvDeferPublish(&xSubscriptionMatches[ulIndex], pxPublishInfo);
+            continue;
         }
+#endif
+        prvRunSubscriptionCallback(mqttexampleCALLBACK_RUN_AGENT, &xSubscriptionMatches[ulIndex], pxPublishInfo);
     }
-    xSemaphoreGive(xSubscriptionsMutex);
-    return publishHandled;
+
+    return (ulMatches > 0U);
 }
 /**********************************************************************************************************************
  End of function prvMatchTopicFilterSubscriptions
  *********************************************************************************************************************/
 
+/**********************************************************************************************************************
+ * Function Name: prvRunSubscriptionCallback
+ * Description  : Run the callback of a matched subscription. The check that
+ *                the subscription is still registered and the record of the
+ *                running callback are made in one critical section, so
+ *                vRemoveMQTTTopicFilterCallback() either prevents the call or
+ *                waits for the callback to return.
+ * Arguments    : uint32_t ulRun - mqttexampleCALLBACK_RUN_AGENT or
+ *                mqttexampleCALLBACK_RUN_DISPATCH.
+ *                const SubscriptionMatch_t * pxMatch - matched subscription.
+ *                MQTTPublishInfo_t * pxPublishInfo - publish passed to the callback.
+ * Return Value : void
+ *********************************************************************************************************************/
+static void prvRunSubscriptionCallback(uint32_t ulRun,
+                                       const SubscriptionMatch_t *pxMatch,
+                                       MQTTPublishInfo_t *pxPublishInfo)
+{
+    const TopicFilterSubscription_t *pxSubscription = &xTopicFilterSubscriptions[pxMatch->usIndex];
+    bool xSubscribed;
+
+    taskENTER_CRITICAL();
+    {
+        xSubscribed = ((NULL != pxSubscription->pcTopicFilter) &&
+                       (pxSubscription->pxIncomingPublishCallback == pxMatch->pxIncomingPublishCallback) &&
+                       (pxSubscription->pvIncomingPublishCallbackContext == pxMatch->pvIncomingPublishCallbackContext));
+
+        if (true == xSubscribed)
+        {
+            xCallbackRuns[ulRun].xTask = xTaskGetCurrentTaskHandle();
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (true == xSubscribed)
+    {
+        pxMatch->pxIncomingPublishCallback(pxMatch->pvIncomingPublishCallbackContext, pxPublishInfo);
+
+        taskENTER_CRITICAL();
+        {
+            xCallbackRuns[ulRun].xTask = NULL;
+            xCallbackRuns[ulRun].ulReturned++;
+        }
+        taskEXIT_CRITICAL();
+    }
+}
+/**********************************************************************************************************************
+ End of function prvRunSubscriptionCallback
+ *********************************************************************************************************************/
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+/**********************************************************************************************************************
+ * Function Name: prvDeferPublish
+ * Description  : Copy a publish for a deferred subscription into a free
+ *                dispatch buffer and queue it to the dispatch task. The
+ *                publish is dropped if it does not fit a buffer or if no
+ *                buffer becomes free within MQTT_AGENT_DISPATCH_BLOCK_TIME_MS.
+ * Arguments    : const SubscriptionMatch_t * pxMatch - matching subscription.
+ *                const MQTTPublishInfo_t * pxPublishInfo - incoming publish info.
+ * Return Value : void
+ *********************************************************************************************************************/
+static void prvDeferPublish(const SubscriptionMatch_t *pxMatch,
+                            const MQTTPublishInfo_t *pxPublishInfo)
+{
+    DeferredPublish_t *pxDeferred = NULL;
+    UBaseType_t uxInUse;
+
+    if (((size_t)pxPublishInfo->topicNameLength + pxPublishInfo->payloadLength) > MQTT_AGENT_DISPATCH_BUFFER_SIZE)
+    {
+        xDispatchStats.ulOversized++;
+        LogWarn(("Publish on %.*s does not fit a dispatch buffer and is dropped.",
+                 pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName));
+        return;
+    }
+
+    if (pdPASS != xQueueReceive(xDispatchFreeQueue, &pxDeferred, pdMS_TO_TICKS(MQTT_AGENT_DISPATCH_BLOCK_TIME_MS)))
+    {
+        xDispatchStats.ulDropped++;
+        LogWarn(("Dispatch queue is full, publish on %.*s is dropped.",
+                 pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName));
+        return;
+    }
+
+    pxDeferred->xMatch = *pxMatch;
+    pxDeferred->xPublishInfo = *pxPublishInfo;
+    memcpy(pxDeferred->ucBuffer, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+    memcpy(&pxDeferred->ucBuffer[pxPublishInfo->topicNameLength], pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
+    pxDeferred->xPublishInfo.pTopicName = (const char *)pxDeferred->ucBuffer;
+    pxDeferred->xPublishInfo.pPayload = &pxDeferred->ucBuffer[pxPublishInfo->topicNameLength];
+
+    uxInUse = MQTT_AGENT_DISPATCH_QUEUE_LENGTH - uxQueueMessagesWaiting(xDispatchFreeQueue);
+    if (uxInUse > xDispatchStats.uxHighWaterMark)
+    {
+        xDispatchStats.uxHighWaterMark = uxInUse;
+    }
+    xDispatchStats.ulDeferred++;
+
+    /* The queue holds every buffer, so it cannot be full. */
+    (void)xQueueSend(xDispatchQueue, &pxDeferred, 0U);
+}
+/**********************************************************************************************************************
+ End of function prvDeferPublish
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: prvDispatchTask
+ * Description  : Run the callbacks of queued publishes for deferred
+ *                subscriptions. A publish whose subscription was removed
+ *                after it was queued is discarded.
+ * Arguments    : void * pvParameters - unused.
+ * Return Value : void
+ *********************************************************************************************************************/
+static void prvDispatchTask(void *pvParameters)
+{
+    DeferredPublish_t *pxDeferred;
+
+    (void)pvParameters;
+
+    for (;;)
+    {
+        (void)xQueueReceive(xDispatchQueue, &pxDeferred, portMAX_DELAY);
+
+        prvRunSubscriptionCallback(mqttexampleCALLBACK_RUN_DISPATCH, &pxDeferred->xMatch, &pxDeferred->xPublishInfo);
+
+        (void)xQueueSend(xDispatchFreeQueue, &pxDeferred, 0U);
+    }
+}
+/**********************************************************************************************************************
+ End of function prvDispatchTask
+ *********************************************************************************************************************/
+#endif /* (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0) */
+
+/**********************************************************************************************************************
+ * Function Name: vGetMQTTAgentDispatchStats
+ * Description  : Copy the dispatch counters.
+ * Arguments    : MQTTAgentDispatchStats_t * pxStats - destination.
+ * Return Value : void
+ *********************************************************************************************************************/
+void vGetMQTTAgentDispatchStats(MQTTAgentDispatchStats_t *pxStats)
+{
+    taskENTER_CRITICAL();
+    {
+        *pxStats = xDispatchStats;
+    }
+    taskEXIT_CRITICAL();
+}
+/**********************************************************************************************************************
+ End of function vGetMQTTAgentDispatchStats
+ *********************************************************************************************************************/
+
 /*-----------------------------------------------------------*/
 
 /**********************************************************************************************************************
@@ -1243,6 +1945,9 @@ BaseType_t xMQTTAgentInit(void)
     {
         xSubscriptionsMutex = xSemaphoreCreateMutex();
 
+        /* All bytes 0xFF makes every bucket mqttexampleSUBSCRIPTION_NONE. */
+        memset(usSubscriptionBuckets, 0xFF, sizeof(usSubscriptionBuckets));
+
         if (NULL != xSubscriptionsMutex)
         {
             xResult = pdPASS;
@@ -1257,6 +1962,28 @@ BaseType_t xMQTTAgentInit(void)
                 xResult = pdFAIL;
             }
         }
+
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+        if (pdPASS == xResult)
+        {
+            xDispatchFreeQueue = xQueueCreate(MQTT_AGENT_DISPATCH_QUEUE_LENGTH, sizeof(DeferredPublish_t *));
+            xDispatchQueue = xQueueCreate(MQTT_AGENT_DISPATCH_QUEUE_LENGTH, sizeof(DeferredPublish_t *));
+
+            if ((NULL == xDispatchFreeQueue) || (NULL == xDispatchQueue))
+            {
+                xResult = pdFAIL;
+            }
+            else
+            {
+                for (uint32_t ulIndex = 0U; ulIndex < MQTT_AGENT_DISPATCH_QUEUE_LENGTH; ulIndex++)
+                {
+                    DeferredPublish_t *pxDeferred = &xDeferredPublishes[ulIndex];
+
+                    (void)xQueueSend(xDispatchFreeQueue, &pxDeferred, 0U);
+                }
+            }
+        }
+#endif
     }
 
     return xResult;
@@ -1349,49 +2076,133 @@ BaseType_t xAddMQTTTopicFilterCallback(const char *pcTopicFilter,
                                        IncomingPubCallback_t pxCallback,
                                        void *pvCallbackContext,
                                        BaseType_t xManageResubscription)
+{
+    return prvAddTopicFilterCallback(pcTopicFilter, usTopicFilterLength, pxCallback,
+                                     pvCallbackContext, xManageResubscription, false);
+}
+/**********************************************************************************************************************
+ End of function xAddMQTTTopicFilterCallback
+ *********************************************************************************************************************/
+/*-----------------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: xAddMQTTTopicFilterDeferredCallback
+ * Description  : Register a local subscription callback for a topic filter
+ *                whose callback runs on the dispatch task with a copy of the
+ *                publish, see MQTT_AGENT_DISPATCH_QUEUE_LENGTH.
+ * Arguments    : As xAddMQTTTopicFilterCallback().
+ * Return Value : BaseType_t - pdPASS on success, pdFAIL on failure or if
+ *                deferred dispatch is disabled.
+ *********************************************************************************************************************/
+BaseType_t xAddMQTTTopicFilterDeferredCallback(const char *pcTopicFilter,
+                                               uint16_t usTopicFilterLength,
+                                               IncomingPubCallback_t pxCallback,
+                                               void *pvCallbackContext,
+                                               BaseType_t xManageResubscription)
+{
+#if (MQTT_AGENT_DISPATCH_QUEUE_LENGTH > 0)
+    return prvAddTopicFilterCallback(pcTopicFilter, usTopicFilterLength, pxCallback,
+                                     pvCallbackContext, xManageResubscription, true);
+#else
+    (void)pcTopicFilter;
+    (void)usTopicFilterLength;
+    (void)pxCallback;
+    (void)pvCallbackContext;
+    (void)xManageResubscription;
+
+    return pdFAIL;
+#endif
+}
+/**********************************************************************************************************************
+ End of function xAddMQTTTopicFilterDeferredCallback
+ *********************************************************************************************************************/
+/*-----------------------------------------------------------------*/
+
+/**********************************************************************************************************************
+ * Function Name: prvAddTopicFilterCallback
+ * Description  : Register a topic filter callback in the subscription
+ *                store. Entries are changed in a critical section and
+ *                ulSubscriptionSequence is incremented, so a lock-free
+ *                reader notices the change.
+ * Arguments    : As xAddMQTTTopicFilterCallback().
+ *                bool xDeferred - run the callback on the dispatch task.
+ * Return Value : BaseType_t - pdPASS on success, pdFAIL on failure.
+ *********************************************************************************************************************/
+static BaseType_t prvAddTopicFilterCallback(const char *pcTopicFilter,
+                                            uint16_t usTopicFilterLength,
+                                            IncomingPubCallback_t pxCallback,
+                                            void *pvCallbackContext,
+                                            BaseType_t xManageResubscription,
+                                            bool xDeferred)
 {
     BaseType_t xResult = pdFAIL;
     uint32_t ulIndex = 0U;
     uint32_t ulAvailableIndex = MQTT_AGENT_MAX_SUBSCRIPTIONS;
+    uint32_t ulKeyHash;
+    uint16_t usKeyLength;
+    uint16_t usBucket;
+    bool xHasWildcard;
+    TopicFilterSubscription_t *pxSubscription;
+
+    usKeyLength = prvSubscriptionKeyLength(pcTopicFilter, usTopicFilterLength, &xHasWildcard);
+    ulKeyHash = prvSubscriptionHash(mqttexampleFNV_OFFSET_BASIS, pcTopicFilter, usKeyLength);
+    usBucket = (uint16_t)(ulKeyHash & (MQTT_AGENT_SUBSCRIPTION_BUCKETS - 1U));
 
     xSemaphoreTake(xSubscriptionsMutex, portMAX_DELAY);
     {
         /**
-         * If this is a duplicate subscription for same topic filter do nothing and return a failure.
-         * Else insert at the first available index;
+         * If this is a duplicate subscription for same topic filter and callback do nothing.
+         * Duplicates share the bucket of the filter, so only that bucket is searched.
          */
-        for (ulIndex = 0U; ulIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS; ulIndex++)
+        for (ulIndex = usSubscriptionBuckets[usBucket]; mqttexampleSUBSCRIPTION_NONE != ulIndex;
+             ulIndex = xTopicFilterSubscriptions[ulIndex].usNextInBucket)
         {
-            if ((NULL == xTopicFilterSubscriptions[ulIndex].pcTopicFilter) &&
-                (MQTT_AGENT_MAX_SUBSCRIPTIONS == ulAvailableIndex))
+            pxSubscription = &xTopicFilterSubscriptions[ulIndex];
+
+            if ((pxSubscription->usTopicFilterLength == usTopicFilterLength) &&
+                (strncmp(pcTopicFilter, pxSubscription->pcTopicFilter, (size_t)usTopicFilterLength) == 0) &&
+                (pxSubscription->pxIncomingPublishCallback == pxCallback) &&
+                (pxSubscription->pvIncomingPublishCallbackContext == pvCallbackContext))
             {
-                ulAvailableIndex = ulIndex;
+                xResult = pdPASS;
+                break;
             }
-            else if ((xTopicFilterSubscriptions[ulIndex].usTopicFilterLength == usTopicFilterLength) &&
-                     (strncmp(pcTopicFilter, xTopicFilterSubscriptions[ulIndex].pcTopicFilter, (size_t)usTopicFilterLength) == 0))
+        }
+
+        /* Else insert at the first available index. */
+        if (pdPASS != xResult)
+        {
+            for (ulIndex = 0U; ulIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS; ulIndex++)
             {
-                /* If a subscription already exists, don't do anything. */
-                if ((xTopicFilterSubscriptions[ulIndex].pxIncomingPublishCallback == pxCallback) &&
-                    (xTopicFilterSubscriptions[ulIndex].pvIncomingPublishCallbackContext == pvCallbackContext))
+                if (NULL == xTopicFilterSubscriptions[ulIndex].pcTopicFilter)
                 {
-                    ulAvailableIndex = MQTT_AGENT_MAX_SUBSCRIPTIONS;
-                    xResult = pdPASS;
+                    ulAvailableIndex = ulIndex;
                     break;
                 }
             }
-            else
-            {
-                ;
-            }
         }
 
         if (ulAvailableIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS)
         {
-            xTopicFilterSubscriptions[ulAvailableIndex].pcTopicFilter = pcTopicFilter;
-            xTopicFilterSubscriptions[ulAvailableIndex].usTopicFilterLength = usTopicFilterLength;
-            xTopicFilterSubscriptions[ulAvailableIndex].pxIncomingPublishCallback = pxCallback;
-            xTopicFilterSubscriptions[ulAvailableIndex].pvIncomingPublishCallbackContext = pvCallbackContext;
-            xTopicFilterSubscriptions[ulAvailableIndex].xManageResubscription = xManageResubscription;
+            pxSubscription = &xTopicFilterSubscriptions[ulAvailableIndex];
+
+            taskENTER_CRITICAL();
+            {
+                pxSubscription->pcTopicFilter = pcTopicFilter;
+                pxSubscription->usTopicFilterLength = usTopicFilterLength;
+                pxSubscription->pxIncomingPublishCallback = pxCallback;
+                pxSubscription->pvIncomingPublishCallbackContext = pvCallbackContext;
+                pxSubscription->xManageResubscription = xManageResubscription;
+                pxSubscription->ulKeyHash = ulKeyHash;
+                pxSubscription->usKeyLength = usKeyLength;
+                pxSubscription->xHasWildcard = xHasWildcard;
+                pxSubscription->xDeferred = xDeferred;
+                pxSubscription->usNextInBucket = usSubscriptionBuckets[usBucket];
+                usSubscriptionBuckets[usBucket] = (uint16_t)ulAvailableIndex;
+                ulSubscriptionSequence++;
+            }
+            taskEXIT_CRITICAL();
+
             xResult = pdPASS;
         }
     }
@@ -1400,14 +2211,18 @@ BaseType_t xAddMQTTTopicFilterCallback(const char *pcTopicFilter,
     return xResult;
 }
 /**********************************************************************************************************************
- End of function xAddMQTTTopicFilterCallback
+ End of function prvAddTopicFilterCallback
  *********************************************************************************************************************/
 /*-----------------------------------------------------------------*/
 
 /**********************************************************************************************************************
  * Function Name: vRemoveMQTTTopicFilterCallback
  * Description  : Remove a previously registered topic filter callback from
- *                the local subscription table. Thread-safe.
+ *                the local subscription table. Thread-safe. Waits for the
+ *                callbacks running on other tasks to return, so the context
+ *                of the removed callback may be freed afterwards. Called from
+ *                a subscription callback, it does not wait, as two callbacks
+ *                waiting for each other would never return.
  * Arguments    : const char * pcTopicFilter - topic filter string to remove.
  *                uint16_t usTopicFilterLength - length of the topic filter.
  * Return Value : void
@@ -1415,22 +2230,69 @@ BaseType_t xAddMQTTTopicFilterCallback(const char *pcTopicFilter,
 void vRemoveMQTTTopicFilterCallback(const char *pcTopicFilter,
                                     uint16_t usTopicFilterLength)
 {
-    uint32_t ulIndex;
+    uint16_t *pusLink;
+    uint16_t usIndex;
+    uint32_t ulKeyHash;
+    uint16_t usKeyLength;
+    bool xHasWildcard;
+    TaskHandle_t xCurrentTask = xTaskGetCurrentTaskHandle();
+    TaskHandle_t xRunningTasks[mqttexampleCALLBACK_RUNS];
+    uint32_t ulReturned[mqttexampleCALLBACK_RUNS];
+    uint32_t ulRun;
+    bool xWait = true;
+
+    usKeyLength = prvSubscriptionKeyLength(pcTopicFilter, usTopicFilterLength, &xHasWildcard);
+    ulKeyHash = prvSubscriptionHash(mqttexampleFNV_OFFSET_BASIS, pcTopicFilter, usKeyLength);
 
     xSemaphoreTake(xSubscriptionsMutex, portMAX_DELAY);
     {
-        for (ulIndex = 0U; ulIndex < MQTT_AGENT_MAX_SUBSCRIPTIONS; ulIndex++)
+        pusLink = &usSubscriptionBuckets[ulKeyHash & (MQTT_AGENT_SUBSCRIPTION_BUCKETS - 1U)];
+
+        while (mqttexampleSUBSCRIPTION_NONE != *pusLink)
         {
-            if (xTopicFilterSubscriptions[ulIndex].usTopicFilterLength == usTopicFilterLength)
+            usIndex = *pusLink;
+
+            if ((xTopicFilterSubscriptions[usIndex].usTopicFilterLength == usTopicFilterLength) &&
+                (strncmp(xTopicFilterSubscriptions[usIndex].pcTopicFilter, pcTopicFilter, usTopicFilterLength) == 0))
             {
-                if (strncmp(xTopicFilterSubscriptions[ulIndex].pcTopicFilter, pcTopicFilter, usTopicFilterLength) == 0)
+                taskENTER_CRITICAL();
                 {
-                    memset(&(xTopicFilterSubscriptions[ulIndex]), 0x00, sizeof(TopicFilterSubscription_t));
+                    *pusLink = xTopicFilterSubscriptions[usIndex].usNextInBucket;
+                    memset(&(xTopicFilterSubscriptions[usIndex]), 0x00, sizeof(TopicFilterSubscription_t));
+                    ulSubscriptionSequence++;
                 }
+                taskEXIT_CRITICAL();
+            }
+            else
+            {
+                pusLink = &xTopicFilterSubscriptions[usIndex].usNextInBucket;
+            }
+        }
+
+        /* A callback started after this point finds its subscription removed. */
+        taskENTER_CRITICAL();
+        {
+            for (ulRun = 0U; ulRun < mqttexampleCALLBACK_RUNS; ulRun++)
+            {
+                xRunningTasks[ulRun] = xCallbackRuns[ulRun].xTask;
+                ulReturned[ulRun] = xCallbackRuns[ulRun].ulReturned;
+                xWait = xWait && (xRunningTasks[ulRun] != xCurrentTask);
             }
         }
+        taskEXIT_CRITICAL();
     }
     xSemaphoreGive(xSubscriptionsMutex);
+
+    /* Wait without xSubscriptionsMutex, the running callbacks may need it. */
+    for (ulRun = 0U; (true == xWait) && (ulRun < mqttexampleCALLBACK_RUNS); ulRun++)
+    {
+        while ((NULL != xRunningTasks[ulRun]) &&
+               (xCallbackRuns[ulRun].xTask == xRunningTasks[ulRun]) &&
+               (xCallbackRuns[ulRun].ulReturned == ulReturned[ulRun]))
+        {
+            vTaskDelay(1U);
+        }
+    }
 }
 /**********************************************************************************************************************
  End of function vRemoveMQTTTopicFilterCallback
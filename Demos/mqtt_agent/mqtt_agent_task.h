@@ -58,6 +58,17 @@ typedef enum MQTTAgentState
 typedef void (*IncomingPubCallback_t)(void *pvIncomingPublishCallbackContext,
                                       MQTTPublishInfo_t *pxPublishInfo);
 
+/**
+ * @brief Counters of the dispatch of publishes to deferred subscriptions.
+ */
+typedef struct MQTTAgentDispatchStats
+{
+    uint32_t ulDeferred;         /* Publishes queued to the dispatch task. */
+    uint32_t ulDropped;          /* Publishes dropped because no dispatch buffer was free. */
+    uint32_t ulOversized;        /* Publishes dropped because they did not fit a dispatch buffer. */
+    UBaseType_t uxHighWaterMark; /* Most dispatch buffers in use at the same time. */
+} MQTTAgentDispatchStats_t;
+
 /**
  * @brief Initialize the MQTT Agent.
  * Create the semaphore and Event group.
@@ -197,9 +208,46 @@ BaseType_t xAddMQTTTopicFilterCallback(const char *pcTopicFilter,
  End of function xAddMQTTTopicFilterCallback
  *********************************************************************************************************************/
 
+/**
+ * @brief Add a callback for the topic filter that runs on the dispatch task.
+ * Same as xAddMQTTTopicFilterCallback(), except that the callback gets a copy of the publish on the MQTT
+ * agent dispatch task, so a slow callback does not hold up the MQTT agent. Publishes are dropped when
+ * the dispatch buffers are exhausted or the publish does not fit a buffer, see vGetMQTTAgentDispatchStats().
+ */
+/**********************************************************************************************************************
+ * Function Name: xAddMQTTTopicFilterDeferredCallback
+ * Description  : Register a local subscription callback run on the dispatch task.
+ * Arguments    : As xAddMQTTTopicFilterCallback().
+ * Return Value : BaseType_t - pdTRUE if added successfully, pdFALSE otherwise.
+ *********************************************************************************************************************/
+BaseType_t xAddMQTTTopicFilterDeferredCallback(const char *pcTopicFilter,
+                                               uint16_t usTopicFilterLength,
+                                               IncomingPubCallback_t pxPublishCallback,
+                                               void *pvCallbackContext,
+                                               BaseType_t xManageResubscription);
+
+/**********************************************************************************************************************
+ End of function xAddMQTTTopicFilterDeferredCallback
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: vGetMQTTAgentDispatchStats
+ * Description  : Get the counters of the dispatch of publishes to deferred subscriptions.
+ * Arguments    : MQTTAgentDispatchStats_t * pxStats - destination of the counters.
+ * Return Value : void
+ *********************************************************************************************************************/
+void vGetMQTTAgentDispatchStats(MQTTAgentDispatchStats_t *pxStats);
+
+/**********************************************************************************************************************
+ End of function vGetMQTTAgentDispatchStats
+ *********************************************************************************************************************/
+
 /**
  * @brief Remove a topic filter callback from the MQTT agent.
  * Function is thread safe and can be invoked by multiple application tasks.
+ * On return the removed callback no longer runs, so its context may be freed.
+ * This does not hold when it is called from a subscription callback, which
+ * does not wait for the callbacks running on other tasks.
  *
  * @param pcTopicFilter Topic filter string for which the callback needs to be removed.
  * @param usTopicFilterLength Length of the topic filter string.
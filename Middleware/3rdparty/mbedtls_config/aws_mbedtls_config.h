@@ -211,11 +211,12 @@
 #ifdef CONFIG_MEDTLS_USE_AFR_MEMORY
     #include <stddef.h>
 
-    extern void * pvCalloc( size_t xNumElements,
-                            size_t xSize ) ;
-    extern void vPortFree( void *pv );
-    #define MBEDTLS_PLATFORM_CALLOC_MACRO pvCalloc
-    #define MBEDTLS_PLATFORM_FREE_MACRO   vPortFree
+    /* The FreeRTOS heap, unless CRYPTO_SetAllocator() replaced it. */
+    extern void * pvCryptoCalloc( size_t xNumElements,
+                                  size_t xSize );
+    extern void vCryptoFree( void * pv );
+    #define MBEDTLS_PLATFORM_CALLOC_MACRO pvCryptoCalloc
+    #define MBEDTLS_PLATFORM_FREE_MACRO   vCryptoFree
 #endif
 
 /**
@@ -2065,7 +2066,7 @@
  *
  * Comment this macro to disable support for SSL session tickets
  */
-//#define MBEDTLS_SSL_SESSION_TICKETS
+#define MBEDTLS_SSL_SESSION_TICKETS
 
 /**
  * \def MBEDTLS_SSL_SERVER_NAME_INDICATION
@@ -2086,7 +2087,7 @@
  *
  * Requires: MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
  */
-//#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
 
 /**
  * \def MBEDTLS_TEST_CONSTANT_FLOW_MEMSAN
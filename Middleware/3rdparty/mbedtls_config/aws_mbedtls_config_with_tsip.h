@@ -192,11 +192,12 @@
 #ifdef CONFIG_MEDTLS_USE_AFR_MEMORY
     #include <stddef.h>
 
-    extern void * pvCalloc( size_t xNumElements,
-                          size_t xSize ) ;
-    extern void vPortFree( void *pv );
-    #define MBEDTLS_PLATFORM_CALLOC_MACRO pvCalloc
-    #define MBEDTLS_PLATFORM_FREE_MACRO   vPortFree
+    /* The FreeRTOS heap, unless CRYPTO_SetAllocator() replaced it. */
+    extern void * pvCryptoCalloc( size_t xNumElements,
+                                  size_t xSize );
+    extern void vCryptoFree( void * pv );
+    #define MBEDTLS_PLATFORM_CALLOC_MACRO pvCryptoCalloc
+    #define MBEDTLS_PLATFORM_FREE_MACRO   vCryptoFree
 #endif
 
 
@@ -1693,7 +1694,7 @@
  *
  * Requires: MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
  */
-//#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
 
 /**
  * \def MBEDTLS_TEST_CONSTANT_FLOW_MEMSAN
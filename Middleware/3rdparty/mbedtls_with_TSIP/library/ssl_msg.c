@@ -61,6 +61,14 @@
 #include "mbedtls/threading.h"
 extern mbedtls_threading_mutex_t mutexUseTsip;
 #endif /* MBEDTLS_THREADING_C */
+
+/*
+ * Output of the TSIP record cipher before it is copied back over the record.
+ * It is only used while mutexUseTsip is held, so one word aligned buffer serves
+ * every connection, rather than a stack buffer per call that is cleared for
+ * every record.
+ */
+static uint32_t tsip_record_text[ ( TSIP_SSL_IN_PAYLOAD_LEN + 3 ) / 4 ];
 #endif /* TSIP_TLS_API_ENABLE */
 
 static uint32_t ssl_get_hs_total_len( mbedtls_ssl_context const *ssl );
@@ -553,7 +561,7 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
 #if defined(TSIP_TLS_API_ENABLE)
     mbedtls_cipher_type_t c_type;
     e_tsip_err_t tsip_ret;
-    uint8_t enc_client_cipher_text[TSIP_SSL_IN_PAYLOAD_LEN];
+    uint8_t *enc_client_cipher_text = (uint8_t *) tsip_record_text;
     tsip_aes_handle_t       tsip_aes_handle;
     tsip_gcm_handle_t       tsip_gcm_handle;
     tsip_hmac_sha_handle_t  tsip_hmac_handle;
@@ -564,11 +572,6 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
     ((void) ssl);
 #endif
 
-#if defined(TSIP_TLS_API_ENABLE)
-    // initialize
-    memset( enc_client_cipher_text, 0, sizeof( enc_client_cipher_text ) );
-#endif /* TSIP_TLS_API_ENABLE */
-
     /* The PRNG is used for dynamic IV generation that's used
      * for CBC transformations in TLS 1.2. */
 #if !( defined(MBEDTLS_SSL_SOME_SUITES_USE_CBC) && \
@@ -1063,6 +1066,10 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
                                         &enc_client_cipher_text[gcm_len],
                                         &olen,
                                         data + rec->data_len );
+            if( TSIP_SUCCESS == tsip_ret )
+            {
+                memcpy( data, &enc_client_cipher_text[0], olen );
+            }
 #if defined(MBEDTLS_THREADING_C)
             mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -1073,7 +1080,6 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
                 return ( MBEDTLS_ERR_SSL_HW_ACCEL_FAILED );
             }
 
-            memcpy( data, &enc_client_cipher_text[0], olen );
             rec->data_len += transform->taglen;
         }
 #endif /* TSIP_TLS_API_ENABLE */
@@ -1293,6 +1299,10 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
                                             &tsip_aes_handle,
                                             NULL,
                                             &dummylen );
+                if( TSIP_SUCCESS == tsip_ret )
+                {
+                    memcpy( data, &enc_client_cipher_text[0], rec->data_len );
+                }
 #if defined(MBEDTLS_THREADING_C)
                 mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -1346,6 +1356,10 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
                                             &tsip_aes_handle,
                                             NULL,
                                             &dummylen );
+                if( TSIP_SUCCESS == tsip_ret )
+                {
+                    memcpy( data, &enc_client_cipher_text[0], rec->data_len );
+                }
 #if defined(MBEDTLS_THREADING_C)
                 mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -1360,10 +1374,6 @@ int mbedtls_ssl_encrypt_buf( mbedtls_ssl_context *ssl,
                 MBEDTLS_SSL_DEBUG_MSG( 1, ( "Invalid cipher suite is selected") );
                 while(1);
             }
-
-            memcpy( data,
-                    &enc_client_cipher_text,
-                    rec->data_len );
         }
 #endif /* TSIP_TLS_API_ENABLE */
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
@@ -1559,7 +1569,7 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
     int ret = 0;
 #if defined(TSIP_TLS_API_ENABLE)
     mbedtls_cipher_type_t c_type;
-    uint8_t dec_client_plain_text[TSIP_SSL_OUT_PAYLOAD_LEN];
+    uint8_t *dec_client_plain_text = (uint8_t *) tsip_record_text;
     tsip_aes_handle_t       tsip_aes_handle;
     tsip_gcm_handle_t       tsip_gcm_handle;
     tsip_hmac_sha_handle_t  tsip_hmac_handle;
@@ -1577,11 +1587,6 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
     ((void) ssl);
 #endif
 
-#if defined(TSIP_TLS_API_ENABLE)
-    // initialize
-    memset( dec_client_plain_text, 0, sizeof( dec_client_plain_text ) );
-#endif /* TSIP_TLS_API_ENABLE */
-
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> decrypt buf" ) );
     if( rec == NULL                     ||
         rec->buf == NULL                ||
@@ -1847,6 +1852,10 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
                                         &olen,
                                         data + rec->data_len,
                 (uint32_t) transform->taglen );
+            if( TSIP_SUCCESS == tsip_ret )
+            {
+                memcpy( data, &dec_client_plain_text[0],  olen );
+            }
 #if defined(MBEDTLS_THREADING_C)
             mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -1855,7 +1864,6 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
                 APP_ALL_PRINT( 1, "R_TSIP_Aes128GcmDecryptFinal ret:%d \r\n", tsip_ret );
                 return ( MBEDTLS_ERR_SSL_HW_ACCEL_FAILED );
             }
-            memcpy( data, &dec_client_plain_text[0],  olen );
 
             ret = tsip_ret;
         }
@@ -2263,6 +2271,10 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
                                             &tsip_aes_handle,
                                             NULL,
                                             &dummylen );
+                if( tsip_ret == TSIP_SUCCESS )
+                {
+                    memcpy( data, &dec_client_plain_text[0], rec->data_len );
+                }
 #if defined(MBEDTLS_THREADING_C)
                 mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -2314,6 +2326,10 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
                                             &tsip_aes_handle,
                                             NULL,
                                             &dummylen );
+                if( tsip_ret == TSIP_SUCCESS )
+                {
+                    memcpy( data, &dec_client_plain_text[0], rec->data_len );
+                }
 #if defined(MBEDTLS_THREADING_C)
                 mbedtls_mutex_unlock( &mutexUseTsip );
 #endif /* MBEDTLS_THREADING_C */
@@ -2329,9 +2345,6 @@ int mbedtls_ssl_decrypt_buf( mbedtls_ssl_context *ssl,
                 return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
             }
 
-            // write decrypted message
-            memcpy( data, &dec_client_plain_text[0], rec->data_len );
-
         } // Client or Server
 #endif /* TSIP_TLS_API_ENABLE */
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
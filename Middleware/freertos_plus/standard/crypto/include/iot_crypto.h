@@ -49,6 +49,27 @@ void CRYPTO_Init( void );
  */
 void CRYPTO_ConfigureThreading( void );
 
+#ifdef CONFIG_MEDTLS_USE_AFR_MEMORY
+
+/**
+ * @brief Implements libc calloc semantics using the FreeRTOS heap.
+ */
+    void * pvCalloc( size_t xNumElements,
+                     size_t xSize );
+
+/**
+ * @brief Replaces the FreeRTOS heap as the allocator of mbedTLS.
+ *
+ * Memory allocated before the call is freed through pxFree as well, which
+ * hands what it did not allocate to vPortFree().
+ *
+ * @param[in] pxCalloc Allocation, with calloc semantics.
+ * @param[in] pxFree Release.
+ */
+    void CRYPTO_SetAllocator( void * ( *pxCalloc )( size_t xNumElements, size_t xSize ),
+                              void ( * pxFree )( void * pv ) );
+#endif
+
 /**
  * @brief Library-independent cryptographic algorithm identifiers.
  */
@@ -95,6 +95,75 @@ void *pvCalloc(size_t xNumElements,
  End of function pvCalloc
  *********************************************************************************************************************/
 
+/**
+ * @brief Allocator set by CRYPTO_SetAllocator(), NULL while mbedTLS uses the FreeRTOS heap.
+ */
+static void *(*pxCryptoCalloc)(size_t xNumElements, size_t xSize) = NULL;
+static void (*pxCryptoFree)(void *pv) = NULL;
+
+/**********************************************************************************************************************
+ * Function Name: CRYPTO_SetAllocator
+ * Description  : Replaces the FreeRTOS heap as the allocator of mbedTLS.
+ * Arguments    : pxCalloc
+ *              : pxFree
+ * Return Value : None.
+ *********************************************************************************************************************/
+void CRYPTO_SetAllocator(void *(*pxCalloc)(size_t xNumElements, size_t xSize),
+                         void (*pxFree)(void *pv))
+{
+    /* No task may see one function of the pair without the other. */
+    taskENTER_CRITICAL();
+    {
+        pxCryptoFree = pxFree;
+        pxCryptoCalloc = pxCalloc;
+    }
+    taskEXIT_CRITICAL();
+}
+/**********************************************************************************************************************
+ End of function CRYPTO_SetAllocator
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: pvCryptoCalloc
+ * Description  : mbedTLS calloc: the allocator set by CRYPTO_SetAllocator(), or pvCalloc().
+ * Arguments    : xNumElements
+ *              : xSize
+ * Return Value : The memory, or NULL.
+ *********************************************************************************************************************/
+void *pvCryptoCalloc(size_t xNumElements,
+                     size_t xSize)
+{
+    void *(*pxCalloc)(size_t, size_t) = pxCryptoCalloc;
+
+    return (NULL != pxCalloc) ? pxCalloc(xNumElements, xSize) : pvCalloc(xNumElements, xSize);
+}
+/**********************************************************************************************************************
+ End of function pvCryptoCalloc
+ *********************************************************************************************************************/
+
+/**********************************************************************************************************************
+ * Function Name: vCryptoFree
+ * Description  : mbedTLS free: the allocator set by CRYPTO_SetAllocator(), or vPortFree().
+ * Arguments    : pv
+ * Return Value : None.
+ *********************************************************************************************************************/
+void vCryptoFree(void *pv)
+{
+    void (*pxFree)(void *) = pxCryptoFree;
+
+    if (NULL != pxFree)
+    {
+        pxFree(pv);
+    }
+    else
+    {
+        vPortFree(pv);
+    }
+}
+/**********************************************************************************************************************
+ End of function vCryptoFree
+ *********************************************************************************************************************/
+
 #endif /* ifdef CONFIG_MEDTLS_USE_AFR_MEMORY */
 
 /*-----------------------------------------------------------*/
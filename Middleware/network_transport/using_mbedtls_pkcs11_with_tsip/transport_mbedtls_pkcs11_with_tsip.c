@@ -44,6 +44,7 @@
 
 /* Standard includes. */
 #include <string.h>
+#include <stdlib.h>
 
 /* FreeRTOS includes. */
 #include "FreeRTOS.h"
@@ -62,6 +63,18 @@
 #include "pkcs11.h"
 #include "core_pki_utils.h"
 
+/* mbed TLS SHA-256, used to identify shared certificates. */
+#include "mbedtls/sha256.h"
+
+/* mbed TLS zeroize, to clear serialized sessions. */
+#include "mbedtls/platform_util.h"
+
+/* mbed TLS allocator, replaced to serve connections from static arenas. */
+#include "mbedtls/platform.h"
+#ifdef CONFIG_MEDTLS_USE_AFR_MEMORY
+    #include "iot_crypto.h"
+#endif
+
 /* Mbedtls with TSIP */
 #include "key_write.h"
 
@@ -115,6 +128,137 @@ static const char * pNoLowLevelMbedTlsCodeStr = "<No-Low-Level-Code>";
     ( mbedtls_low_level_strerr( mbedTlsCode ) != NULL ) ? \
     mbedtls_low_level_strerr( mbedTlsCode ) : pNoLowLevelMbedTlsCodeStr
 
+/**
+ * @brief Handshake statistics of all connections.
+ */
+static TlsTransportStats_t transportStats;
+
+/**
+ * @brief Size of the key identifying a shared certificate.
+ */
+#define TLS_CERTIFICATE_KEY_SIZE    ( 32U )
+
+#if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+
+/**
+ * @brief Magic of a session serialized by TLS_FreeRTOS_SaveSession().
+ */
+    #define TLS_SESSION_MAGIC          ( 0x544C5354UL )
+
+/**
+ * @brief Size of the header of a serialized session: magic, port, host name length,
+ * session age in milliseconds and the keys of the root CA and client certificate.
+ */
+    #define TLS_SESSION_HEADER_SIZE    ( 12U + ( 2U * TLS_CERTIFICATE_KEY_SIZE ) )
+
+/**
+ * @brief Session of the last successful handshake.
+ *
+ * Connections of all tasks share it, so it is accessed with the scheduler suspended.
+ */
+    typedef struct TlsSessionCache
+    {
+        mbedtls_ssl_session session;
+        char hostName[ TLS_TRANSPORT_SESSION_HOST_MAX_LENGTH + 1U ];
+        uint16_t port;
+        uint8_t rootCaKey[ TLS_CERTIFICATE_KEY_SIZE ];     /**< @brief Key of the root CA that verified the server. */
+        uint8_t clientCertKey[ TLS_CERTIFICATE_KEY_SIZE ]; /**< @brief Key of the client certificate that was presented. */
+        TickType_t fullHandshakeTime;                      /**< @brief Tick count of the full handshake that created the session. */
+        BaseType_t valid;
+    } TlsSessionCache_t;
+
+    static TlsSessionCache_t sessionCache;
+#endif /* TLS_TRANSPORT_SESSION_RESUMPTION == 1 */
+
+/**
+ * @brief Certificate parsed once and shared by all connections.
+ *
+ * A client certificate is parsed in place from the DER copy that follows the structure.
+ */
+struct TlsCertificate
+{
+    mbedtls_x509_crt certificate;
+    uint8_t key[ TLS_CERTIFICATE_KEY_SIZE ]; /**< @brief SHA-256 of the root CA PEM or of the PKCS #11 label. */
+    uint32_t references;                     /**< @brief Connections using the certificate, plus one while it is shared. */
+};
+
+/**
+ * @brief Certificates used by the next connections.
+ *
+ * Connections of all tasks share them, so they are accessed with the scheduler suspended.
+ */
+static TlsCertificate_t * pSharedRootCa = NULL;
+static TlsCertificate_t * pSharedClientCert = NULL;
+
+#if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+
+/**
+ * @brief Allocator of what does not fit in an arena and of tasks without one:
+ * the FreeRTOS heap when mbed TLS uses it, libc otherwise.
+ */
+    #if defined( CONFIG_MEDTLS_USE_AFR_MEMORY )
+        #define TLS_ARENA_HEAP_CALLOC    pvCalloc
+        #define TLS_ARENA_HEAP_FREE      vPortFree
+    #elif defined( MBEDTLS_PLATFORM_CALLOC_MACRO ) || defined( MBEDTLS_PLATFORM_FREE_MACRO )
+        #error "TLS_TRANSPORT_ARENA_COUNT needs an mbed TLS allocator that can be replaced at run time."
+    #else
+        #define TLS_ARENA_HEAP_CALLOC    calloc
+        #define TLS_ARENA_HEAP_FREE      free
+    #endif
+
+/**
+ * @brief Alignment of the memory returned from an arena.
+ */
+    #define TLS_ARENA_ALIGNMENT    ( 8U )
+
+/**
+ * @brief Round a size up to the arena alignment.
+ */
+    #define TLS_ARENA_ALIGN( size )    ( ( ( size ) + TLS_ARENA_ALIGNMENT - 1U ) & ~( ( size_t ) TLS_ARENA_ALIGNMENT - 1U ) )
+
+/**
+ * @brief Header in front of every arena block, allocated or free.
+ */
+    typedef struct TlsArenaBlock
+    {
+        struct TlsArenaBlock * pNextFree; /**< @brief Next free block by address, only set while free. */
+        size_t size;                      /**< @brief Size of the block, header included. */
+    } TlsArenaBlock_t;
+
+/**
+ * @brief Size of the block header, keeping the memory after it aligned.
+ */
+    #define TLS_ARENA_HEADER_SIZE    TLS_ARENA_ALIGN( sizeof( TlsArenaBlock_t ) )
+
+/**
+ * @brief Static memory serving the mbed TLS allocations of a connection.
+ *
+ * Blocks are allocated first fit from a free list kept in address order, so freed
+ * neighbours merge back. The arena is accessed with the scheduler suspended.
+ */
+    struct TlsArena
+    {
+        TlsArenaBlock_t * pFreeList;
+        size_t currentBytes;
+        size_t peakBytes;
+        size_t steadyStateBytes;
+        uint32_t heapFallbacks;
+        BaseType_t inUse;
+    };
+
+/**
+ * @brief Memory of the arenas, contiguous so a pointer is mapped to its arena by address.
+ */
+    static uint64_t arenaMemory[ TLS_TRANSPORT_ARENA_COUNT ][ ( TLS_TRANSPORT_ARENA_SIZE + 7U ) / 8U ];
+
+    static TlsArena_t arenas[ TLS_TRANSPORT_ARENA_COUNT ];
+
+/**
+ * @brief The arena allocator has been installed in mbed TLS.
+ */
+    static BaseType_t arenaHooksInstalled = pdFALSE;
+#endif /* TLS_TRANSPORT_ARENA_COUNT > 0 */
+
 /*-----------------------------------------------------------*/
 
 /**
@@ -136,6 +280,7 @@ static void sslContextFree( SSLContext_t * pSslContext );
  *
  * @param[in] pNetworkContext Network context.
  * @param[in] pHostName Remote host name, used for server name indication.
+ * @param[in] port Remote port, used to look up a cached session.
  * @param[in] pNetworkCredentials TLS setup parameters.
  *
  * @return #TLS_TRANSPORT_SUCCESS, #TLS_TRANSPORT_INSUFFICIENT_MEMORY, #TLS_TRANSPORT_INVALID_CREDENTIALS,
@@ -143,8 +288,222 @@ static void sslContextFree( SSLContext_t * pSslContext );
  */
 static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
                                       const char * pHostName,
+                                      uint16_t port,
                                       const NetworkCredentials_t * pNetworkCredentials );
 
+/**
+ * @brief mbed TLS send callback. Counts the bytes written to the TCP socket.
+ *
+ * @param[in] pvCtx The TlsTransportParams_t of the connection.
+ * @param[in] pBuf Data to send.
+ * @param[in] len Length of pBuf.
+ *
+ * @return Number of bytes sent, or an mbed TLS error code.
+ */
+static int tlsBioSend( void * pvCtx,
+                       const unsigned char * pBuf,
+                       size_t len );
+
+/**
+ * @brief mbed TLS receive callback. Counts the bytes read from the TCP socket.
+ *
+ * @param[in] pvCtx The TlsTransportParams_t of the connection.
+ * @param[out] pBuf Buffer for the received data.
+ * @param[in] len Size of pBuf.
+ *
+ * @return Number of bytes received, or an mbed TLS error code.
+ */
+static int tlsBioRecv( void * pvCtx,
+                       unsigned char * pBuf,
+                       size_t len );
+
+/**
+ * @brief Certificate verification callback. It does not change the verification
+ * result, it only records that the handshake verified the server certificate,
+ * which tells a full handshake from a resumed one.
+ *
+ * @param[in] pvCtx The SSLContext_t of the connection.
+ * @param[in] pCert Certificate being verified.
+ * @param[in] depth Depth of pCert in the chain.
+ * @param[in,out] pFlags Verification result of pCert.
+ *
+ * @return Zero.
+ */
+static int certificateVerifyCallback( void * pvCtx,
+                                      mbedtls_x509_crt * pCert,
+                                      int depth,
+                                      uint32_t * pFlags );
+
+#if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+
+/**
+ * @brief Check if the cached session belongs to the host, port and credentials.
+ *
+ * Must be called with the scheduler suspended.
+ *
+ * @param[in] pHostName Remote host name.
+ * @param[in] port Remote port.
+ * @param[in] pRootCaKey Key of the root CA of the connection.
+ * @param[in] pClientCertKey Key of the client certificate of the connection.
+ *
+ * @return pdTRUE if the cached session is valid and matches.
+ */
+    static BaseType_t sessionCacheMatches( const char * pHostName,
+                                           uint16_t port,
+                                           const uint8_t * pRootCaKey,
+                                           const uint8_t * pClientCertKey );
+
+/**
+ * @brief Offer the cached session if it belongs to the host, port and credentials
+ * and has not expired.
+ *
+ * @param[in] pContext SSL context before the handshake.
+ * @param[in] pHostName Remote host name.
+ * @param[in] port Remote port.
+ * @param[in] pRootCaKey Key of the root CA of the connection.
+ * @param[in] pClientCertKey Key of the client certificate of the connection.
+ *
+ * @return pdTRUE if a session was offered.
+ */
+    static BaseType_t offerCachedSession( mbedtls_ssl_context * pContext,
+                                          const char * pHostName,
+                                          uint16_t port,
+                                          const uint8_t * pRootCaKey,
+                                          const uint8_t * pClientCertKey );
+
+/**
+ * @brief Cache the session of a successful handshake.
+ *
+ * @param[in] pContext SSL context after the handshake.
+ * @param[in] pHostName Remote host name.
+ * @param[in] port Remote port.
+ * @param[in] pRootCaKey Key of the root CA of the connection.
+ * @param[in] pClientCertKey Key of the client certificate of the connection.
+ * @param[in] resumed The handshake resumed the cached session.
+ */
+    static void cacheSession( const mbedtls_ssl_context * pContext,
+                              const char * pHostName,
+                              uint16_t port,
+                              const uint8_t * pRootCaKey,
+                              const uint8_t * pClientCertKey,
+                              BaseType_t resumed );
+#endif /* TLS_TRANSPORT_SESSION_RESUMPTION == 1 */
+
+/**
+ * @brief Take a reference to the shared certificate if it has the key.
+ *
+ * @param[in] ppShared Shared certificate.
+ * @param[in] pKey Key of the certificate.
+ *
+ * @return The certificate, or NULL if it is not shared.
+ */
+static TlsCertificate_t * findCertificate( TlsCertificate_t * const * ppShared,
+                                           const uint8_t * pKey );
+
+/**
+ * @brief Share a newly parsed certificate, replacing the shared one.
+ *
+ * @param[in,out] ppShared Shared certificate.
+ * @param[in] pCertificate Certificate, also referenced by the caller.
+ */
+static void shareCertificate( TlsCertificate_t ** ppShared,
+                              TlsCertificate_t * pCertificate );
+
+/**
+ * @brief Drop a reference to a certificate, and free it with the last one.
+ *
+ * @param[in] pCertificate Certificate, may be NULL.
+ */
+static void releaseCertificate( TlsCertificate_t * pCertificate );
+
+#if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+
+/**
+ * @brief Take a free arena for a new connection.
+ *
+ * @return The arena, or NULL if all of them are used.
+ */
+    static TlsArena_t * tlsArenaAcquire( void );
+
+/**
+ * @brief Give back the arena of a closed connection, discarding whatever is left in it.
+ *
+ * @param[in] pArena Arena, may be NULL.
+ */
+    static void tlsArenaRelease( TlsArena_t * pArena );
+
+/**
+ * @brief Make the mbed TLS allocations of the calling task use an arena.
+ *
+ * @param[in] pArena Arena, NULL to use the heap.
+ *
+ * @return The arena bound before.
+ */
+    static TlsArena_t * tlsArenaBind( TlsArena_t * pArena );
+
+/**
+ * @brief Allocate a block from an arena.
+ *
+ * @param[in] pArena Arena.
+ * @param[in] size Bytes to allocate.
+ *
+ * @return The memory, or NULL if the arena is full.
+ */
+    static void * tlsArenaAlloc( TlsArena_t * pArena,
+                                 size_t size );
+
+/**
+ * @brief mbed TLS calloc: allocate from the arena bound to the calling task, or from the heap.
+ */
+    static void * tlsArenaCalloc( size_t count,
+                                  size_t size );
+
+/**
+ * @brief mbed TLS free: give the memory back to its arena, or to the heap.
+ */
+    static void tlsArenaFree( void * pMemory );
+#endif /* TLS_TRANSPORT_ARENA_COUNT > 0 */
+
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+
+/**
+ * @brief Convert a maximum fragment length to its mbed TLS code.
+ *
+ * @param[in] length Maximum fragment length in bytes, 0 for #TLS_TRANSPORT_MAX_FRAGMENT_LENGTH.
+ * @param[out] pCode MBEDTLS_SSL_MAX_FRAG_LEN_* code.
+ *
+ * @return #TLS_TRANSPORT_SUCCESS or #TLS_TRANSPORT_INVALID_PARAMETER.
+ */
+    static TlsTransportStatus_t getMaxFragmentLengthCode( uint16_t length,
+                                                          unsigned char * pCode );
+#endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+
+/**
+ * @brief Get the root CA of a connection from the shared certificates, parsing it
+ * only if it is not shared yet.
+ *
+ * @param[in] pSslContext Caller TLS context.
+ * @param[in] pRootCa PEM or DER root CA.
+ * @param[in] rootCaSize Size of pRootCa.
+ *
+ * @return #TLS_TRANSPORT_SUCCESS or #TLS_TRANSPORT_INVALID_CREDENTIALS.
+ */
+static TlsTransportStatus_t loadRootCa( SSLContext_t * pSslContext,
+                                        const unsigned char * pRootCa,
+                                        size_t rootCaSize );
+
+/**
+ * @brief Get the client certificate of a connection from the shared certificates,
+ * reading it from PKCS #11 only if it is not shared yet.
+ *
+ * @param[in] pSslContext Caller TLS context.
+ * @param[in] pcLabelName PKCS #11 certificate object label.
+ *
+ * @return CKR_OK on success.
+ */
+static CK_RV loadClientCertificate( SSLContext_t * pSslContext,
+                                    const char * pcLabelName );
+
 /*-----------------------------------------------------------*/
 
 /**
@@ -168,14 +527,14 @@ static int generateRandomBytes( void * pvCtx,
  * @param[in] pSslContext Caller TLS context.
  * @param[in] pcLabelName PKCS #11 certificate object label.
  * @param[in] xClass PKCS #11 certificate object class.
- * @param[out] pxCertificateContext Certificate context.
+ * @param[out] ppCertificate Certificate with one reference, key not set.
  *
  * @return Zero on success.
  */
 static CK_RV readCertificateIntoContext( SSLContext_t * pSslContext,
                                          const char * pcLabelName,
                                          CK_OBJECT_CLASS xClass,
-                                         mbedtls_x509_crt * pxCertificateContext );
+                                         TlsCertificate_t ** ppCertificate );
 
 /**
  * @brief Helper for setting up potentially hardware-based cryptographic context
@@ -229,8 +588,8 @@ static void sslContextInit( SSLContext_t * pSslContext )
     configASSERT( pSslContext != NULL );
 
     mbedtls_ssl_config_init( &( pSslContext->config ) );
-    mbedtls_x509_crt_init( &( pSslContext->rootCa ) );
-    mbedtls_x509_crt_init( &( pSslContext->clientCert ) );
+    pSslContext->pRootCa = NULL;
+    pSslContext->pClientCert = NULL;
     mbedtls_ssl_init( &( pSslContext->context ) );
 
     xInitializePkcs11Session( &( pSslContext->xP11Session ) );
@@ -243,9 +602,11 @@ static void sslContextFree( SSLContext_t * pSslContext )
     configASSERT( pSslContext != NULL );
 
     mbedtls_ssl_free( &( pSslContext->context ) );
-    mbedtls_x509_crt_free( &( pSslContext->rootCa ) );
-    mbedtls_x509_crt_free( &( pSslContext->clientCert ) );
     mbedtls_ssl_config_free( &( pSslContext->config ) );
+    releaseCertificate( pSslContext->pRootCa );
+    releaseCertificate( pSslContext->pClientCert );
+    pSslContext->pRootCa = NULL;
+    pSslContext->pClientCert = NULL;
 
     mbedtls_pk_free( &( pSslContext->privKey ) );
 
@@ -256,20 +617,25 @@ static void sslContextFree( SSLContext_t * pSslContext )
 
 static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
                                       const char * pHostName,
+                                      uint16_t port,
                                       const NetworkCredentials_t * pNetworkCredentials )
 {
     TlsTransportParams_t * pTlsTransportParams = NULL;
     TlsTransportStatus_t returnStatus = TLS_TRANSPORT_SUCCESS;
     int32_t mbedtlsError = 0;
     CK_RV xResult = CKR_OK;
+    TickType_t handshakeStart = 0U;
+    uint32_t handshakeMs = 0U;
+    BaseType_t sessionOffered = pdFALSE;
+    BaseType_t resumed = pdFALSE;
 
-#if defined(TSIP_TLS_API_ENABLE)
-    extern mbedtls_threading_mutex_t 						mutexUseTsip;
-    extern tsip_tls_ca_certification_public_key_index_t		system_user_rsa2048_ne_key_index;
-	const char trust_ca_root_rsa_certificate_signature[] = {
-		#include "AmazonRootCA1_sig_array.txt"
-    };
-#endif
+    #ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+        unsigned char maxFragmentLengthCode = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+    #endif
+
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        TlsArena_t * pPreviousArena = NULL;
+    #endif
 
     configASSERT( pNetworkContext != NULL );
     configASSERT( pNetworkContext->pParams != NULL );
@@ -283,6 +649,11 @@ static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
 
     /* Initialize the mbed TLS context structures. */
     sslContextInit( &( pTlsTransportParams->sslContext ) );
+    pTlsTransportParams->pArena = NULL;
+
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        pTlsTransportParams->pArena = tlsArenaAcquire();
+    #endif
 
     mbedtlsError = mbedtls_ssl_config_defaults( &( pTlsTransportParams->sslContext.config ),
                                                 MBEDTLS_SSL_IS_CLIENT,
@@ -321,52 +692,24 @@ static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
                               &pTlsTransportParams->sslContext );
         mbedtls_ssl_conf_cert_profile( &( pTlsTransportParams->sslContext.config ),
                                        &( pTlsTransportParams->sslContext.certProfile ) );
+        mbedtls_ssl_conf_verify( &( pTlsTransportParams->sslContext.config ),
+                                 certificateVerifyCallback,
+                                 &( pTlsTransportParams->sslContext ) );
+        pTlsTransportParams->sslContext.certificateVerified = pdFALSE;
 
-        /* Parse the server root CA certificate into the SSL context. */
-        mbedtlsError = mbedtls_x509_crt_parse( &( pTlsTransportParams->sslContext.rootCa ),
-                                               pNetworkCredentials->pRootCa,
-                                               pNetworkCredentials->rootCaSize );
-
-        if( mbedtlsError != 0 )
-        {
-            LogError( ( "Failed to parse server root CA certificate: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+        /* Get the server root CA certificate, parsed by the first connection that used it. */
+        returnStatus = loadRootCa( &( pTlsTransportParams->sslContext ),
+                                   pNetworkCredentials->pRootCa,
+                                   pNetworkCredentials->rootCaSize );
 
-            returnStatus = TLS_TRANSPORT_INVALID_CREDENTIALS;
-        }
-        else
+        if( returnStatus == TLS_TRANSPORT_SUCCESS )
         {
             mbedtls_ssl_conf_ca_chain( &( pTlsTransportParams->sslContext.config ),
-                                       &( pTlsTransportParams->sslContext.rootCa ),
+                                       &( pTlsTransportParams->sslContext.pRootCa->certificate ),
                                        NULL );
         }
     }
 
-    /* RootCA certificate verification */
-    mbedtls_rsa_context * p_tmprsa = mbedtls_pk_rsa(pTlsTransportParams->sslContext.rootCa.pk);
-    mbedtlsError = R_TSIP_TlsRootCertificateVerification(
-                    (uint32_t)R_TSIP_TLS_PUBLIC_KEY_TYPE_RSA2048, // 0 : RSA 2048bit
-                    (uint8_t*)pTlsTransportParams->sslContext.rootCa.raw.p, //
-                    (uint32_t)pTlsTransportParams->sslContext.rootCa.raw.len, //
-                    (uint32_t)(p_tmprsa->pubkey_n_spos + 1) -   //
-                        (uint32_t)(uint8_t *)pTlsTransportParams->sslContext.rootCa.raw.p, //
-                    (uint32_t)(p_tmprsa->pubkey_n_spos -    //
-                        (uint32_t)(uint8_t *)pTlsTransportParams->sslContext.rootCa.raw.p) +    //
-                        (p_tmprsa->pubkey_n_epos - 1), //
-                    (uint32_t)p_tmprsa->pubkey_e_spos - //
-                        (uint32_t)(uint8_t *)pTlsTransportParams->sslContext.rootCa.raw.p,  //
-                    (uint32_t)(p_tmprsa->pubkey_e_spos -    //
-                        (uint32_t)(uint8_t *)pTlsTransportParams->sslContext.rootCa.raw.p) +    //
-                        (p_tmprsa->pubkey_e_epos - 1), //
-                    (uint8_t *)trust_ca_root_rsa_certificate_signature, //
-                    &tsip_rootca_rsa_pubkey[tsip_rootca_rsa_pubkey_scnt][0]);
-    if (TSIP_SUCCESS != mbedtlsError)
-    {
-        LogError(("Failed to RootCA certificate verification"));
-        returnStatus = TLS_TRANSPORT_INVALID_CREDENTIALS;
-    }
-
     if (TLS_TRANSPORT_SUCCESS == returnStatus)
     {
         /* Configuring client certificate private key (RSA) */
@@ -381,150 +724,945 @@ static TlsTransportStatus_t tlsSetup( NetworkContext_t * pNetworkContext,
         else
         {
             /* Setup the client certificate. */
-            xResult = readCertificateIntoContext( &( pTlsTransportParams->sslContext ),
-                                                  pNetworkCredentials->pClientCertLabel,
-                                                  CKO_CERTIFICATE,
-                                                  &( pTlsTransportParams->sslContext.clientCert ) );
+            xResult = loadClientCertificate( &( pTlsTransportParams->sslContext ),
+                                             pNetworkCredentials->pClientCertLabel );
 
             if( xResult != CKR_OK )
             {
                 LogError( ( "Failed to get certificate from PKCS #11 module." ) );
 
-                returnStatus = TLS_TRANSPORT_INVALID_CREDENTIALS;
-            }
-            else
+                returnStatus = TLS_TRANSPORT_INVALID_CREDENTIALS;
+            }
+            else
+            {
+                ( void ) mbedtls_ssl_conf_own_cert( &( pTlsTransportParams->sslContext.config ),
+                                                    &( pTlsTransportParams->sslContext.pClientCert->certificate ),
+                                                    &( pTlsTransportParams->sslContext.privKey ) );
+            }
+        }
+    }
+
+    if( ( returnStatus == TLS_TRANSPORT_SUCCESS ) && ( pNetworkCredentials->pAlpnProtos != NULL ) )
+    {
+        /* Include an application protocol list in the TLS ClientHello
+         * message. */
+        mbedtlsError = mbedtls_ssl_conf_alpn_protocols( &( pTlsTransportParams->sslContext.config ),
+                                                        pNetworkCredentials->pAlpnProtos );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to configure ALPN protocol in mbed TLS: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+
+            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+        }
+    }
+
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        /* From here on the allocations belong to this connection only. The certificates
+         * and the session cache, shared with other connections, stay on the heap. */
+        pPreviousArena = tlsArenaBind( pTlsTransportParams->pArena );
+    #endif
+
+    if( returnStatus == TLS_TRANSPORT_SUCCESS )
+    {
+        /* Initialize the mbed TLS secured connection context. */
+        mbedtlsError = mbedtls_ssl_setup( &( pTlsTransportParams->sslContext.context ),
+                                          &( pTlsTransportParams->sslContext.config ) );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to set up mbed TLS SSL context: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+
+            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+        }
+        else
+        {
+            /* Set the underlying IO for the TLS connection. */
+
+            /* MISRA Rule 11.2 flags the following line for casting the second
+             * parameter to void *. This rule is suppressed because
+             * #mbedtls_ssl_set_bio requires the second parameter as void *.
+             */
+            /* coverity[misra_c_2012_rule_11_2_violation] */
+            mbedtls_ssl_set_bio( &( pTlsTransportParams->sslContext.context ),
+                                 ( void * ) pTlsTransportParams,
+                                 tlsBioSend,
+                                 tlsBioRecv,
+                                 NULL );
+        }
+    }
+
+    if( returnStatus == TLS_TRANSPORT_SUCCESS )
+    {
+        /* Enable SNI if requested. */
+        if( pNetworkCredentials->disableSni == pdFALSE )
+        {
+            mbedtlsError = mbedtls_ssl_set_hostname( &( pTlsTransportParams->sslContext.context ),
+                                                     pHostName );
+        }
+        /* MbedTLS-3.6.3 requires calling the mbedtls_ssl_set_hostname() before calling mbedtls_ssl_handshake(). */
+        else
+        {
+            mbedtlsError = mbedtls_ssl_set_hostname( &( pTlsTransportParams->sslContext.context ),
+                                                     NULL );
+        }
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to set server name: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+
+            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+        }
+    }
+
+    /* Set Maximum Fragment Length if enabled. */
+    #ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+        if( returnStatus == TLS_TRANSPORT_SUCCESS )
+        {
+            /* Request the max fragment extension, see RFC 6066. A server that ignores it
+             * keeps sending records of up to 16 KB, so the buffers keep their full size. */
+            returnStatus = getMaxFragmentLengthCode( pNetworkCredentials->maxFragmentLength,
+                                                     &maxFragmentLengthCode );
+        }
+
+        if( returnStatus == TLS_TRANSPORT_SUCCESS )
+        {
+            mbedtlsError = mbedtls_ssl_conf_max_frag_len( &( pTlsTransportParams->sslContext.config ), maxFragmentLengthCode );
+
+            if( mbedtlsError != 0 )
+            {
+                LogError( ( "Failed to maximum fragment length extension: mbedTLSError= %s : %s.",
+                            mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                            mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+                returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+            }
+        }
+    #endif /* ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+
+    if( returnStatus == TLS_TRANSPORT_SUCCESS )
+    {
+        #if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+            sessionOffered = offerCachedSession( &( pTlsTransportParams->sslContext.context ),
+                                                 pHostName,
+                                                 port,
+                                                 pTlsTransportParams->sslContext.pRootCa->key,
+                                                 pTlsTransportParams->sslContext.pClientCert->key );
+        #endif
+
+        handshakeStart = xTaskGetTickCount();
+
+        /* Perform the TLS handshake. */
+        do
+        {
+            mbedtlsError = mbedtls_ssl_handshake( &( pTlsTransportParams->sslContext.context ) );
+        } while( ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_READ ) ||
+                 ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_WRITE ) );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to perform TLS handshake: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+
+            returnStatus = TLS_TRANSPORT_HANDSHAKE_FAILED;
+        }
+    }
+
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        ( void ) tlsArenaBind( pPreviousArena );
+    #endif
+
+    if( returnStatus != TLS_TRANSPORT_SUCCESS )
+    {
+        if( returnStatus == TLS_TRANSPORT_HANDSHAKE_FAILED )
+        {
+            taskENTER_CRITICAL();
+            {
+                transportStats.failedHandshakes++;
+            }
+            taskEXIT_CRITICAL();
+
+            /* Do not offer a session again that may have caused the failure. */
+            if( sessionOffered == pdTRUE )
+            {
+                TLS_FreeRTOS_ClearSession();
+            }
+        }
+
+        sslContextFree( &( pTlsTransportParams->sslContext ) );
+
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            tlsArenaRelease( pTlsTransportParams->pArena );
+            pTlsTransportParams->pArena = NULL;
+        #endif
+    }
+    else
+    {
+        handshakeMs = ( uint32_t ) ( ( xTaskGetTickCount() - handshakeStart ) * portTICK_PERIOD_MS );
+        resumed = ( pTlsTransportParams->sslContext.certificateVerified == pdFALSE ) ? pdTRUE : pdFALSE;
+
+        taskENTER_CRITICAL();
+        {
+            if( resumed == pdTRUE )
+            {
+                transportStats.resumedHandshakes++;
+            }
+            else
+            {
+                transportStats.fullHandshakes++;
+            }
+
+            transportStats.lastHandshakeMs = handshakeMs;
+            transportStats.lastHandshakeBytesSent = pTlsTransportParams->bytesSent;
+            transportStats.lastHandshakeBytesReceived = pTlsTransportParams->bytesReceived;
+            transportStats.totalHandshakeMs += handshakeMs;
+            transportStats.totalHandshakeBytes += pTlsTransportParams->bytesSent + pTlsTransportParams->bytesReceived;
+        }
+        taskEXIT_CRITICAL();
+
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            if( pTlsTransportParams->pArena != NULL )
+            {
+                /* The handshake state is freed by now, what is left lives as long as the connection. */
+                vTaskSuspendAll();
+                {
+                    pTlsTransportParams->pArena->steadyStateBytes = pTlsTransportParams->pArena->currentBytes;
+                }
+                ( void ) xTaskResumeAll();
+
+                LogInfo( ( "(Network connection %p) TLS arena: %u bytes peak, %u bytes steady state, %u heap fallbacks.",
+                           pNetworkContext,
+                           ( unsigned int ) pTlsTransportParams->pArena->peakBytes,
+                           ( unsigned int ) pTlsTransportParams->pArena->steadyStateBytes,
+                           ( unsigned int ) pTlsTransportParams->pArena->heapFallbacks ) );
+            }
+        #endif
+
+        #if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+            cacheSession( &( pTlsTransportParams->sslContext.context ),
+                          pHostName,
+                          port,
+                          pTlsTransportParams->sslContext.pRootCa->key,
+                          pTlsTransportParams->sslContext.pClientCert->key,
+                          resumed );
+        #endif
+
+        LogInfo( ( "(Network connection %p) TLS handshake successful (%s, %u ms, %u bytes sent, %u bytes received).",
+                   pNetworkContext,
+                   ( resumed == pdTRUE ) ? "resumed" : "full",
+                   ( unsigned int ) handshakeMs,
+                   ( unsigned int ) pTlsTransportParams->bytesSent,
+                   ( unsigned int ) pTlsTransportParams->bytesReceived ) );
+        LogDebug( ( "(Network connection %p) Record payload limits: %d bytes in, %d bytes out.",
+                    pNetworkContext,
+                    mbedtls_ssl_get_max_in_record_payload( &( pTlsTransportParams->sslContext.context ) ),
+                    mbedtls_ssl_get_max_out_record_payload( &( pTlsTransportParams->sslContext.context ) ) ) );
+    }
+
+    return returnStatus;
+}
+
+
+static int tlsBioSend( void * pvCtx,
+                       const unsigned char * pBuf,
+                       size_t len )
+{
+    TlsTransportParams_t * pTlsTransportParams = ( TlsTransportParams_t * ) pvCtx;
+    int result;
+
+    result = xMbedTLSBioTCPSocketsWrapperSend( ( void * ) pTlsTransportParams->tcpSocket, pBuf, len );
+
+    if( result > 0 )
+    {
+        pTlsTransportParams->bytesSent += ( uint32_t ) result;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static int tlsBioRecv( void * pvCtx,
+                       unsigned char * pBuf,
+                       size_t len )
+{
+    TlsTransportParams_t * pTlsTransportParams = ( TlsTransportParams_t * ) pvCtx;
+    int result;
+
+    result = xMbedTLSBioTCPSocketsWrapperRecv( ( void * ) pTlsTransportParams->tcpSocket, pBuf, len );
+
+    if( result > 0 )
+    {
+        pTlsTransportParams->bytesReceived += ( uint32_t ) result;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static int certificateVerifyCallback( void * pvCtx,
+                                      mbedtls_x509_crt * pCert,
+                                      int depth,
+                                      uint32_t * pFlags )
+{
+    ( void ) pCert;
+    ( void ) depth;
+    ( void ) pFlags;
+
+    ( ( SSLContext_t * ) pvCtx )->certificateVerified = pdTRUE;
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+    static BaseType_t sessionCacheMatches( const char * pHostName,
+                                           uint16_t port,
+                                           const uint8_t * pRootCaKey,
+                                           const uint8_t * pClientCertKey )
+    {
+        BaseType_t matches = pdFALSE;
+
+        if( ( sessionCache.valid == pdTRUE ) &&
+            ( sessionCache.port == port ) &&
+            ( strncmp( sessionCache.hostName, pHostName, sizeof( sessionCache.hostName ) ) == 0 ) &&
+            ( memcmp( sessionCache.rootCaKey, pRootCaKey, TLS_CERTIFICATE_KEY_SIZE ) == 0 ) &&
+            ( memcmp( sessionCache.clientCertKey, pClientCertKey, TLS_CERTIFICATE_KEY_SIZE ) == 0 ) )
+        {
+            matches = pdTRUE;
+        }
+
+        return matches;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static BaseType_t offerCachedSession( mbedtls_ssl_context * pContext,
+                                          const char * pHostName,
+                                          uint16_t port,
+                                          const uint8_t * pRootCaKey,
+                                          const uint8_t * pClientCertKey )
+    {
+        BaseType_t offered = pdFALSE;
+        int32_t mbedtlsError = 0;
+        mbedtls_ssl_session session;
+        unsigned char * pSessionBuffer = NULL;
+        size_t bufferLength = 0U;
+        size_t sessionLength = 0U;
+
+        /* Copying a session parses its peer certificate, which must not be done with the
+         * scheduler suspended. The cached session is only serialized while suspended and
+         * the copy for the connection is loaded from the serialized session afterwards. */
+        vTaskSuspendAll();
+        {
+            if( ( sessionCache.valid == pdTRUE ) &&
+                ( ( xTaskGetTickCount() - sessionCache.fullHandshakeTime ) >= pdMS_TO_TICKS( TLS_TRANSPORT_SESSION_LIFETIME_MS ) ) )
+            {
+                mbedtls_ssl_session_free( &( sessionCache.session ) );
+                sessionCache.valid = pdFALSE;
+            }
+
+            if( sessionCacheMatches( pHostName, port, pRootCaKey, pClientCertKey ) == pdTRUE )
+            {
+                /* Query the size of the session first. */
+                ( void ) mbedtls_ssl_session_save( &( sessionCache.session ), NULL, 0U, &bufferLength );
+            }
+        }
+        ( void ) xTaskResumeAll();
+
+        if( bufferLength > 0U )
+        {
+            pSessionBuffer = pvPortMalloc( bufferLength );
+        }
+
+        if( pSessionBuffer != NULL )
+        {
+            vTaskSuspendAll();
+            {
+                /* The session may have been replaced while the buffer was allocated. */
+                if( sessionCacheMatches( pHostName, port, pRootCaKey, pClientCertKey ) == pdTRUE )
+                {
+                    mbedtlsError = mbedtls_ssl_session_save( &( sessionCache.session ),
+                                                             pSessionBuffer,
+                                                             bufferLength,
+                                                             &sessionLength );
+                }
+            }
+            ( void ) xTaskResumeAll();
+
+            if( ( mbedtlsError == 0 ) && ( sessionLength > 0U ) )
+            {
+                mbedtls_ssl_session_init( &session );
+                mbedtlsError = mbedtls_ssl_session_load( &session, pSessionBuffer, sessionLength );
+
+                if( mbedtlsError == 0 )
+                {
+                    mbedtlsError = mbedtls_ssl_set_session( pContext, &session );
+                    offered = ( mbedtlsError == 0 ) ? pdTRUE : pdFALSE;
+                }
+
+                mbedtls_ssl_session_free( &session );
+            }
+
+            /* The serialized session holds the master secret. */
+            mbedtls_platform_zeroize( pSessionBuffer, bufferLength );
+            vPortFree( pSessionBuffer );
+        }
+
+        if( mbedtlsError != 0 )
+        {
+            LogWarn( ( "Failed to offer the cached TLS session: mbedTLSError= %s : %s.",
+                       mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                       mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+        }
+
+        return offered;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void cacheSession( const mbedtls_ssl_context * pContext,
+                              const char * pHostName,
+                              uint16_t port,
+                              const uint8_t * pRootCaKey,
+                              const uint8_t * pClientCertKey,
+                              BaseType_t resumed )
+    {
+        mbedtls_ssl_session session;
+        int32_t mbedtlsError;
+
+        if( strlen( pHostName ) <= TLS_TRANSPORT_SESSION_HOST_MAX_LENGTH )
+        {
+            /* Get the session outside of the cache, the copy allocates memory. */
+            mbedtls_ssl_session_init( &session );
+            mbedtlsError = mbedtls_ssl_get_session( pContext, &session );
+
+            if( mbedtlsError != 0 )
+            {
+                LogDebug( ( "TLS session not cached: mbedTLSError= %s : %s.",
+                            mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                            mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+                mbedtls_ssl_session_free( &session );
+            }
+            else
+            {
+                vTaskSuspendAll();
+                {
+                    /* A resumed session keeps the age of the full handshake that created it. */
+                    if( ( resumed == pdFALSE ) || ( sessionCache.valid == pdFALSE ) )
+                    {
+                        sessionCache.fullHandshakeTime = xTaskGetTickCount();
+                    }
+
+                    mbedtls_ssl_session_free( &( sessionCache.session ) );
+                    sessionCache.session = session;
+                    ( void ) strncpy( sessionCache.hostName, pHostName, sizeof( sessionCache.hostName ) - 1U );
+                    sessionCache.hostName[ sizeof( sessionCache.hostName ) - 1U ] = '\0';
+                    sessionCache.port = port;
+                    ( void ) memcpy( sessionCache.rootCaKey, pRootCaKey, TLS_CERTIFICATE_KEY_SIZE );
+                    ( void ) memcpy( sessionCache.clientCertKey, pClientCertKey, TLS_CERTIFICATE_KEY_SIZE );
+                    sessionCache.valid = pdTRUE;
+                }
+                ( void ) xTaskResumeAll();
+            }
+        }
+    }
+#endif /* TLS_TRANSPORT_SESSION_RESUMPTION == 1 */
+
+/*-----------------------------------------------------------*/
+
+static TlsCertificate_t * findCertificate( TlsCertificate_t * const * ppShared,
+                                           const uint8_t * pKey )
+{
+    TlsCertificate_t * pCertificate = NULL;
+
+    vTaskSuspendAll();
+    {
+        if( ( *ppShared != NULL ) &&
+            ( memcmp( ( *ppShared )->key, pKey, TLS_CERTIFICATE_KEY_SIZE ) == 0 ) )
+        {
+            pCertificate = *ppShared;
+            pCertificate->references++;
+        }
+    }
+    ( void ) xTaskResumeAll();
+
+    return pCertificate;
+}
+
+/*-----------------------------------------------------------*/
+
+static void shareCertificate( TlsCertificate_t ** ppShared,
+                              TlsCertificate_t * pCertificate )
+{
+    TlsCertificate_t * pReplaced = NULL;
+
+    vTaskSuspendAll();
+    {
+        /* The store holds a reference of its own. */
+        pCertificate->references++;
+        pReplaced = *ppShared;
+        *ppShared = pCertificate;
+    }
+    ( void ) xTaskResumeAll();
+
+    releaseCertificate( pReplaced );
+}
+
+/*-----------------------------------------------------------*/
+
+static void releaseCertificate( TlsCertificate_t * pCertificate )
+{
+    uint32_t references = 0U;
+
+    if( pCertificate != NULL )
+    {
+        vTaskSuspendAll();
+        {
+            pCertificate->references--;
+            references = pCertificate->references;
+        }
+        ( void ) xTaskResumeAll();
+
+        if( references == 0U )
+        {
+            mbedtls_x509_crt_free( &( pCertificate->certificate ) );
+            vPortFree( pCertificate );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+
+    static TlsArena_t * tlsArenaAcquire( void )
+    {
+        TlsArena_t * pArena = NULL;
+        TlsArenaBlock_t * pBlock = NULL;
+        size_t i;
+
+        vTaskSuspendAll();
+        {
+            for( i = 0U; ( i < ( size_t ) TLS_TRANSPORT_ARENA_COUNT ) && ( pArena == NULL ); i++ )
+            {
+                if( arenas[ i ].inUse == pdFALSE )
+                {
+                    pArena = &( arenas[ i ] );
+                    pBlock = ( TlsArenaBlock_t * ) arenaMemory[ i ];
+                }
+            }
+
+            if( pArena != NULL )
+            {
+                pBlock->pNextFree = NULL;
+                pBlock->size = sizeof( arenaMemory[ 0 ] );
+                pArena->pFreeList = pBlock;
+                pArena->currentBytes = 0U;
+                pArena->peakBytes = 0U;
+                pArena->steadyStateBytes = 0U;
+                pArena->heapFallbacks = 0U;
+                pArena->inUse = pdTRUE;
+            }
+        }
+        ( void ) xTaskResumeAll();
+
+        if( pArena == NULL )
+        {
+            LogWarn( ( "No free TLS arena, the connection allocates from the heap." ) );
+        }
+        else if( arenaHooksInstalled == pdFALSE )
+        {
+            /* Tasks without a bound arena keep allocating from the heap. */
+            #ifdef CONFIG_MEDTLS_USE_AFR_MEMORY
+                CRYPTO_SetAllocator( tlsArenaCalloc, tlsArenaFree );
+            #else
+                ( void ) mbedtls_platform_set_calloc_free( tlsArenaCalloc, tlsArenaFree );
+            #endif
+            arenaHooksInstalled = pdTRUE;
+        }
+        else
+        {
+            /* Empty else for MISRA 15.7 compliance. */
+        }
+
+        return pArena;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void tlsArenaRelease( TlsArena_t * pArena )
+    {
+        if( pArena != NULL )
+        {
+            /* The free list is rebuilt by the next acquire, so nothing has to be walked. */
+            vTaskSuspendAll();
+            {
+                pArena->inUse = pdFALSE;
+            }
+            ( void ) xTaskResumeAll();
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static TlsArena_t * tlsArenaBind( TlsArena_t * pArena )
+    {
+        TlsArena_t * pPrevious = ( TlsArena_t * ) pvTaskGetThreadLocalStoragePointer( NULL, TLS_TRANSPORT_ARENA_TLS_INDEX );
+
+        vTaskSetThreadLocalStoragePointer( NULL, TLS_TRANSPORT_ARENA_TLS_INDEX, pArena );
+
+        return pPrevious;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void * tlsArenaAlloc( TlsArena_t * pArena,
+                                 size_t size )
+    {
+        TlsArenaBlock_t ** ppLink = NULL;
+        TlsArenaBlock_t * pBlock = NULL;
+        TlsArenaBlock_t * pRemainder = NULL;
+        size_t blockSize = 0U;
+        void * pMemory = NULL;
+
+        if( size <= sizeof( arenaMemory[ 0 ] ) )
+        {
+            blockSize = TLS_ARENA_HEADER_SIZE + TLS_ARENA_ALIGN( size );
+        }
+
+        vTaskSuspendAll();
+        {
+            ppLink = &( pArena->pFreeList );
+
+            while( ( *ppLink != NULL ) && ( ( *ppLink )->size < blockSize ) )
+            {
+                ppLink = &( ( *ppLink )->pNextFree );
+            }
+
+            pBlock = *ppLink;
+
+            if( ( pBlock == NULL ) || ( blockSize == 0U ) )
+            {
+                pArena->heapFallbacks++;
+            }
+            else
+            {
+                /* Split the block unless the rest is too small to be allocated. */
+                if( ( pBlock->size - blockSize ) > TLS_ARENA_HEADER_SIZE )
+                {
+                    pRemainder = ( TlsArenaBlock_t * ) ( ( uint8_t * ) pBlock + blockSize );
+                    pRemainder->size = pBlock->size - blockSize;
+                    pRemainder->pNextFree = pBlock->pNextFree;
+                    pBlock->size = blockSize;
+                    *ppLink = pRemainder;
+                }
+                else
+                {
+                    *ppLink = pBlock->pNextFree;
+                }
+
+                pArena->currentBytes += pBlock->size;
+
+                if( pArena->currentBytes > pArena->peakBytes )
+                {
+                    pArena->peakBytes = pArena->currentBytes;
+                }
+
+                pMemory = ( uint8_t * ) pBlock + TLS_ARENA_HEADER_SIZE;
+            }
+        }
+        ( void ) xTaskResumeAll();
+
+        return pMemory;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void * tlsArenaCalloc( size_t count,
+                                  size_t size )
+    {
+        TlsArena_t * pArena = ( TlsArena_t * ) pvTaskGetThreadLocalStoragePointer( NULL, TLS_TRANSPORT_ARENA_TLS_INDEX );
+        void * pMemory = NULL;
+        size_t bytes = count * size;
+
+        if( ( size != 0U ) && ( ( bytes / size ) != count ) )
+        {
+            /* The size overflows. */
+        }
+        else if( ( pArena == NULL ) || ( bytes == 0U ) )
+        {
+            pMemory = TLS_ARENA_HEAP_CALLOC( count, size );
+        }
+        else
+        {
+            pMemory = tlsArenaAlloc( pArena, bytes );
+
+            if( pMemory != NULL )
+            {
+                ( void ) memset( pMemory, 0, bytes );
+            }
+            else
+            {
+                pMemory = TLS_ARENA_HEAP_CALLOC( count, size );
+            }
+        }
+
+        return pMemory;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void tlsArenaFree( void * pMemory )
+    {
+        uint8_t * pAddress = ( uint8_t * ) pMemory;
+        uint8_t * pPoolStart = ( uint8_t * ) arenaMemory;
+        TlsArena_t * pArena = NULL;
+        TlsArenaBlock_t * pBlock = NULL;
+        TlsArenaBlock_t * pPrevious = NULL;
+        TlsArenaBlock_t * pNext = NULL;
+        TlsArenaBlock_t ** ppLink = NULL;
+
+        if( pMemory == NULL )
+        {
+            /* Nothing to free. */
+        }
+        else if( ( pAddress < pPoolStart ) || ( pAddress >= ( pPoolStart + sizeof( arenaMemory ) ) ) )
+        {
+            TLS_ARENA_HEAP_FREE( pMemory );
+        }
+        else
+        {
+            pArena = &( arenas[ ( size_t ) ( pAddress - pPoolStart ) / sizeof( arenaMemory[ 0 ] ) ] );
+            pBlock = ( TlsArenaBlock_t * ) ( pAddress - TLS_ARENA_HEADER_SIZE );
+
+            vTaskSuspendAll();
             {
-                ( void ) mbedtls_ssl_conf_own_cert( &( pTlsTransportParams->sslContext.config ),
-                                                    &( pTlsTransportParams->sslContext.clientCert ),
-                                                    &( pTlsTransportParams->sslContext.privKey ) );
+                /* The memory of a released arena went with it. */
+                if( pArena->inUse == pdTRUE )
+                {
+                    pArena->currentBytes -= pBlock->size;
+
+                    ppLink = &( pArena->pFreeList );
+
+                    while( ( *ppLink != NULL ) && ( *ppLink < pBlock ) )
+                    {
+                        pPrevious = *ppLink;
+                        ppLink = &( ( *ppLink )->pNextFree );
+                    }
+
+                    pNext = *ppLink;
+
+                    /* Merge with the free block that follows. */
+                    if( ( pNext != NULL ) && ( ( ( uint8_t * ) pBlock + pBlock->size ) == ( uint8_t * ) pNext ) )
+                    {
+                        pBlock->size += pNext->size;
+                        pBlock->pNextFree = pNext->pNextFree;
+                    }
+                    else
+                    {
+                        pBlock->pNextFree = pNext;
+                    }
+
+                    /* Merge with the free block that precedes. */
+                    if( ( pPrevious != NULL ) && ( ( ( uint8_t * ) pPrevious + pPrevious->size ) == ( uint8_t * ) pBlock ) )
+                    {
+                        pPrevious->size += pBlock->size;
+                        pPrevious->pNextFree = pBlock->pNextFree;
+                    }
+                    else
+                    {
+                        *ppLink = pBlock;
+                    }
+                }
             }
+            ( void ) xTaskResumeAll();
         }
     }
 
-    if( ( returnStatus == TLS_TRANSPORT_SUCCESS ) && ( pNetworkCredentials->pAlpnProtos != NULL ) )
+/*-----------------------------------------------------------*/
+
+#endif /* TLS_TRANSPORT_ARENA_COUNT > 0 */
+
+#ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+    static TlsTransportStatus_t getMaxFragmentLengthCode( uint16_t length,
+                                                          unsigned char * pCode )
     {
-        /* Include an application protocol list in the TLS ClientHello
-         * message. */
-        mbedtlsError = mbedtls_ssl_conf_alpn_protocols( &( pTlsTransportParams->sslContext.config ),
-                                                        pNetworkCredentials->pAlpnProtos );
+        TlsTransportStatus_t returnStatus = TLS_TRANSPORT_SUCCESS;
 
-        if( mbedtlsError != 0 )
+        if( length == 0U )
         {
-            LogError( ( "Failed to configure ALPN protocol in mbed TLS: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+            length = TLS_TRANSPORT_MAX_FRAGMENT_LENGTH;
+        }
 
-            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+        switch( length )
+        {
+            case 512U:
+                *pCode = MBEDTLS_SSL_MAX_FRAG_LEN_512;
+                break;
+
+            case 1024U:
+                *pCode = MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+                break;
+
+            case 2048U:
+                *pCode = MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+                break;
+
+            case 4096U:
+                *pCode = MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+                break;
+
+            case 16384U:
+                *pCode = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+                break;
+
+            default:
+                LogError( ( "Invalid maximum fragment length %u.", ( unsigned int ) length ) );
+                returnStatus = TLS_TRANSPORT_INVALID_PARAMETER;
+                break;
         }
+
+        return returnStatus;
     }
 
-    if( returnStatus == TLS_TRANSPORT_SUCCESS )
-    {
-        /* Initialize the mbed TLS secured connection context. */
-        mbedtlsError = mbedtls_ssl_setup( &( pTlsTransportParams->sslContext.context ),
-                                          &( pTlsTransportParams->sslContext.config ) );
+/*-----------------------------------------------------------*/
+#endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
 
-        if( mbedtlsError != 0 )
-        {
-            LogError( ( "Failed to set up mbed TLS SSL context: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+static TlsTransportStatus_t loadRootCa( SSLContext_t * pSslContext,
+                                        const unsigned char * pRootCa,
+                                        size_t rootCaSize )
+{
+    TlsTransportStatus_t returnStatus = TLS_TRANSPORT_SUCCESS;
+    TlsCertificate_t * pCertificate = NULL;
+    uint8_t key[ TLS_CERTIFICATE_KEY_SIZE ];
+    int32_t mbedtlsError = 0;
+    mbedtls_rsa_context * p_tmprsa = NULL;
+    uint8_t * p_raw = NULL;
+    const char trust_ca_root_rsa_certificate_signature[] = {
+        #include "AmazonRootCA1_sig_array.txt"
+    };
 
-            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
-        }
-        else
-        {
-            /* Set the underlying IO for the TLS connection. */
+    mbedtlsError = mbedtls_sha256( pRootCa, rootCaSize, key, 0 );
 
-            /* MISRA Rule 11.2 flags the following line for casting the second
-             * parameter to void *. This rule is suppressed because
-             * #mbedtls_ssl_set_bio requires the second parameter as void *.
-             */
-            /* coverity[misra_c_2012_rule_11_2_violation] */
-            mbedtls_ssl_set_bio( &( pTlsTransportParams->sslContext.context ),
-                                 ( void * ) pTlsTransportParams->tcpSocket,
-                                 xMbedTLSBioTCPSocketsWrapperSend,
-                                 xMbedTLSBioTCPSocketsWrapperRecv,
-                                 NULL );
-        }
+    if( mbedtlsError == 0 )
+    {
+        pCertificate = findCertificate( &pSharedRootCa, key );
     }
 
-    if( returnStatus == TLS_TRANSPORT_SUCCESS )
+    if( ( mbedtlsError == 0 ) && ( pCertificate == NULL ) )
     {
-        /* Enable SNI if requested. */
-        if( pNetworkCredentials->disableSni == pdFALSE )
+        pCertificate = pvPortMalloc( sizeof( TlsCertificate_t ) );
+
+        if( pCertificate == NULL )
         {
-            mbedtlsError = mbedtls_ssl_set_hostname( &( pTlsTransportParams->sslContext.context ),
-                                                     pHostName );
+            mbedtlsError = MBEDTLS_ERR_X509_ALLOC_FAILED;
         }
-        /* MbedTLS-3.6.3 requires calling the mbedtls_ssl_set_hostname() before calling mbedtls_ssl_handshake(). */
         else
         {
-            mbedtlsError = mbedtls_ssl_set_hostname( &( pTlsTransportParams->sslContext.context ),
-                                                     NULL );
-        }
-
-        if( mbedtlsError != 0 )
-        {
-            LogError( ( "Failed to set server name: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+            mbedtls_x509_crt_init( &( pCertificate->certificate ) );
+            ( void ) memcpy( pCertificate->key, key, sizeof( key ) );
+            pCertificate->references = 1U;
 
-            returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
-        }
-    }
+            mbedtlsError = mbedtls_x509_crt_parse( &( pCertificate->certificate ),
+                                                   pRootCa,
+                                                   rootCaSize );
 
-    /* Set Maximum Fragment Length if enabled. */
-    #ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
-        if( returnStatus == TLS_TRANSPORT_SUCCESS )
-        {
-            /* Enable the max fragment extension. 4096 bytes is currently the largest fragment size permitted.
-             * See RFC 8449 https://tools.ietf.org/html/rfc8449 for more information.
-             *
-             * Smaller values can be found in "mbedtls/include/ssl.h".
-             */
-            mbedtlsError = mbedtls_ssl_conf_max_frag_len( &( pTlsTransportParams->sslContext.config ), MBEDTLS_SSL_MAX_FRAG_LEN_4096 );
+            /* RootCA certificate verification. The server public key it extracts stays
+             * valid until another root CA is verified, so it is done once per root CA. */
+            if( mbedtlsError == 0 )
+            {
+                p_tmprsa = mbedtls_pk_rsa( pCertificate->certificate.pk );
+                p_raw = ( uint8_t * ) pCertificate->certificate.raw.p;
+                mbedtlsError = R_TSIP_TlsRootCertificateVerification(
+                                (uint32_t)R_TSIP_TLS_PUBLIC_KEY_TYPE_RSA2048, // 0 : RSA 2048bit
+                                p_raw, //
+                                (uint32_t)pCertificate->certificate.raw.len, //
+                                (uint32_t)(p_tmprsa->pubkey_n_spos + 1) - (uint32_t)p_raw, //
+                                (uint32_t)(p_tmprsa->pubkey_n_spos - (uint32_t)p_raw) + (p_tmprsa->pubkey_n_epos - 1), //
+                                (uint32_t)p_tmprsa->pubkey_e_spos - (uint32_t)p_raw, //
+                                (uint32_t)(p_tmprsa->pubkey_e_spos - (uint32_t)p_raw) + (p_tmprsa->pubkey_e_epos - 1), //
+                                (uint8_t *)trust_ca_root_rsa_certificate_signature, //
+                                &tsip_rootca_rsa_pubkey[tsip_rootca_rsa_pubkey_scnt][0]);
+
+                if( TSIP_SUCCESS != mbedtlsError )
+                {
+                    LogError( ( "Failed to RootCA certificate verification" ) );
+                }
+            }
 
-            if( mbedtlsError != 0 )
+            if( mbedtlsError == 0 )
             {
-                LogError( ( "Failed to maximum fragment length extension: mbedTLSError= %s : %s.",
-                            mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                            mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
-                returnStatus = TLS_TRANSPORT_INTERNAL_ERROR;
+                shareCertificate( &pSharedRootCa, pCertificate );
+            }
+            else
+            {
+                releaseCertificate( pCertificate );
+                pCertificate = NULL;
             }
         }
-    #endif /* ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+    }
 
-    if( returnStatus == TLS_TRANSPORT_SUCCESS )
+    if( mbedtlsError != 0 )
     {
-        /* Perform the TLS handshake. */
-        do
-        {
-            mbedtlsError = mbedtls_ssl_handshake( &( pTlsTransportParams->sslContext.context ) );
-        } while( ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_READ ) ||
-                 ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_WRITE ) );
-
-        if( mbedtlsError != 0 )
-        {
-            LogError( ( "Failed to perform TLS handshake: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+        LogError( ( "Failed to parse server root CA certificate: mbedTLSError= %s : %s.",
+                    mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                    mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
 
-            returnStatus = TLS_TRANSPORT_HANDSHAKE_FAILED;
-        }
+        returnStatus = TLS_TRANSPORT_INVALID_CREDENTIALS;
     }
 
-    if( returnStatus != TLS_TRANSPORT_SUCCESS )
+    pSslContext->pRootCa = pCertificate;
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV loadClientCertificate( SSLContext_t * pSslContext,
+                                    const char * pcLabelName )
+{
+    CK_RV xResult = CKR_OK;
+    TlsCertificate_t * pCertificate = NULL;
+    uint8_t key[ TLS_CERTIFICATE_KEY_SIZE ];
+
+    if( mbedtls_sha256( ( const unsigned char * ) pcLabelName,
+                        strnlen( pcLabelName, pkcs11configMAX_LABEL_LENGTH ),
+                        key,
+                        0 ) != 0 )
     {
-        sslContextFree( &( pTlsTransportParams->sslContext ) );
+        xResult = CKR_FUNCTION_FAILED;
     }
     else
     {
-        LogInfo( ( "(Network connection %p) TLS handshake successful.",
-                   pNetworkContext ) );
+        pCertificate = findCertificate( &pSharedClientCert, key );
     }
 
-    return returnStatus;
+    if( ( xResult == CKR_OK ) && ( pCertificate == NULL ) )
+    {
+        xResult = readCertificateIntoContext( pSslContext,
+                                              pcLabelName,
+                                              CKO_CERTIFICATE,
+                                              &pCertificate );
+
+        if( xResult == CKR_OK )
+        {
+            ( void ) memcpy( pCertificate->key, key, sizeof( key ) );
+            shareCertificate( &pSharedClientCert, pCertificate );
+        }
+    }
+
+    pSslContext->pClientCert = pCertificate;
+
+    return xResult;
 }
 
 /*-----------------------------------------------------------*/
@@ -552,11 +1690,12 @@ static int generateRandomBytes( void * pvCtx,
 static CK_RV readCertificateIntoContext( SSLContext_t * pSslContext,
                                          const char * pcLabelName,
                                          CK_OBJECT_CLASS xClass,
-                                         mbedtls_x509_crt * pxCertificateContext )
+                                         TlsCertificate_t ** ppCertificate )
 {
     CK_RV xResult = CKR_OK;
     CK_ATTRIBUTE xTemplate = { 0 };
     CK_OBJECT_HANDLE xCertObj = 0;
+    TlsCertificate_t * pCertificate = NULL;
 
     /* Get the handle of the certificate. */
     xResult = xFindObjectWithLabelAndClass( pSslContext->xP11Session,
@@ -583,15 +1722,21 @@ static CK_RV readCertificateIntoContext( SSLContext_t * pSslContext,
                                                                        1 );
     }
 
-    /* Create a buffer for the certificate. */
+    /* Create the certificate, followed by the DER buffer it is parsed from. */
     if( CKR_OK == xResult )
     {
-        xTemplate.pValue = pvPortMalloc( xTemplate.ulValueLen );
+        pCertificate = pvPortMalloc( sizeof( TlsCertificate_t ) + xTemplate.ulValueLen );
 
-        if( NULL == xTemplate.pValue )
+        if( NULL == pCertificate )
         {
             xResult = CKR_HOST_MEMORY;
         }
+        else
+        {
+            mbedtls_x509_crt_init( &( pCertificate->certificate ) );
+            pCertificate->references = 1U;
+            xTemplate.pValue = &pCertificate[ 1 ];
+        }
     }
 
     /* Export the certificate. */
@@ -603,18 +1748,22 @@ static CK_RV readCertificateIntoContext( SSLContext_t * pSslContext,
                                                                        1 );
     }
 
-    /* Decode the certificate. */
+    /* Decode the certificate without copying it, the buffer lives as long as the certificate. */
     if( CKR_OK == xResult )
     {
-        xResult = mbedtls_x509_crt_parse( pxCertificateContext,
-                                          ( const unsigned char * ) xTemplate.pValue,
-                                          xTemplate.ulValueLen );
+        xResult = mbedtls_x509_crt_parse_der_nocopy( &( pCertificate->certificate ),
+                                                     ( const unsigned char * ) xTemplate.pValue,
+                                                     xTemplate.ulValueLen );
     }
 
-    /* Free memory. */
-    if( xTemplate.pValue != NULL )
+    if( CKR_OK == xResult )
+    {
+        *ppCertificate = pCertificate;
+    }
+    else
     {
-        vPortFree( xTemplate.pValue );
+        /* Free memory. */
+        releaseCertificate( pCertificate );
     }
 
     return xResult;
@@ -766,7 +1915,10 @@ TlsTransportStatus_t TLS_FreeRTOS_Connect( NetworkContext_t * pNetworkContext,
     /* Perform TLS handshake. */
     if( returnStatus == TLS_TRANSPORT_SUCCESS )
     {
-        returnStatus = tlsSetup( pNetworkContext, pHostName, pNetworkCredentials );
+        pTlsTransportParams->bytesSent = 0U;
+        pTlsTransportParams->bytesReceived = 0U;
+
+        returnStatus = tlsSetup( pNetworkContext, pHostName, port, pNetworkCredentials );
     }
 
     /* Clean up on failure. */
@@ -820,6 +1972,12 @@ void TLS_FreeRTOS_Disconnect( NetworkContext_t * pNetworkContext )
 
         /* Free mbed TLS contexts. */
         sslContextFree( &( pTlsTransportParams->sslContext ) );
+
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            /* Anything mbed TLS still held in the arena goes with it. */
+            tlsArenaRelease( pTlsTransportParams->pArena );
+            pTlsTransportParams->pArena = NULL;
+        #endif
     }
 }
 
@@ -832,6 +1990,10 @@ int32_t TLS_FreeRTOS_recv( NetworkContext_t * pNetworkContext,
     TlsTransportParams_t * pTlsTransportParams = NULL;
     int32_t tlsStatus = 0;
 
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        TlsArena_t * pPreviousArena = NULL;
+    #endif
+
     if( ( pNetworkContext == NULL ) || ( pNetworkContext->pParams == NULL ) )
     {
         LogError( ( "invalid input, pNetworkContext=%p", pNetworkContext ) );
@@ -851,10 +2013,18 @@ int32_t TLS_FreeRTOS_recv( NetworkContext_t * pNetworkContext,
     {
         pTlsTransportParams = pNetworkContext->pParams;
 
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            pPreviousArena = tlsArenaBind( pTlsTransportParams->pArena );
+        #endif
+
         tlsStatus = ( int32_t ) mbedtls_ssl_read( &( pTlsTransportParams->sslContext.context ),
                                                   pBuffer,
                                                   bytesToRecv );
 
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            ( void ) tlsArenaBind( pPreviousArena );
+        #endif
+
         if( ( tlsStatus == MBEDTLS_ERR_SSL_TIMEOUT ) ||
             ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
             ( tlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) )
@@ -892,6 +2062,10 @@ int32_t TLS_FreeRTOS_send( NetworkContext_t * pNetworkContext,
     TlsTransportParams_t * pTlsTransportParams = NULL;
     int32_t tlsStatus = 0;
 
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        TlsArena_t * pPreviousArena = NULL;
+    #endif
+
     if( ( pNetworkContext == NULL ) || ( pNetworkContext->pParams == NULL ) )
     {
         LogError( ( "invalid input, pNetworkContext=%p", pNetworkContext ) );
@@ -910,10 +2084,18 @@ int32_t TLS_FreeRTOS_send( NetworkContext_t * pNetworkContext,
     else
     {
         pTlsTransportParams = pNetworkContext->pParams;
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            pPreviousArena = tlsArenaBind( pTlsTransportParams->pArena );
+        #endif
+
         tlsStatus = ( int32_t ) mbedtls_ssl_write( &( pTlsTransportParams->sslContext.context ),
                                                    pBuffer,
                                                    bytesToSend );
 
+        #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+            ( void ) tlsArenaBind( pPreviousArena );
+        #endif
+
         if( ( tlsStatus == MBEDTLS_ERR_SSL_TIMEOUT ) ||
             ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
             ( tlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) )
@@ -935,10 +2117,293 @@ int32_t TLS_FreeRTOS_send( NetworkContext_t * pNetworkContext,
         }
         else
         {
-            /* Empty else marker. */
+            /* mbedtls_ssl_write() sends at most one record per call. */
+            taskENTER_CRITICAL();
+            {
+                transportStats.recordsSent++;
+                transportStats.applicationBytesSent += ( uint32_t ) tlsStatus;
+            }
+            taskEXIT_CRITICAL();
+        }
+    }
+
+    return tlsStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t TLS_FreeRTOS_writev( NetworkContext_t * pNetworkContext,
+                             TransportOutVector_t * pIoVec,
+                             size_t ioVecCount )
+{
+    TlsTransportParams_t * pTlsTransportParams = NULL;
+    int32_t tlsStatus = 0;
+    size_t gathered = 0U;
+    size_t i = 0U;
+
+    if( ( pNetworkContext == NULL ) || ( pNetworkContext->pParams == NULL ) )
+    {
+        LogError( ( "invalid input, pNetworkContext=%p", pNetworkContext ) );
+        tlsStatus = -1;
+    }
+    else if( ( pIoVec == NULL ) || ( ioVecCount == 0U ) )
+    {
+        LogError( ( "invalid input, pIoVec=%p, ioVecCount=%u", pIoVec, ( unsigned int ) ioVecCount ) );
+        tlsStatus = -1;
+    }
+    else
+    {
+        pTlsTransportParams = pNetworkContext->pParams;
+
+        /* Gather the leading fragments that fit, so they share a record. */
+        while( ( i < ioVecCount ) &&
+               ( pIoVec[ i ].iov_len <= ( sizeof( pTlsTransportParams->writevBuffer ) - gathered ) ) )
+        {
+            if( pIoVec[ i ].iov_len > 0U )
+            {
+                ( void ) memcpy( &( pTlsTransportParams->writevBuffer[ gathered ] ),
+                                 pIoVec[ i ].iov_base,
+                                 pIoVec[ i ].iov_len );
+                gathered += pIoVec[ i ].iov_len;
+            }
+
+            i++;
+        }
+
+        if( gathered > 0U )
+        {
+            /* A partial send covers a prefix of the fragments, as the caller expects. */
+            tlsStatus = TLS_FreeRTOS_send( pNetworkContext,
+                                           pTlsTransportParams->writevBuffer,
+                                           gathered );
+        }
+        else if( i < ioVecCount )
+        {
+            /* The first fragment does not fit, it is sent without a copy. */
+            tlsStatus = TLS_FreeRTOS_send( pNetworkContext,
+                                           pIoVec[ i ].iov_base,
+                                           pIoVec[ i ].iov_len );
+        }
+        else
+        {
+            /* All fragments are empty. */
         }
     }
 
     return tlsStatus;
 }
+
+/*-----------------------------------------------------------*/
+
+void TLS_FreeRTOS_GetStats( TlsTransportStats_t * pStats )
+{
+    if( pStats != NULL )
+    {
+        taskENTER_CRITICAL();
+        {
+            *pStats = transportStats;
+        }
+        taskEXIT_CRITICAL();
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+TlsTransportStatus_t TLS_FreeRTOS_GetMemoryStats( NetworkContext_t * pNetworkContext,
+                                                  TlsTransportMemoryStats_t * pStats )
+{
+    TlsTransportStatus_t returnStatus = TLS_TRANSPORT_INVALID_PARAMETER;
+
+    #if ( TLS_TRANSPORT_ARENA_COUNT > 0 )
+        TlsArena_t * pArena = NULL;
+
+        if( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) && ( pStats != NULL ) )
+        {
+            pArena = pNetworkContext->pParams->pArena;
+        }
+
+        if( pArena != NULL )
+        {
+            vTaskSuspendAll();
+            {
+                pStats->arenaSize = sizeof( arenaMemory[ 0 ] );
+                pStats->currentBytes = pArena->currentBytes;
+                pStats->peakBytes = pArena->peakBytes;
+                pStats->steadyStateBytes = pArena->steadyStateBytes;
+                pStats->heapFallbacks = pArena->heapFallbacks;
+            }
+            ( void ) xTaskResumeAll();
+
+            returnStatus = TLS_TRANSPORT_SUCCESS;
+        }
+    #else /* if ( TLS_TRANSPORT_ARENA_COUNT > 0 ) */
+        ( void ) pNetworkContext;
+        ( void ) pStats;
+    #endif /* if ( TLS_TRANSPORT_ARENA_COUNT > 0 ) */
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void TLS_FreeRTOS_InvalidateCredentials( void )
+{
+    TlsCertificate_t * pRootCa = NULL;
+    TlsCertificate_t * pClientCert = NULL;
+
+    vTaskSuspendAll();
+    {
+        pRootCa = pSharedRootCa;
+        pClientCert = pSharedClientCert;
+        pSharedRootCa = NULL;
+        pSharedClientCert = NULL;
+    }
+    ( void ) xTaskResumeAll();
+
+    /* Open connections keep their references. */
+    releaseCertificate( pRootCa );
+    releaseCertificate( pClientCert );
+
+    /* The cached session was authenticated with the old credentials. */
+    TLS_FreeRTOS_ClearSession();
+}
+
+/*-----------------------------------------------------------*/
+
+void TLS_FreeRTOS_ClearSession( void )
+{
+    #if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+        vTaskSuspendAll();
+        {
+            mbedtls_ssl_session_free( &( sessionCache.session ) );
+            sessionCache.valid = pdFALSE;
+        }
+        ( void ) xTaskResumeAll();
+    #endif
+}
+
+/*-----------------------------------------------------------*/
+
+TlsTransportStatus_t TLS_FreeRTOS_SaveSession( unsigned char * pBuffer,
+                                               size_t bufferSize,
+                                               size_t * pLength )
+{
+    TlsTransportStatus_t returnStatus = TLS_TRANSPORT_INVALID_PARAMETER;
+
+    #if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+        size_t hostLength;
+        size_t sessionLength = 0U;
+        uint32_t magic = TLS_SESSION_MAGIC;
+        uint32_t ageMs;
+        int32_t mbedtlsError;
+
+        if( pLength != NULL )
+        {
+            vTaskSuspendAll();
+            {
+                if( sessionCache.valid == pdTRUE )
+                {
+                    hostLength = strlen( sessionCache.hostName );
+
+                    /* Query the size of the session first. */
+                    ( void ) mbedtls_ssl_session_save( &( sessionCache.session ), NULL, 0U, &sessionLength );
+                    *pLength = TLS_SESSION_HEADER_SIZE + hostLength + sessionLength;
+
+                    if( ( pBuffer == NULL ) || ( bufferSize < *pLength ) )
+                    {
+                        returnStatus = TLS_TRANSPORT_INSUFFICIENT_MEMORY;
+                    }
+                    else
+                    {
+                        ( void ) memcpy( pBuffer, &magic, sizeof( magic ) );
+                        ( void ) memcpy( &pBuffer[ 4 ], &( sessionCache.port ), sizeof( uint16_t ) );
+                        pBuffer[ 6 ] = ( unsigned char ) hostLength;
+                        pBuffer[ 7 ] = 0U;
+                        ageMs = ( uint32_t ) ( ( xTaskGetTickCount() - sessionCache.fullHandshakeTime ) * portTICK_PERIOD_MS );
+                        ( void ) memcpy( &pBuffer[ 8 ], &ageMs, sizeof( ageMs ) );
+                        ( void ) memcpy( &pBuffer[ 12 ], sessionCache.rootCaKey, TLS_CERTIFICATE_KEY_SIZE );
+                        ( void ) memcpy( &pBuffer[ 12U + TLS_CERTIFICATE_KEY_SIZE ], sessionCache.clientCertKey, TLS_CERTIFICATE_KEY_SIZE );
+                        ( void ) memcpy( &pBuffer[ TLS_SESSION_HEADER_SIZE ], sessionCache.hostName, hostLength );
+
+                        mbedtlsError = mbedtls_ssl_session_save( &( sessionCache.session ),
+                                                                 &pBuffer[ TLS_SESSION_HEADER_SIZE + hostLength ],
+                                                                 sessionLength,
+                                                                 &sessionLength );
+                        returnStatus = ( mbedtlsError == 0 ) ? TLS_TRANSPORT_SUCCESS : TLS_TRANSPORT_INTERNAL_ERROR;
+                    }
+                }
+            }
+            ( void ) xTaskResumeAll();
+        }
+    #else /* if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 ) */
+        ( void ) pBuffer;
+        ( void ) bufferSize;
+        ( void ) pLength;
+    #endif /* if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 ) */
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+TlsTransportStatus_t TLS_FreeRTOS_LoadSession( const unsigned char * pBuffer,
+                                               size_t length )
+{
+    TlsTransportStatus_t returnStatus = TLS_TRANSPORT_INVALID_PARAMETER;
+
+    #if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 )
+        mbedtls_ssl_session session;
+        uint32_t magic = 0U;
+        uint16_t port = 0U;
+        size_t hostLength = 0U;
+        uint32_t ageMs = 0U;
+
+        if( ( pBuffer != NULL ) && ( length > TLS_SESSION_HEADER_SIZE ) )
+        {
+            ( void ) memcpy( &magic, pBuffer, sizeof( magic ) );
+            ( void ) memcpy( &port, &pBuffer[ 4 ], sizeof( port ) );
+            hostLength = pBuffer[ 6 ];
+            ( void ) memcpy( &ageMs, &pBuffer[ 8 ], sizeof( ageMs ) );
+        }
+
+        /* The age was taken when the session was saved, time spent powered off is not known. */
+        if( ( magic == TLS_SESSION_MAGIC ) &&
+            ( ageMs < TLS_TRANSPORT_SESSION_LIFETIME_MS ) &&
+            ( hostLength <= TLS_TRANSPORT_SESSION_HOST_MAX_LENGTH ) &&
+            ( length > ( TLS_SESSION_HEADER_SIZE + hostLength ) ) )
+        {
+            mbedtls_ssl_session_init( &session );
+
+            if( mbedtls_ssl_session_load( &session,
+                                          &pBuffer[ TLS_SESSION_HEADER_SIZE + hostLength ],
+                                          length - TLS_SESSION_HEADER_SIZE - hostLength ) == 0 )
+            {
+                vTaskSuspendAll();
+                {
+                    mbedtls_ssl_session_free( &( sessionCache.session ) );
+                    sessionCache.session = session;
+                    ( void ) memcpy( sessionCache.hostName, &pBuffer[ TLS_SESSION_HEADER_SIZE ], hostLength );
+                    sessionCache.hostName[ hostLength ] = '\0';
+                    sessionCache.port = port;
+                    ( void ) memcpy( sessionCache.rootCaKey, &pBuffer[ 12 ], TLS_CERTIFICATE_KEY_SIZE );
+                    ( void ) memcpy( sessionCache.clientCertKey, &pBuffer[ 12U + TLS_CERTIFICATE_KEY_SIZE ], TLS_CERTIFICATE_KEY_SIZE );
+                    sessionCache.fullHandshakeTime = xTaskGetTickCount() - pdMS_TO_TICKS( ageMs );
+                    sessionCache.valid = pdTRUE;
+                }
+                ( void ) xTaskResumeAll();
+
+                returnStatus = TLS_TRANSPORT_SUCCESS;
+            }
+            else
+            {
+                mbedtls_ssl_session_free( &session );
+            }
+        }
+    #else /* if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 ) */
+        ( void ) pBuffer;
+        ( void ) length;
+    #endif /* if ( TLS_TRANSPORT_SESSION_RESUMPTION == 1 ) */
+
+    return returnStatus;
+}
 /*-----------------------------------------------------------*/
@@ -60,6 +60,117 @@
 /* PKCS #11 includes. */
 #include "core_pkcs11.h"
 
+/**
+ * @brief Keep the TLS session of the last successful handshake and offer it on the
+ * next connection to the same host and port with the same root CA and client certificate.
+ *
+ * When the server accepts it, the handshake is abbreviated: no certificate is sent
+ * or verified and the client key is not used, so a reconnect takes a single round
+ * trip. Both session IDs and RFC 5077 session tickets are offered. A session the
+ * server declines falls back to a full handshake.
+ * Set to 0 to always perform a full handshake.
+ */
+#ifndef TLS_TRANSPORT_SESSION_RESUMPTION
+    #define TLS_TRANSPORT_SESSION_RESUMPTION    ( 1 )
+#endif
+
+/**
+ * @brief Time after which a cached session is no longer offered.
+ */
+#ifndef TLS_TRANSPORT_SESSION_LIFETIME_MS
+    #define TLS_TRANSPORT_SESSION_LIFETIME_MS    ( 60U * 60U * 1000U )
+#endif
+
+/**
+ * @brief Longest host name for which a session is cached.
+ */
+#ifndef TLS_TRANSPORT_SESSION_HOST_MAX_LENGTH
+    #define TLS_TRANSPORT_SESSION_HOST_MAX_LENGTH    ( 128U )
+#endif
+
+/**
+ * @brief Name of the file in which the application keeps the session saved by
+ * TLS_FreeRTOS_SaveSession(). Code changing the stored credentials removes it.
+ */
+#ifndef TLS_TRANSPORT_SESSION_FILE_NAME
+    #define TLS_TRANSPORT_SESSION_FILE_NAME    "tls_session"
+#endif
+
+/**
+ * @brief Size of the buffer gathering the fragments passed to TLS_FreeRTOS_writev(),
+ * so that a small packet handed over in pieces is sent as a single TLS record.
+ */
+#ifndef TLS_TRANSPORT_WRITEV_BUFFER_SIZE
+    #define TLS_TRANSPORT_WRITEV_BUFFER_SIZE    ( 512U )
+#endif
+
+/**
+ * @brief Maximum fragment length, in bytes, negotiated by connections that leave
+ * NetworkCredentials_t.maxFragmentLength at 0.
+ *
+ * One of 512, 1024, 2048 or 4096 requests the RFC 6066 max_fragment_length
+ * extension; 16384 does not request it. Smaller records cost more overhead per byte
+ * but, with MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH, let mbed TLS shrink the record buffers
+ * of the connection to the negotiated length after the handshake.
+ */
+#ifndef TLS_TRANSPORT_MAX_FRAGMENT_LENGTH
+    #define TLS_TRANSPORT_MAX_FRAGMENT_LENGTH    ( 4096U )
+#endif
+
+/**
+ * @brief Number of connections whose mbed TLS allocations are served from a static
+ * arena instead of the heap.
+ *
+ * The record buffers and handshake state of such a connection are carved out of
+ * its arena, which is released at once on disconnect, so connections neither
+ * fragment the heap nor fail on it after a long uptime. Allocations that do not fit
+ * fall back to the heap and are counted. Certificates and sessions shared between
+ * connections always stay on the heap, which is the FreeRTOS heap when
+ * CONFIG_MEDTLS_USE_AFR_MEMORY routes mbed TLS through CRYPTO_SetAllocator().
+ * Set to 0 to allocate everything from the heap.
+ */
+#ifndef TLS_TRANSPORT_ARENA_COUNT
+    #define TLS_TRANSPORT_ARENA_COUNT    ( 0 )
+#endif
+
+/**
+ * @brief Arena memory used by the handshake besides the record buffers:
+ * key exchange, peer certificate chain and transforms.
+ */
+#ifndef TLS_TRANSPORT_ARENA_WORKING_SIZE
+    #define TLS_TRANSPORT_ARENA_WORKING_SIZE    ( 24U * 1024U )
+#endif
+
+/**
+ * @brief Size of each arena.
+ *
+ * The record buffers follow MBEDTLS_SSL_IN_CONTENT_LEN and MBEDTLS_SSL_OUT_CONTENT_LEN,
+ * so lowering them to the negotiated maximum fragment length (4096) shrinks the arena.
+ * Compare with the peak reported by TLS_FreeRTOS_GetMemoryStats() when tuning it.
+ */
+#ifndef TLS_TRANSPORT_ARENA_SIZE
+    #define TLS_TRANSPORT_ARENA_SIZE                                           \
+    ( MBEDTLS_SSL_IN_CONTENT_LEN + MBEDTLS_SSL_OUT_CONTENT_LEN + ( 2U * 512U ) + \
+      TLS_TRANSPORT_ARENA_WORKING_SIZE )
+#endif
+
+/**
+ * @brief Thread local storage pointer binding the arena to the task calling mbed TLS.
+ */
+#ifndef TLS_TRANSPORT_ARENA_TLS_INDEX
+    #define TLS_TRANSPORT_ARENA_TLS_INDEX    ( configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1 )
+#endif
+
+/**
+ * @brief Certificate parsed once and shared by all connections.
+ */
+typedef struct TlsCertificate TlsCertificate_t;
+
+/**
+ * @brief Static memory serving the mbed TLS allocations of a connection.
+ */
+typedef struct TlsArena TlsArena_t;
+
 /**
  * @brief Secured connection context.
  */
@@ -68,10 +179,11 @@ typedef struct SSLContext
     mbedtls_ssl_config config;            /**< @brief SSL connection configuration. */
     mbedtls_ssl_context context;          /**< @brief SSL connection context */
     mbedtls_x509_crt_profile certProfile; /**< @brief Certificate security profile for this connection. */
-    mbedtls_x509_crt rootCa;              /**< @brief Root CA certificate context. */
-    mbedtls_x509_crt clientCert;          /**< @brief Client certificate context. */
+    TlsCertificate_t * pRootCa;           /**< @brief Shared root CA certificate. */
+    TlsCertificate_t * pClientCert;       /**< @brief Shared client certificate. */
     mbedtls_pk_context privKey;           /**< @brief Client private key context. */
     mbedtls_pk_info_t privKeyInfo;        /**< @brief Client private key info. */
+    BaseType_t certificateVerified;       /**< @brief The handshake verified the server certificate. */
 
     /* PKCS#11. */
     CK_FUNCTION_LIST_PTR pxP11FunctionList;
@@ -87,6 +199,10 @@ typedef struct TlsTransportParams
 {
     Socket_t tcpSocket;
     SSLContext_t sslContext;
+    uint32_t bytesSent;     /**< @brief Bytes sent on tcpSocket. */
+    uint32_t bytesReceived; /**< @brief Bytes received on tcpSocket. */
+    TlsArena_t * pArena;    /**< @brief Arena of the connection, NULL if it uses the heap. */
+    uint8_t writevBuffer[ TLS_TRANSPORT_WRITEV_BUFFER_SIZE ]; /**< @brief Fragments gathered by TLS_FreeRTOS_writev(). */
 } TlsTransportParams_t;
 
 /**
@@ -117,6 +233,12 @@ typedef struct NetworkCredentials
     size_t passwordSize;             /**< @brief Size associated with #NetworkCredentials.pPassword. */
     const char * pClientCertLabel;   /**< @brief PKCS #11 label string of the client certificate. */
     const char * pPrivateKeyLabel;   /**< @brief PKCS #11 label for the private key. */
+
+    /**
+     * @brief Maximum fragment length to negotiate in bytes: 512, 1024, 2048, 4096, or
+     * 16384 for none. 0 selects #TLS_TRANSPORT_MAX_FRAGMENT_LENGTH.
+     */
+    uint16_t maxFragmentLength;
 } NetworkCredentials_t;
 
 /**
@@ -133,6 +255,35 @@ typedef enum TlsTransportStatus
     TLS_TRANSPORT_CONNECT_FAILURE      /**< Initial connection to the server failed. */
 } TlsTransportStatus_t;
 
+/**
+ * @brief Handshake statistics of the TLS transport.
+ */
+typedef struct TlsTransportStats
+{
+    uint32_t fullHandshakes;             /**< @brief Handshakes that verified the server certificate. */
+    uint32_t resumedHandshakes;          /**< @brief Handshakes that resumed a cached session. */
+    uint32_t failedHandshakes;           /**< @brief Handshakes that failed. */
+    uint32_t lastHandshakeMs;            /**< @brief Duration of the last successful handshake. */
+    uint32_t lastHandshakeBytesSent;     /**< @brief Bytes sent on the TCP connection by the last successful handshake. */
+    uint32_t lastHandshakeBytesReceived; /**< @brief Bytes received on the TCP connection by the last successful handshake. */
+    uint32_t totalHandshakeMs;           /**< @brief Duration of all successful handshakes. */
+    uint32_t totalHandshakeBytes;        /**< @brief Bytes sent and received by all successful handshakes. */
+    uint32_t recordsSent;                /**< @brief Application data records sent. */
+    uint32_t applicationBytesSent;       /**< @brief Application data bytes sent in these records. */
+} TlsTransportStats_t;
+
+/**
+ * @brief Arena usage of a TLS connection.
+ */
+typedef struct TlsTransportMemoryStats
+{
+    size_t arenaSize;        /**< @brief Size of the arena. */
+    size_t currentBytes;     /**< @brief Bytes allocated from the arena now. */
+    size_t peakBytes;        /**< @brief Most bytes allocated from the arena, reached during the handshake. */
+    size_t steadyStateBytes; /**< @brief Bytes allocated from the arena once the handshake completed. */
+    uint32_t heapFallbacks;  /**< @brief Allocations that did not fit in the arena and used the heap. */
+} TlsTransportMemoryStats_t;
+
 /**
  * @brief Create a TLS connection with FreeRTOS sockets.
  *
@@ -197,4 +348,89 @@ int32_t TLS_FreeRTOS_send( NetworkContext_t * pNetworkContext,
                            const void * pBuffer,
                            size_t bytesToSend );
 
+/**
+ * @brief Sends the fragments of a packet over an established TLS connection.
+ *
+ * This is the TLS version of the transport interface's
+ * #TransportWritev_t function. The leading fragments that fit in
+ * #TLS_TRANSPORT_WRITEV_BUFFER_SIZE are gathered and sent as one TLS record,
+ * instead of one record per fragment, e.g. for the header, topic and payload
+ * of an MQTT PUBLISH. A fragment larger than the buffer is sent on its own.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[in] pIoVec Fragments to send.
+ * @param[in] ioVecCount Number of fragments.
+ *
+ * @return Number of bytes (> 0) sent from the start of the fragments on success;
+ * 0 if the socket times out without sending any bytes;
+ * else a negative value to represent error.
+ */
+int32_t TLS_FreeRTOS_writev( NetworkContext_t * pNetworkContext,
+                             TransportOutVector_t * pIoVec,
+                             size_t ioVecCount );
+
+/**
+ * @brief Get the handshake statistics of the TLS transport.
+ *
+ * @param[out] pStats Statistics.
+ */
+void TLS_FreeRTOS_GetStats( TlsTransportStats_t * pStats );
+
+/**
+ * @brief Get the arena usage of a TLS connection.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pStats Statistics.
+ *
+ * @return #TLS_TRANSPORT_SUCCESS, or #TLS_TRANSPORT_INVALID_PARAMETER if the
+ * connection does not use an arena.
+ */
+TlsTransportStatus_t TLS_FreeRTOS_GetMemoryStats( NetworkContext_t * pNetworkContext,
+                                                  TlsTransportMemoryStats_t * pStats );
+
+/**
+ * @brief Drop the shared root CA and client certificates, so the next connection
+ * parses them again, and forget the cached TLS session. Call it when the stored
+ * certificates change.
+ *
+ * Open connections keep the certificates they were set up with.
+ */
+void TLS_FreeRTOS_InvalidateCredentials( void );
+
+/**
+ * @brief Forget the cached TLS session, so the next connection performs a full handshake.
+ */
+void TLS_FreeRTOS_ClearSession( void );
+
+/**
+ * @brief Serialize the cached TLS session, e.g. to keep it across a reset.
+ *
+ * @note The buffer holds the session master secret and must be stored like a private key.
+ * It also holds the age of the session, which does not advance while it is stored.
+ *
+ * @param[out] pBuffer Buffer for the session, NULL to query the size.
+ * @param[in] bufferSize Size of pBuffer.
+ * @param[out] pLength Length of the serialized session.
+ *
+ * @return #TLS_TRANSPORT_SUCCESS, #TLS_TRANSPORT_INVALID_PARAMETER if no session is cached,
+ * or #TLS_TRANSPORT_INSUFFICIENT_MEMORY if pBuffer is too small (pLength is set to the size needed).
+ */
+TlsTransportStatus_t TLS_FreeRTOS_SaveSession( unsigned char * pBuffer,
+                                               size_t bufferSize,
+                                               size_t * pLength );
+
+/**
+ * @brief Cache a TLS session serialized by TLS_FreeRTOS_SaveSession().
+ *
+ * A session older than #TLS_TRANSPORT_SESSION_LIFETIME_MS is not loaded, otherwise
+ * it expires when its saved age plus the time since loading reaches the lifetime.
+ *
+ * @param[in] pBuffer Serialized session.
+ * @param[in] length Length of pBuffer.
+ *
+ * @return #TLS_TRANSPORT_SUCCESS or #TLS_TRANSPORT_INVALID_PARAMETER if the session cannot be loaded.
+ */
+TlsTransportStatus_t TLS_FreeRTOS_LoadSession( const unsigned char * pBuffer,
+                                               size_t length );
+
 #endif /* ifndef TRANSPORT_MBEDTLS_PKCS11 */
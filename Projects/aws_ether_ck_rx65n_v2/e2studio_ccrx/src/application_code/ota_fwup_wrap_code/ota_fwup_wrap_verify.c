@@ -46,6 +46,13 @@ int32_t ota_sha256_init_function(void * vp_ctx)
 {
     (void) vp_ctx;
 
+    /* Release the context of a hash that was never finished, e.g. of an aborted download. */
+    if (NULL != s_ctx_iot)
+    {
+        (void) CRYPTO_SignatureVerificationFinal(s_ctx_iot, NULL, 0, NULL, 0);
+        s_ctx_iot = NULL;
+    }
+
     if (pdFALSE == CRYPTO_SignatureVerificationStart( &s_ctx_iot,
                                                 cryptoASYMMETRIC_ALGORITHM_ECDSA,
                                                 cryptoHASH_ALGORITHM_SHA256 ) )
@@ -135,9 +142,14 @@ int32_t ota_verify_ecdsa_function(uint8_t *p_hash, uint8_t *p_sig_type, uint8_t
     }
     else
     {
-        if ( CRYPTO_SignatureVerificationFinal( s_ctx_iot, ( char * ) pucSignerCert, ulSignerCertSize,
+        BaseType_t xVerified = CRYPTO_SignatureVerificationFinal( s_ctx_iot, ( char * ) pucSignerCert, ulSignerCertSize,
                 /* Cast to type "uint8_t *" to be compatible with parameter type */
-                (uint8_t *)pOTAFileContext->signature, pOTAFileContext->signatureLen ) == pdFALSE )
+                (uint8_t *)pOTAFileContext->signature, pOTAFileContext->signatureLen );
+
+        /* The context is freed by CRYPTO_SignatureVerificationFinal() */
+        s_ctx_iot = NULL;
+
+        if ( xVerified == pdFALSE )
         {
             LogError( ( "Finished %s signature verification, but signature verification failed",
                         VERIFICATION_SCHEME_ECDSA ) );
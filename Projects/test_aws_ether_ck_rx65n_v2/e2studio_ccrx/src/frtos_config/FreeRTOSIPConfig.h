@@ -80,6 +80,11 @@ out the application messages. */
  */
 #define ipconfigNUM_NETWORK_BUFFER_DESCRIPTORS    (ETHER_CFG_EMAC_TX_DESCRIPTORS)
 
+/* Let the Ethernet driver pass all frames received in one burst to the IP task
+ * as a single chain of network buffers, so that the IP task is woken once per
+ * burst rather than once per frame. */
+#define ipconfigUSE_LINKED_RX_MESSAGES    (1)
+
 /* Related to the macro 'ipconfigEVENT_QUEUE_LENGTH' here above:
  * when developing a new networking application, it can be helpful
  * to monitor the length of the message queue of the IP-task.
@@ -0,0 +1,267 @@
+""" Creates encoded OTA files for Demos/OtaOverMqtt/ota_image_decoder.c.
+
+A delta file rebuilds the new image on the device from the running image (job fileType 1):
+
+    python ota_image_encoder.py --base old.rsu --target new.rsu -o new.delta --verify
+
+A compressed file rebuilds the new image from itself alone (job fileType 2):
+
+    python ota_image_encoder.py --compress --target new.rsu -o new.lz --verify
+
+--compress together with --base also compresses the parts of a delta that are not in the base.
+--base is the image the device runs, --target the image to install. Both are RSU files made by
+image-gen.py. The device rebuilds the target as its OTA file (the RSU file without the 0x200 byte
+header) and checks the signature of the job document over it, so the job must carry the signature
+of the target OTA file, not of the encoded file.
+
+--benchmark prints the size of each encoding of the target, the number of stream blocks to
+download and the encode and reference decode time. The decode time of the device is logged by
+the OTA demo.
+"""
+import argparse
+import math
+import struct
+import sys
+import time
+import zlib
+
+RSU_HEADER_SIZE = 0x200
+RSU_MAGIC_CODES = (b'RELFWV2', b'Renesas')
+DESC_SIZE = 256
+DESC_BLOCKS = 31
+
+CF_MAIN_AREA_ADDR = 0xFFF00000
+CF_MAIN_AREA_SIZE = 0xF0000
+
+MAGIC = b'RXIE'
+VERSION = 1
+HEADER_FORMAT = '<4sB3xIII'
+
+OP_LITERAL = 0x01
+OP_COPY_BASE = 0x02
+OP_COPY_OUTPUT = 0x03
+
+# OTA_IMAGE_WINDOW_SIZE of ota_image_decoder.h
+WINDOW_SIZE = 2048
+# mqttFileDownloader_CONFIG_BLOCK_SIZE of the projects
+STREAM_BLOCK_SIZE = 4096
+
+MAX_OP_LENGTH = 0xFFFF
+KEY_SIZE = 16
+KEY_STRIDE = 4
+MIN_MATCH = 24
+LZ_KEY_SIZE = 4
+LZ_MIN_MATCH = 6
+LZ_MAX_CHAIN = 32
+
+
+def load_ota_file(path):
+    """ Returns the OTA file of an RSU file: the descriptor followed by the regions. """
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:7] in RSU_MAGIC_CODES:
+        data = data[RSU_HEADER_SIZE:]
+    return data
+
+
+def copyable_size(ota_file):
+    """ Returns the size of the beginning of the OTA file that stays in the running bank.
+
+    The device reads the base from the code flash main area, so the base ends at the first
+    region outside of it (e.g. data flash, which the running firmware changes).
+    """
+    n = struct.unpack_from('<I', ota_file, 0)[0]
+    size = DESC_SIZE
+    for i in range(min(n, DESC_BLOCKS)):
+        addr, length = struct.unpack_from('<II', ota_file, 4 + i * 8)
+        if addr < CF_MAIN_AREA_ADDR or addr + length > CF_MAIN_AREA_ADDR + CF_MAIN_AREA_SIZE:
+            break
+        size += length
+    return min(size, len(ota_file))
+
+
+def emit_literal(out, data):
+    for pos in range(0, len(data), MAX_OP_LENGTH):
+        chunk = data[pos:pos + MAX_OP_LENGTH]
+        out += struct.pack('<BH', OP_LITERAL, len(chunk))
+        out += chunk
+
+
+def emit_copy(out, offset, length):
+    while length > 0:
+        chunk = min(length, MAX_OP_LENGTH)
+        out += struct.pack('<BIH', OP_COPY_BASE, offset, chunk)
+        offset += chunk
+        length -= chunk
+
+
+def emit_output(out, distance, length):
+    while length > 0:
+        chunk = min(length, MAX_OP_LENGTH)
+        out += struct.pack('<BHH', OP_COPY_OUTPUT, distance, chunk)
+        length -= chunk
+
+
+def match_length(target, pos, source, source_pos, limit):
+    length = 0
+    while (pos + length < limit and source_pos + length < len(source) and
+           target[pos + length] == source[source_pos + length]):
+        length += 1
+    return length
+
+
+def encode(base, target, compress):
+    """ Greedy matcher.
+
+    Sampled keys of the base are looked up at every target offset (rsync style). With compress,
+    the last WINDOW_SIZE bytes of the target are searched through hash chains as well (LZ77).
+    The longer match wins.
+    """
+    index = {}
+    for i in range(0, len(base) - KEY_SIZE + 1, KEY_STRIDE):
+        index.setdefault(base[i:i + KEY_SIZE], i)
+    chains = {}
+
+    def insert(upto):
+        while insert.next < upto and insert.next + LZ_KEY_SIZE <= len(target):
+            chains.setdefault(target[insert.next:insert.next + LZ_KEY_SIZE], []).append(insert.next)
+            insert.next += 1
+    insert.next = 0
+
+    out = bytearray(struct.pack(HEADER_FORMAT, MAGIC, VERSION, len(target), len(base), zlib.crc32(base)))
+    literal_start = 0
+    pos = 0
+    while pos + LZ_KEY_SIZE <= len(target):
+        best = None
+
+        base_pos = index.get(target[pos:pos + KEY_SIZE]) if pos + KEY_SIZE <= len(target) else None
+        if base_pos is not None:
+            end = pos + match_length(target, pos, base, base_pos, len(target))
+            start = pos
+            base_start = base_pos
+            while start > literal_start and base_start > 0 and target[start - 1] == base[base_start - 1]:
+                start -= 1
+                base_start -= 1
+            if end - start >= MIN_MATCH:
+                best = (OP_COPY_BASE, start, base_start, end)
+
+        if compress:
+            insert(pos)
+            for candidate in reversed(chains.get(target[pos:pos + LZ_KEY_SIZE], [])[-LZ_MAX_CHAIN:]):
+                if pos - candidate > WINDOW_SIZE:
+                    break
+                end = pos + match_length(target, pos, target, candidate, len(target))
+                if end - pos >= LZ_MIN_MATCH and (best is None or end - pos > best[3] - best[1]):
+                    best = (OP_COPY_OUTPUT, pos, pos - candidate, end)
+
+        if best is None:
+            pos += 1
+            continue
+
+        op, start, source, end = best
+        emit_literal(out, target[literal_start:start])
+        if op == OP_COPY_BASE:
+            emit_copy(out, source, end - start)
+        else:
+            emit_output(out, source, end - start)
+        literal_start = pos = end
+
+    emit_literal(out, target[literal_start:])
+    return bytes(out)
+
+
+def decode(encoded, base):
+    """ Reference decoder, same checks as ota_image_decoder.c. """
+    magic, version, output_size, base_size, base_crc = struct.unpack_from(HEADER_FORMAT, encoded, 0)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('bad header')
+    if base_size > len(base) or zlib.crc32(base[:base_size]) != base_crc:
+        raise ValueError('base mismatch')
+
+    out = bytearray()
+    pos = struct.calcsize(HEADER_FORMAT)
+    while len(out) < output_size:
+        op = encoded[pos]
+        if op == OP_LITERAL:
+            length = struct.unpack_from('<H', encoded, pos + 1)[0]
+            out += encoded[pos + 3:pos + 3 + length]
+            pos += 3 + length
+        elif op == OP_COPY_BASE:
+            offset, length = struct.unpack_from('<IH', encoded, pos + 1)
+            if offset + length > base_size:
+                raise ValueError('copy outside of the base')
+            out += base[offset:offset + length]
+            pos += 7
+        elif op == OP_COPY_OUTPUT:
+            distance, length = struct.unpack_from('<HH', encoded, pos + 1)
+            if distance == 0 or distance > WINDOW_SIZE or distance > len(out):
+                raise ValueError('copy outside of the window')
+            for _ in range(length):
+                out.append(out[-distance])
+            pos += 5
+        else:
+            raise ValueError('unknown operation 0x%02x' % op)
+    if len(out) != output_size or pos != len(encoded):
+        raise ValueError('size mismatch')
+    return bytes(out)
+
+
+def benchmark(base, target):
+    """ Prints the size of each encoding of the target. """
+    modes = [('compressed', b'', True)]
+    if base:
+        modes = [('delta', base, False), ('delta+compressed', base, True)] + modes
+    print('%-18s %10s %8s %8s %10s %10s' % ('encoding', 'bytes', 'ratio', 'blocks', 'encode s', 'decode s'))
+    print('%-18s %10d %7.1f%% %8d' % ('image', len(target), 100.0, math.ceil(len(target) / STREAM_BLOCK_SIZE)))
+    for name, mode_base, compress in modes:
+        start = time.perf_counter()
+        encoded = encode(mode_base, target, compress)
+        encode_time = time.perf_counter() - start
+        start = time.perf_counter()
+        if decode(encoded, mode_base) != target:
+            raise ValueError('%s does not decode to the target' % name)
+        decode_time = time.perf_counter() - start
+        print('%-18s %10d %7.1f%% %8d %10.2f %10.2f' %
+              (name, len(encoded), 100.0 * len(encoded) / max(len(target), 1),
+               math.ceil(len(encoded) / STREAM_BLOCK_SIZE), encode_time, decode_time))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Create an encoded OTA file.')
+    parser.add_argument('--base', help='RSU file of the running image, creates a delta file')
+    parser.add_argument('--target', required=True, help='RSU file of the new image')
+    parser.add_argument('-o', '--output', help='encoded OTA file')
+    parser.add_argument('--compress', action='store_true', help='compress the parts not copied from the base')
+    parser.add_argument('--verify', action='store_true', help='decode the output and compare it with the target')
+    parser.add_argument('--benchmark', action='store_true', help='compare the encodings of the target')
+    args = parser.parse_args()
+
+    base = b''
+    if args.base:
+        base_file = load_ota_file(args.base)
+        base = base_file[:copyable_size(base_file)]
+    target = load_ota_file(args.target)
+
+    if args.benchmark:
+        benchmark(base, target)
+        return 0
+
+    if not args.output or not (args.base or args.compress):
+        parser.error('-o and at least one of --base and --compress are required')
+
+    encoded = encode(base, target, args.compress)
+
+    if args.verify and decode(encoded, base) != target:
+        print('verify failed', file=sys.stderr)
+        return 1
+
+    with open(args.output, 'wb') as f:
+        f.write(encoded)
+
+    print('target %d bytes, encoded %d bytes (%.1f%%)' %
+          (len(target), len(encoded), 100.0 * len(encoded) / max(len(target), 1)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())